@@ -0,0 +1,501 @@
+/*
+ * alog.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _ALOG_H_
+#define _ALOG_H_
+
+/* ************************
+ * 异步日志：
+ * 	- 每个线程第一次写日志时创建自己的环形缓冲区（单生产者/单消费者，无锁），
+ * 	  写日志只是把一条二进制记录（时间戳、级别、消息或原始字节）拷贝进环形缓冲区，
+ * 	  不持有stdio的锁，也不调用write()
+ * 	- 后台线程定期取出所有线程的记录，格式化时间和级别、把原始字节转成十六进制，
+ * 	  再成批地write()到输出的fd
+ * 	- 缓冲区满时丢弃新的记录并计数，绝不阻塞写日志的线程
+ * 	- 日志级别在运行时设置（alog_set_level()或环境变量ALOG_LEVEL），
+ * 	  被关闭的级别只有一次比较和分支，参数不会被求值
+ *
+ * 同一线程的日志按顺序输出，不同线程之间的日志不保证按时间排序。
+ * alog_init()之前（或alog_shutdown()之后）写的日志直接同步输出到stderr。
+ * 只在程序中包含一次（所有函数都是static inline，状态是static的）。
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <errno.h>
+
+enum ALOG_LEVEL
+{
+	ALOG_OFF = 0,
+	ALOG_ERROR,
+	ALOG_WARN,
+	ALOG_INFO,
+	ALOG_DEBUG,
+	ALOG_TRACE,
+};
+
+#define ALOG_RING_SIZE (128 * 1024)	// per thread, power of 2
+#define ALOG_MAX_MSG (512)	// longer messages are truncated
+#define ALOG_FLUSH_MS (10)	// background thread polling interval when idle
+#define ALOG_OUT_BUF_SIZE (64 * 1024)
+
+enum ALOG_RECORD_TYPE
+{
+	ALOG_RECORD_PAD = 0,	// skip to the start of the ring
+	ALOG_RECORD_TEXT,		// message
+	ALOG_RECORD_HEX,		// message followed by raw bytes
+};
+
+// 记录按16字节对齐，环形缓冲区尾部剩余的空间总能放下一个PAD记录头
+typedef struct alog_record
+{
+	uint32_t length;	// including this header, multiple of 16
+	uint16_t level;
+	uint16_t type;
+	uint64_t timestamp_ns;	// CLOCK_REALTIME
+	unsigned char data[];
+}alog_record_t;
+
+typedef struct alog_ring
+{
+	struct alog_ring * next;
+	int tid;
+	int closed;		// owner thread exited, freed by the background thread once drained
+	char name[16];
+	uint64_t dropped;	// written by the owner thread
+	uint64_t dropped_reported;	// background thread only
+
+	uint64_t head __attribute__((aligned(64)));	// written by the owner thread
+	uint64_t tail __attribute__((aligned(64)));	// written by the background thread
+	unsigned char data[ALOG_RING_SIZE] __attribute__((aligned(64)));
+}alog_ring_t;
+
+static struct
+{
+	int level;
+	int fd;
+	int running;
+	pthread_t th;
+	pthread_mutex_t mutex;	// protects the list of rings (registration is rare)
+	alog_ring_t * rings;
+	pthread_once_t once;
+	pthread_key_t key;
+}g_alog = { ALOG_INFO, 2, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, PTHREAD_ONCE_INIT, 0 };
+
+static __thread alog_ring_t * t_alog_ring;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline int alog_get_level(void)
+{
+	return __atomic_load_n(&g_alog.level, __ATOMIC_RELAXED);
+}
+
+static inline void alog_set_level(int level)
+{
+	__atomic_store_n(&g_alog.level, level, __ATOMIC_RELAXED);
+}
+
+static inline int alog_enabled(int level)
+{
+	return __builtin_expect(level <= alog_get_level(), 0);
+}
+
+static const char * const g_alog_level_names[] = { "OFF", "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+
+// 接受级别名（不区分大小写）或数字，无法识别时返回-1
+static inline int alog_parse_level(const char * name)
+{
+	int i;
+	if(NULL == name || '\0' == name[0]) return -1;
+	if(name[0] >= '0' && name[0] <= '9')
+	{
+		i = atoi(name);
+		return (i <= ALOG_TRACE)?i:-1;
+	}
+	for(i = 0; i <= ALOG_TRACE; ++i)
+	{
+		if(0 == strcasecmp(name, g_alog_level_names[i])) return i;
+	}
+	return -1;
+}
+
+static inline void alog_thread_exit(void * param)
+{
+	alog_ring_t * ring = (alog_ring_t *)param;
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static inline void alog_key_init(void)
+{
+	pthread_key_create(&g_alog.key, alog_thread_exit);
+}
+
+static inline alog_ring_t * alog_ring_get(void)
+{
+	alog_ring_t * ring = t_alog_ring;
+	if(__builtin_expect(NULL != ring, 1)) return ring;
+
+	ring = (alog_ring_t *)aligned_alloc(64, sizeof(alog_ring_t));
+	if(NULL == ring) return NULL;
+	memset(ring, 0, offsetof(alog_ring_t, data));
+	ring->tid = (int)syscall(SYS_gettid);
+	pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+	pthread_once(&g_alog.once, alog_key_init);
+	pthread_setspecific(g_alog.key, ring);
+	pthread_mutex_lock(&g_alog.mutex);
+	ring->next = g_alog.rings;
+	g_alog.rings = ring;
+	pthread_mutex_unlock(&g_alog.mutex);
+	t_alog_ring = ring;
+	return ring;
+}
+
+// 给当前线程的日志起一个名字（最多15个字符），同时设置为线程名
+static inline void alog_set_thread_name(const char * name)
+{
+	// 缓冲区在第一次写日志时才创建，创建时读取线程名
+	pthread_setname_np(pthread_self(), name);
+	if(t_alog_ring) snprintf(t_alog_ring->name, sizeof(t_alog_ring->name), "%s", name);
+}
+
+/* ************************
+ * 在环形缓冲区中预留max_length字节（含记录头），
+ * 写完之后用alog_ring_commit()提交实际的长度
+ * */
+static inline alog_record_t * alog_ring_reserve(alog_ring_t * ring, size_t max_length)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t pos = (size_t)(head & (ALOG_RING_SIZE - 1));
+	size_t contiguous = ALOG_RING_SIZE - pos;
+	size_t needed;
+
+	max_length = (max_length + 15) & ~(size_t)15;
+	needed = (max_length > contiguous)?(contiguous + max_length):max_length;
+	if(ALOG_RING_SIZE - (size_t)(head - tail) < needed)
+	{
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if(max_length > contiguous)
+	{
+		alog_record_t * pad = (alog_record_t *)&ring->data[pos];
+		pad->length = (uint32_t)contiguous;
+		pad->type = ALOG_RECORD_PAD;
+		head += contiguous;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		pos = 0;
+	}
+	return (alog_record_t *)&ring->data[pos];
+}
+
+static inline void alog_ring_commit(alog_ring_t * ring, alog_record_t * record, size_t length)
+{
+	record->length = (uint32_t)((length + 15) & ~(size_t)15);
+	__atomic_store_n(&ring->head, ring->head + record->length, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t alog_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ************************
+ * 写一条日志。一般通过alog_error()/alog_info()等宏调用，由宏先判断级别。
+ * data != NULL时，在消息之后附加length字节的原始数据，由后台线程格式化成十六进制。
+ * HEX记录的布局: uint32_t 数据长度, 原始数据, 消息('\0'结尾)
+ * */
+static inline void alog_write_hex(int level, const void * data, size_t length, const char * fmt, ...) __attribute__((format(printf, 4, 5)));
+static inline void alog_write_hex(int level, const void * data, size_t length, const char * fmt, ...)
+{
+	va_list args;
+	alog_ring_t * ring = NULL;
+	alog_record_t * record = NULL;
+	size_t offset = 0;
+	size_t i;
+	int cb;
+
+	if(__atomic_load_n(&g_alog.running, __ATOMIC_ACQUIRE)) ring = alog_ring_get();
+	if(NULL == ring)
+	{
+		// 没有后台线程：同步输出
+		va_start(args, fmt);
+		fprintf(stderr, "%-5s ", g_alog_level_names[level]);
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		if(data)
+		{
+			fprintf(stderr, ":");
+			for(i = 0; i < length; ++i) fprintf(stderr, " %.2x", ((const unsigned char *)data)[i]);
+		}
+		fputc('\n', stderr);
+		return;
+	}
+
+	if(length > ALOG_MAX_MSG) length = ALOG_MAX_MSG;
+	if(data) offset = sizeof(uint32_t) + length;
+	record = alog_ring_reserve(ring, sizeof(alog_record_t) + offset + ALOG_MAX_MSG + 1);
+	if(NULL == record) return;
+	record->level = (uint16_t)level;
+	record->type = data?ALOG_RECORD_HEX:ALOG_RECORD_TEXT;
+	record->timestamp_ns = alog_now_ns();
+	if(data)
+	{
+		uint32_t raw_length = (uint32_t)length;
+		memcpy(record->data, &raw_length, sizeof(raw_length));
+		memcpy(record->data + sizeof(raw_length), data, length);
+	}
+
+	va_start(args, fmt);
+	cb = vsnprintf((char *)record->data + offset, ALOG_MAX_MSG + 1, fmt, args);
+	va_end(args);
+	if(cb < 0) cb = 0;
+	if(cb > ALOG_MAX_MSG) cb = ALOG_MAX_MSG;
+	alog_ring_commit(ring, record, sizeof(alog_record_t) + offset + (size_t)cb + 1);
+}
+
+#define alog_log(level, fmt, ...) do { \
+		if(alog_enabled(level)) alog_write_hex(level, NULL, 0, fmt, ##__VA_ARGS__); \
+	}while(0)
+
+#define alog_error(fmt, ...) alog_log(ALOG_ERROR, fmt, ##__VA_ARGS__)
+#define alog_warn(fmt, ...) alog_log(ALOG_WARN, fmt, ##__VA_ARGS__)
+#define alog_info(fmt, ...) alog_log(ALOG_INFO, fmt, ##__VA_ARGS__)
+#define alog_debug(fmt, ...) alog_log(ALOG_DEBUG, fmt, ##__VA_ARGS__)
+#define alog_trace(fmt, ...) alog_log(ALOG_TRACE, fmt, ##__VA_ARGS__)
+
+// 消息后附加原始字节的十六进制，例如: alog_hexdump(ALOG_DEBUG, buf, len, "packet from [%d]", id)
+#define alog_hexdump(level, data, length, fmt, ...) do { \
+		if(alog_enabled(level)) alog_write_hex(level, data, length, fmt, ##__VA_ARGS__); \
+	}while(0)
+
+/* ************************
+ * 后台线程：取出所有线程的记录，格式化到输出缓冲区，满了或者一轮结束时write()
+ * */
+typedef struct alog_output
+{
+	size_t used;
+	time_t last_sec;
+	char timestr[32];
+	char buf[ALOG_OUT_BUF_SIZE];
+}alog_output_t;
+
+static inline void alog_output_flush(alog_output_t * out)
+{
+	size_t offset = 0;
+	while(offset < out->used)
+	{
+		ssize_t cb = write(g_alog.fd, out->buf + offset, out->used - offset);
+		if(cb <= 0)
+		{
+			if(cb < 0 && EINTR == errno) continue;
+			break;	// 输出出错时丢弃，不能影响业务线程
+		}
+		offset += (size_t)cb;
+	}
+	out->used = 0;
+}
+
+// 每一行最长: 前缀 + ALOG_MAX_MSG + 3 * ALOG_MAX_MSG（十六进制）
+#define ALOG_MAX_LINE (128 + 4 * ALOG_MAX_MSG)
+
+static inline void alog_format(alog_output_t * out, const alog_ring_t * ring, const alog_record_t * record)
+{
+	const char * msg = (const char *)record->data;
+	const unsigned char * raw = NULL;
+	uint32_t raw_length = 0;
+	uint32_t i;
+	time_t sec = (time_t)(record->timestamp_ns / 1000000000);
+	char * p;
+
+	if(out->used + ALOG_MAX_LINE > sizeof(out->buf)) alog_output_flush(out);
+	if(sec != out->last_sec)
+	{
+		struct tm tm;
+		localtime_r(&sec, &tm);
+		strftime(out->timestr, sizeof(out->timestr), "%Y-%m-%d %H:%M:%S", &tm);
+		out->last_sec = sec;
+	}
+	if(ALOG_RECORD_HEX == record->type)
+	{
+		memcpy(&raw_length, record->data, sizeof(raw_length));
+		raw = record->data + sizeof(raw_length);
+		msg = (const char *)raw + raw_length;
+	}
+
+	p = out->buf + out->used;
+	p += sprintf(p, "%s.%06lu %-5s [%s] %s", out->timestr,
+		(unsigned long)(record->timestamp_ns % 1000000000 / 1000),
+		g_alog_level_names[(record->level <= ALOG_TRACE)?record->level:0],
+		ring->name[0]?ring->name:"-", msg);
+	if(raw)
+	{
+		static const char hex[] = "0123456789abcdef";
+		*p++ = ':';
+		for(i = 0; i < raw_length; ++i)
+		{
+			*p++ = ' ';
+			*p++ = hex[raw[i] >> 4];
+			*p++ = hex[raw[i] & 0x0f];
+		}
+	}
+	*p++ = '\n';
+	out->used = (size_t)(p - out->buf);
+}
+
+// 取出一个环形缓冲区中的全部记录，返回处理的记录数
+static inline size_t alog_ring_drain(alog_ring_t * ring, alog_output_t * out)
+{
+	size_t count = 0;
+	uint64_t tail = ring->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	while(tail != head)
+	{
+		const alog_record_t * record = (const alog_record_t *)&ring->data[tail & (ALOG_RING_SIZE - 1)];
+		if(ALOG_RECORD_PAD != record->type)
+		{
+			alog_format(out, ring, record);
+			++count;
+		}
+		tail += record->length;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	if(dropped != ring->dropped_reported)
+	{
+		if(out->used + ALOG_MAX_LINE > sizeof(out->buf)) alog_output_flush(out);
+		out->used += sprintf(out->buf + out->used, "%s WARN  [%s] %lu log records dropped\n",
+			out->timestr, ring->name[0]?ring->name:"-", (unsigned long)(dropped - ring->dropped_reported));
+		ring->dropped_reported = dropped;
+	}
+	return count;
+}
+
+// 处理所有线程的记录，释放已经退出并且处理完的线程的缓冲区
+static inline size_t alog_drain_all(alog_output_t * out)
+{
+	size_t count = 0;
+	alog_ring_t ** pp;
+	pthread_mutex_lock(&g_alog.mutex);
+	pp = &g_alog.rings;
+	while(*pp)
+	{
+		alog_ring_t * ring = *pp;
+		int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+		count += alog_ring_drain(ring, out);
+		if(closed && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		{
+			*pp = ring->next;
+			free(ring);
+			continue;
+		}
+		pp = &ring->next;
+	}
+	pthread_mutex_unlock(&g_alog.mutex);
+	alog_output_flush(out);
+	return count;
+}
+
+static inline void * alog_thread(void * param)
+{
+	alog_output_t * out = (alog_output_t *)param;
+	struct timespec ts = {0, ALOG_FLUSH_MS * 1000000};
+	while(__atomic_load_n(&g_alog.running, __ATOMIC_ACQUIRE))
+	{
+		// 有数据时立即再处理一轮，没有数据时才休眠
+		if(0 == alog_drain_all(out)) nanosleep(&ts, NULL);
+	}
+	alog_drain_all(out);
+	free(out);
+	return NULL;
+}
+
+/* ************************
+ * 启动后台线程，日志输出到fd，环境变量ALOG_LEVEL优先于level参数
+ * */
+static inline int alog_init(int fd, int level)
+{
+	int rc;
+	alog_output_t * out;
+	const char * env = getenv("ALOG_LEVEL");
+	if(env && alog_parse_level(env) >= 0) level = alog_parse_level(env);
+	alog_set_level(level);
+	if(g_alog.running) return 0;
+
+	out = (alog_output_t *)calloc(1, sizeof(alog_output_t));
+	if(NULL == out) return -1;
+	g_alog.fd = fd;
+	__atomic_store_n(&g_alog.running, 1, __ATOMIC_RELEASE);
+
+	// 后台线程屏蔽所有信号，信号只交给程序自己的线程处理
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&g_alog.th, NULL, alog_thread, out);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(rc)
+	{
+		__atomic_store_n(&g_alog.running, 0, __ATOMIC_RELEASE);
+		free(out);
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+// 输出所有尚未输出的日志，停止后台线程
+static inline void alog_shutdown(void)
+{
+	if(!__atomic_load_n(&g_alog.running, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&g_alog.running, 0, __ATOMIC_RELEASE);
+	pthread_join(g_alog.th, NULL);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
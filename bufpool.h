@@ -0,0 +1,237 @@
+/*
+ * bufpool.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+/* ************************
+ * 带引用计数的固定大小缓冲区池：
+ * 	- 缓冲区按cache line对齐，用完后回到池中的空闲链表，不还给系统
+ * 	- buf_slice_t是缓冲区中一段数据的视图，
+ * 	  把slice交给发送队列或协议处理函数时只增加引用计数，不需要memcpy
+ * 	- 最后一个引用释放时缓冲区自动回到池中
+ *
+ * 超过buf_size的请求（buffer_pool_get_size()）单独分配，释放时直接还给系统。
+ *
+ * 引用计数不是原子操作：每个reactor拥有自己的池，
+ * 缓冲区只能在所属的线程中引用和释放。
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BUFPOOL_ALIGN (64)
+
+struct buffer_pool;
+typedef struct pool_buf
+{
+	struct buffer_pool * pool;
+	struct pool_buf * next_free;
+	size_t size;
+	int refs;
+	unsigned char data[] __attribute__((aligned(BUFPOOL_ALIGN)));
+}pool_buf_t;
+
+typedef struct buf_slice
+{
+	pool_buf_t * buf;
+	size_t offset;
+	size_t length;
+}buf_slice_t;
+
+typedef struct buffer_pool
+{
+	size_t buf_size;
+	pool_buf_t * free_list;
+	size_t num_free;
+	size_t num_bufs;	// allocated from the system
+
+	// statistics
+	size_t gets;
+	size_t hits;		// served from free_list
+	size_t in_use;
+	size_t high_water;	// max in_use
+	size_t oversized;	// buffers larger than buf_size, allocated and freed directly
+}buffer_pool_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline pool_buf_t * buffer_pool_alloc_buf(buffer_pool_t * pool)
+{
+	pool_buf_t * buf = (pool_buf_t *)aligned_alloc(BUFPOOL_ALIGN, sizeof(pool_buf_t) + pool->buf_size);
+	if(NULL == buf) return NULL;
+	buf->pool = pool;
+	buf->next_free = NULL;
+	buf->size = pool->buf_size;
+	buf->refs = 0;
+	++pool->num_bufs;
+	return buf;
+}
+
+/* ************************
+ * buf_size会向上取整到BUFPOOL_ALIGN的整数倍，
+ * prealloc个缓冲区在初始化时一次性分配
+ * */
+static inline int buffer_pool_init(buffer_pool_t * pool, size_t buf_size, size_t prealloc)
+{
+	size_t i;
+	assert(NULL != pool && buf_size > 0);
+	memset(pool, 0, sizeof(*pool));
+	pool->buf_size = (buf_size + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+	for(i = 0; i < prealloc; ++i)
+	{
+		pool_buf_t * buf = buffer_pool_alloc_buf(pool);
+		if(NULL == buf) return -1;
+		buf->next_free = pool->free_list;
+		pool->free_list = buf;
+		++pool->num_free;
+	}
+	return 0;
+}
+
+static inline void buffer_pool_destroy(buffer_pool_t * pool)
+{
+	pool_buf_t * buf = pool->free_list;
+	while(buf)
+	{
+		pool_buf_t * next = buf->next_free;
+		free(buf);
+		buf = next;
+	}
+	pool->free_list = NULL;
+	pool->num_free = 0;
+}
+
+// 返回的缓冲区引用计数为1
+static inline pool_buf_t * buffer_pool_get(buffer_pool_t * pool)
+{
+	pool_buf_t * buf = pool->free_list;
+	++pool->gets;
+	if(buf)
+	{
+		pool->free_list = buf->next_free;
+		--pool->num_free;
+		++pool->hits;
+	}else
+	{
+		buf = buffer_pool_alloc_buf(pool);
+		if(NULL == buf) return NULL;
+	}
+	buf->next_free = NULL;
+	buf->refs = 1;
+	if(++pool->in_use > pool->high_water) pool->high_water = pool->in_use;
+	return buf;
+}
+
+// size > buf_size时单独分配一块缓冲区，不进入空闲链表
+static inline pool_buf_t * buffer_pool_get_size(buffer_pool_t * pool, size_t size)
+{
+	pool_buf_t * buf;
+	if(size <= pool->buf_size) return buffer_pool_get(pool);
+	size = (size + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+	buf = (pool_buf_t *)aligned_alloc(BUFPOOL_ALIGN, sizeof(pool_buf_t) + size);
+	if(NULL == buf) return NULL;
+	buf->pool = pool;
+	buf->next_free = NULL;
+	buf->size = size;
+	buf->refs = 1;
+	++pool->oversized;
+	return buf;
+}
+
+static inline pool_buf_t * pool_buf_ref(pool_buf_t * buf)
+{
+	assert(buf->refs > 0);
+	++buf->refs;
+	return buf;
+}
+
+static inline void pool_buf_unref(pool_buf_t * buf)
+{
+	buffer_pool_t * pool;
+	if(NULL == buf) return;
+	assert(buf->refs > 0);
+	if(--buf->refs) return;
+
+	pool = buf->pool;
+	if(buf->size != pool->buf_size)
+	{
+		free(buf);
+		return;
+	}
+	buf->next_free = pool->free_list;
+	pool->free_list = buf;
+	++pool->num_free;
+	--pool->in_use;
+}
+
+static inline buf_slice_t buf_slice_make(pool_buf_t * buf, size_t offset, size_t length)
+{
+	buf_slice_t slice;
+	assert(offset + length <= buf->size);
+	slice.buf = pool_buf_ref(buf);
+	slice.offset = offset;
+	slice.length = length;
+	return slice;
+}
+
+static inline unsigned char * buf_slice_data(const buf_slice_t * slice)
+{
+	return slice->buf->data + slice->offset;
+}
+
+static inline void buf_slice_release(buf_slice_t * slice)
+{
+	pool_buf_unref(slice->buf);
+	slice->buf = NULL;
+	slice->length = 0;
+}
+
+static inline void buffer_pool_report(const buffer_pool_t * pool, FILE * fp, const char * name)
+{
+	fprintf(fp, "%s: buf_size=%lu gets=%lu hit_rate=%.2f%% in_use=%lu high_water=%lu allocated=%lu (%lu KB) oversized=%lu\n",
+		name?name:"buffer_pool",
+		(unsigned long)pool->buf_size,
+		(unsigned long)pool->gets,
+		pool->gets?(100.0 * (double)pool->hits / (double)pool->gets):100.0,
+		(unsigned long)pool->in_use,
+		(unsigned long)pool->high_water,
+		(unsigned long)pool->num_bufs,
+		(unsigned long)(pool->num_bufs * (sizeof(pool_buf_t) + pool->buf_size) / 1024),
+		(unsigned long)pool->oversized);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
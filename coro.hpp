@@ -0,0 +1,629 @@
+/*
+ * coro.hpp
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _CORO_HPP_
+#define _CORO_HPP_
+
+/* ************************
+ * C++20协程的连接处理层（header-only）：
+ * 	coro::task<> handle(coro::conn & c)
+ * 	{
+ * 		char buf[4096];
+ * 		ssize_t n;
+ * 		while((n = co_await c.read(buf, sizeof(buf))) > 0)
+ * 		{
+ * 			if(co_await c.write(buf, n) < 0) break;
+ * 		}
+ * 	}
+ * 
+ * 结构与echoserv的epoll backend相同：每个reactor线程有自己的epoll实例和SO_REUSEPORT侦听socket，
+ * 连接在哪个reactor上建立就一直由它处理。连接注册一次EPOLLIN | EPOLLOUT | EPOLLET，之后不再调用epoll_ctl：
+ * 	- co_await c.read()/c.write()先直接尝试IO，能完成（包括出错）就不挂起；
+ * 	- 遇到EAGAIN时awaiter本身（在协程帧里）挂到conn上，reactor在事件到来时代为完成IO，
+ * 	  然后直接在reactor线程中恢复协程，一直运行到它下一次挂起。
+ * 协程帧由operator new从当前reactor的frame_pool中分配（按2的幂分级的slab，见slab.h），
+ * 建立连接和co_await子任务都不调用malloc；co_await read()/write()本身不分配任何内存。
+ * 
+ * 约定：
+ * 	- 不使用异常，协程中抛出异常直接abort()；帧分配失败时task为空，co_await一个空task立即返回T{}
+ * 	- task是惰性的，co_await时才开始执行，子任务结束后用对称转移直接恢复等待者，不增加栈深度
+ * 	- 同一个conn同时最多有一个read和一个write在等待
+ * 	- handler返回后连接被关闭；conn对象在这一批事件处理完后才释放
+ * */
+
+#include <coroutine>
+#include <span>
+#include <utility>
+#include <type_traits>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "slab.h"
+#include "metrics.h"
+
+namespace coro
+{
+
+/* ************************
+ * 协程帧的分配器：64字节到64KB按2的幂分为11级，每级一个slab_cache_t，
+ * 更大的帧（例如局部变量中有很大的数组）退回malloc()并计数。
+ * 每个reactor一个，不是线程安全的；帧总是在所属reactor的线程中创建和销毁。
+ * */
+class frame_pool
+{
+public:
+	static constexpr size_t MIN_SHIFT = 6;
+	static constexpr size_t NUM_CLASSES = 11;
+	
+	frame_pool() noexcept
+	{
+		for(size_t k = 0; k < NUM_CLASSES; ++k)
+		{
+			size_t size = (size_t)1 << (MIN_SHIFT + k);
+			slab_cache_init(&m_caches[k], size, (size < 4096)?(65536 / size):16);
+		}
+	}
+	~frame_pool()
+	{
+		for(size_t k = 0; k < NUM_CLASSES; ++k) slab_cache_destroy(&m_caches[k]);
+	}
+	frame_pool(const frame_pool &) = delete;
+	frame_pool & operator=(const frame_pool &) = delete;
+	
+	void * alloc(size_t size) noexcept
+	{
+		int k = size_class(size);
+		if(k < 0)
+		{
+			++m_oversized;
+			return malloc(size);
+		}
+		return slab_alloc(&m_caches[k]);
+	}
+	void free(void * ptr, size_t size) noexcept
+	{
+		int k = size_class(size);
+		if(k < 0) ::free(ptr);
+		else slab_free(&m_caches[k], ptr);
+	}
+	
+	void report(FILE * fp, const char * name) const
+	{
+		fprintf(fp, "%s:", name);
+		for(size_t k = 0; k < NUM_CLASSES; ++k)
+		{
+			if(0 == m_caches[k].high_water) continue;
+			fprintf(fp, " %lu=%lu/%lu", (unsigned long)m_caches[k].obj_size, 
+				(unsigned long)m_caches[k].in_use, (unsigned long)m_caches[k].high_water);
+		}
+		fprintf(fp, " (size=in_use/high_water) oversized=%lu\n", (unsigned long)m_oversized);
+	}
+	
+private:
+	static int size_class(size_t size) noexcept
+	{
+		size_t k = 0;
+		while(((size_t)1 << (MIN_SHIFT + k)) < size)
+		{
+			if(++k == NUM_CLASSES) return -1;
+		}
+		return (int)k;
+	}
+	
+	slab_cache_t m_caches[NUM_CLASSES];
+	size_t m_oversized = 0;
+};
+
+// 当前线程（reactor）的帧分配器，不在reactor线程中创建的协程使用malloc()
+inline thread_local frame_pool * t_frame_pool = nullptr;
+
+template<typename T = void> class task;
+
+namespace detail
+{
+
+struct promise_base
+{
+	std::coroutine_handle<> continuation;	// co_await这个task的协程
+	bool detached = false;	// 顶层任务，结束时自己销毁
+	
+	static void * operator new(size_t size) noexcept
+	{
+		return t_frame_pool?t_frame_pool->alloc(size):malloc(size);
+	}
+	static void operator delete(void * ptr, size_t size) noexcept
+	{
+		if(t_frame_pool) t_frame_pool->free(ptr, size);
+		else free(ptr);
+	}
+	
+	struct final_awaiter
+	{
+		bool await_ready() noexcept { return false; }
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			promise_base & p = h.promise();
+			if(p.continuation) return p.continuation;
+			if(p.detached) h.destroy();
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { abort(); }
+};
+
+template<typename T>
+struct promise : promise_base
+{
+	T value{};
+	task<T> get_return_object() noexcept;
+	static task<T> get_return_object_on_allocation_failure() noexcept { return task<T>(); }
+	void return_value(T v) noexcept { value = std::move(v); }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+	task<void> get_return_object() noexcept;
+	static task<void> get_return_object_on_allocation_failure() noexcept;
+	void return_void() noexcept {}
+};
+
+}
+
+template<typename T>
+class task
+{
+public:
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+	
+	task() noexcept = default;
+	explicit task(handle_type h) noexcept : m_handle(h) {}
+	task(task && other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+	task & operator=(task && other) noexcept
+	{
+		if(this != &other)
+		{
+			if(m_handle) m_handle.destroy();
+			m_handle = std::exchange(other.m_handle, {});
+		}
+		return *this;
+	}
+	~task()
+	{
+		if(m_handle) m_handle.destroy();
+	}
+	task(const task &) = delete;
+	task & operator=(const task &) = delete;
+	
+	explicit operator bool() const noexcept { return (bool)m_handle; }
+	
+	auto operator co_await() const noexcept
+	{
+		struct awaiter
+		{
+			handle_type h;
+			bool await_ready() noexcept { return !h || h.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				h.promise().continuation = caller;
+				return h;
+			}
+			T await_resume() noexcept
+			{
+				if constexpr(!std::is_void_v<T>) return h?std::move(h.promise().value):T{};
+			}
+		};
+		return awaiter{m_handle};
+	}
+	
+	// 顶层任务：交出帧的所有权，运行到第一次挂起为止，结束时自己销毁
+	void start_detached() noexcept
+	{
+		handle_type h = std::exchange(m_handle, {});
+		if(!h) return;
+		h.promise().detached = true;
+		h.resume();
+	}
+	
+private:
+	handle_type m_handle;
+};
+
+namespace detail
+{
+
+template<typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object_on_allocation_failure() noexcept
+{
+	return task<void>();
+}
+
+}
+
+class reactor;
+
+/* ************************
+ * 一个连接：read()/write()返回awaitable，
+ * 	read   有数据就返回：> 0 读到的字节数，0 对端关闭，< 0 -errno
+ * 	write  全部写完才返回：写入的字节数，出错时 < 0 (-errno)
+ * */
+class conn
+{
+public:
+	conn(reactor * r, int fd) noexcept : m_reactor(r), m_fd(fd) {}
+	conn(const conn &) = delete;
+	conn & operator=(const conn &) = delete;
+	
+	int fd() const noexcept { return m_fd; }
+	reactor & owner() const noexcept { return *m_reactor; }
+	
+	struct read_awaiter
+	{
+		conn * c;
+		void * buf;
+		size_t size;
+		ssize_t result;
+		std::coroutine_handle<> waiter;
+		
+		bool await_ready() noexcept
+		{
+			result = c->try_read(buf, size);
+			return -EAGAIN != result;
+		}
+		void await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			waiter = h;
+			c->m_reader = this;
+		}
+		ssize_t await_resume() noexcept { return result; }
+	};
+	
+	struct write_awaiter
+	{
+		conn * c;
+		const char * data;
+		size_t size;
+		size_t done;
+		ssize_t result;
+		std::coroutine_handle<> waiter;
+		
+		bool await_ready() noexcept { return c->try_write(this); }
+		void await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			waiter = h;
+			c->m_writer = this;
+		}
+		ssize_t await_resume() noexcept { return result; }
+	};
+	
+	read_awaiter read(void * buf, size_t size) noexcept { return read_awaiter{this, buf, size, 0, {}}; }
+	read_awaiter read(std::span<std::byte> buf) noexcept { return read(buf.data(), buf.size()); }
+	write_awaiter write(const void * data, size_t size) noexcept
+	{
+		return write_awaiter{this, (const char *)data, size, 0, 0, {}};
+	}
+	write_awaiter write(std::span<const std::byte> data) noexcept { return write(data.data(), data.size()); }
+	
+	// 读满size字节：返回size，对端提前关闭时返回已经读到的字节数，出错时 < 0
+	task<ssize_t> read_exact(void * buf, size_t size) noexcept
+	{
+		size_t got = 0;
+		while(got < size)
+		{
+			ssize_t n = co_await read((char *)buf + got, size - got);
+			if(n < 0) co_return n;
+			if(0 == n) break;
+			got += n;
+		}
+		co_return (ssize_t)got;
+	}
+	
+private:
+	friend class reactor;
+	
+	ssize_t try_read(void * buf, size_t size) noexcept
+	{
+		ssize_t n;
+		do
+		{
+			n = ::read(m_fd, buf, size);
+		}while(-1 == n && EINTR == errno);
+		if(-1 == n) return (EWOULDBLOCK == errno)?-EAGAIN:-errno;
+		return n;
+	}
+	
+	// 写完或者出错时返回true，结果在op->result中
+	bool try_write(write_awaiter * op) noexcept
+	{
+		while(op->done < op->size)
+		{
+			ssize_t n = ::send(m_fd, op->data + op->done, op->size - op->done, MSG_NOSIGNAL);
+			if(n >= 0)
+			{
+				op->done += n;
+				continue;
+			}
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno) return false;
+			op->result = -errno;
+			return true;
+		}
+		op->result = (ssize_t)op->done;
+		return true;
+	}
+	
+	// 由reactor在事件到来时调用，完成等待中的IO后恢复协程
+	void on_readable() noexcept
+	{
+		read_awaiter * op = m_reader;
+		if(NULL == op) return;
+		op->result = try_read(op->buf, op->size);
+		if(-EAGAIN == op->result) return;
+		m_reader = NULL;
+		op->waiter.resume();
+	}
+	void on_writable() noexcept
+	{
+		write_awaiter * op = m_writer;
+		if(NULL == op || !try_write(op)) return;
+		m_writer = NULL;
+		op->waiter.resume();
+	}
+	
+	reactor * m_reactor;
+	int m_fd;
+	bool m_closed = false;
+	read_awaiter * m_reader = NULL;
+	write_awaiter * m_writer = NULL;
+	conn * m_next_closed = NULL;
+};
+
+typedef task<> (*handler_t)(conn & c);
+
+/* ************************
+ * 每个reactor线程的事件循环：
+ * 侦听socket的data.ptr为NULL，连接的data.ptr指向conn；
+ * handler结束后立即关闭fd，conn对象挂到m_closed上，这一批事件处理完再释放，
+ * 同一批中后面的事件不会访问到已经释放的conn。
+ * */
+class reactor
+{
+public:
+	static constexpr int MAX_EVENTS = 64;
+	static constexpr size_t CONNS_PER_SLAB = 256;
+	
+	reactor() noexcept
+	{
+		slab_cache_init(&m_conn_slab, sizeof(conn), CONNS_PER_SLAB);
+	}
+	~reactor()
+	{
+		slab_cache_destroy(&m_conn_slab);
+	}
+	reactor(const reactor &) = delete;
+	reactor & operator=(const reactor &) = delete;
+	
+	// 在主线程中调用：创建epoll实例和SO_REUSEPORT侦听socket，失败时输出原因并返回-1
+	int init(int id, const char * host, const char * port, handler_t handler)
+	{
+		struct addrinfo hints, * serv_info, * p;
+		int on = 1;
+		int rc;
+		m_id = id;
+		m_handler = handler;
+		
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;	// host == NULL: any address
+		rc = getaddrinfo(host, port, &hints, &serv_info);
+		if(rc)
+		{
+			fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
+			return -1;
+		}
+		for(p = serv_info; NULL != p; p = p->ai_next)
+		{
+			m_sfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+			if(-1 == m_sfd) continue;
+			if(0 == setsockopt(m_sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+				&& 0 == bind(m_sfd, p->ai_addr, p->ai_addrlen)
+				&& 0 == listen(m_sfd, SOMAXCONN)) break;
+			perror("bind");
+			close(m_sfd);
+			m_sfd = -1;
+		}
+		freeaddrinfo(serv_info);
+		if(m_sfd < 0) return -1;
+		
+		m_efd = epoll_create1(EPOLL_CLOEXEC);
+		if(-1 == m_efd)
+		{
+			perror("epoll_create1");
+			return -1;
+		}
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(m_efd, EPOLL_CTL_ADD, m_sfd, &ev))
+		{
+			perror("epoll_ctl");
+			return -1;
+		}
+		return 0;
+	}
+	
+	static void * thread_main(void * param)
+	{
+		((reactor *)param)->run();
+		return NULL;
+	}
+	
+	void run() noexcept
+	{
+		struct epoll_event events[MAX_EVENTS];
+		t_frame_pool = &m_frames;
+		while(1)
+		{
+			int n = epoll_wait(m_efd, events, MAX_EVENTS, -1);
+			if(n < 0)
+			{
+				if(EINTR == errno) continue;
+				perror("epoll_wait");
+				break;
+			}
+			for(int i = 0; i < n; ++i)
+			{
+				conn * c = (conn *)events[i].data.ptr;
+				if(NULL == c)
+				{
+					on_accept();
+					continue;
+				}
+				// 错误和挂断也要唤醒等待者，由它们的read()/write()返回结果
+				if(!c->m_closed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) c->on_readable();
+				if(!c->m_closed && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) c->on_writable();
+			}
+			free_closed();
+		}
+		t_frame_pool = NULL;
+	}
+	
+	int id() const noexcept { return m_id; }
+	uint64_t num_conns() const noexcept { return metric_get(&m_accepts) - metric_get(&m_closes); }
+	uint64_t accepts() const noexcept { return metric_get(&m_accepts); }
+	const frame_pool & frames() const noexcept { return m_frames; }
+	
+private:
+	void on_accept() noexcept
+	{
+		while(1)
+		{
+			int fd = accept4(m_sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(-1 == fd)
+			{
+				if(EINTR == errno || ECONNABORTED == errno) continue;
+				if(EAGAIN != errno && EWOULDBLOCK != errno) perror("accept4");
+				break;
+			}
+			void * mem = slab_alloc(&m_conn_slab);
+			if(NULL == mem)
+			{
+				close(fd);
+				continue;
+			}
+			conn * c = new(mem) conn(this, fd);
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			ev.data.ptr = c;
+			if(epoll_ctl(m_efd, EPOLL_CTL_ADD, fd, &ev))
+			{
+				perror("epoll_ctl");
+				close(fd);
+				c->~conn();
+				slab_free(&m_conn_slab, c);
+				continue;
+			}
+			metric_add(&m_accepts, 1);
+			task<> t = conn_main(this, c);
+			if(t) t.start_detached();
+			else conn_close(c);	// no memory for the coroutine frame
+		}
+	}
+	
+	// 每个连接的顶层协程：运行handler，结束后关闭连接
+	static task<> conn_main(reactor * r, conn * c)
+	{
+		co_await r->m_handler(*c);
+		r->conn_close(c);
+	}
+	
+	void conn_close(conn * c) noexcept
+	{
+		c->m_closed = true;
+		close(c->m_fd);
+		c->m_next_closed = m_closed;
+		m_closed = c;
+		metric_add(&m_closes, 1);
+	}
+	
+	void free_closed() noexcept
+	{
+		while(m_closed)
+		{
+			conn * c = m_closed;
+			m_closed = c->m_next_closed;
+			c->~conn();
+			slab_free(&m_conn_slab, c);
+		}
+	}
+	
+	int m_id = 0;
+	int m_efd = -1;
+	int m_sfd = -1;
+	handler_t m_handler = NULL;
+	frame_pool m_frames;
+	slab_cache_t m_conn_slab;
+	conn * m_closed = NULL;
+	uint64_t m_accepts = 0;	// single writer (the reactor), see metrics.h
+	uint64_t m_closes = 0;
+};
+
+}
+
+#endif
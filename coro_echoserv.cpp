@@ -0,0 +1,154 @@
+/*
+ * coro_echoserv.cpp
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* ************************
+ * coro.hpp的例子：用协程写的echo服务器
+ * 	g++ -std=c++20 -o coro_echoserv coro_echoserv.cpp -lpthread
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "coro.hpp"
+#include "frame.h"
+
+#define MAX_REACTORS (64)
+#define BUFFER_SIZE (16384)
+
+static const char * g_port = "8081";
+static int g_threads = 0;
+static int g_frame_type = FRAME_NONE;
+
+static coro::task<> echo_raw(coro::conn & c)
+{
+	char buf[BUFFER_SIZE];
+	ssize_t n;
+	while((n = co_await c.read(buf, sizeof(buf))) > 0)
+	{
+		if(co_await c.write(buf, n) < 0) break;
+	}
+}
+
+// -f u32: 读完整的一帧再原样返回，大于缓冲区的帧分段转发
+static coro::task<> echo_frames(coro::conn & c)
+{
+	unsigned char buf[BUFFER_SIZE];
+	uint32_t length;
+	while(1)
+	{
+		if(co_await c.read_exact(buf, 4) != 4) break;
+		if(frame_parse_header(FRAME_U32, buf, 4, &length) < 0) break;
+		if(co_await c.write(buf, 4) < 0) break;
+		while(length > 0)
+		{
+			size_t size = (length < sizeof(buf))?length:sizeof(buf);
+			if(co_await c.read_exact(buf, size) != (ssize_t)size) co_return;
+			if(co_await c.write(std::as_bytes(std::span(buf, size))) < 0) co_return;
+			length -= size;
+		}
+	}
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-P port] [-f u32|none]\n", name);
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	static coro::reactor reactors[MAX_REACTORS];
+	pthread_t threads[MAX_REACTORS];
+	int opt;
+	int i;
+	
+	while((opt = getopt(argc, argv, "t:P:f:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 't': g_threads = atoi(optarg); break;
+		case 'P': g_port = optarg; break;
+		case 'f':
+			if(0 == strcmp(optarg, "u32")) g_frame_type = FRAME_U32;
+			else if(0 == strcmp(optarg, "none")) g_frame_type = FRAME_NONE;
+			else usage(argv[0]);
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if(g_threads <= 0) g_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(g_threads > MAX_REACTORS) g_threads = MAX_REACTORS;
+	
+	// reactor线程继承屏蔽的信号，由主线程sigwait()
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	
+	coro::handler_t handler = (FRAME_U32 == g_frame_type)?echo_frames:echo_raw;
+	for(i = 0; i < g_threads; ++i)
+	{
+		if(reactors[i].init(i, NULL, g_port, handler)) exit(1);
+	}
+	for(i = 0; i < g_threads; ++i)
+	{
+		if(pthread_create(&threads[i], NULL, coro::reactor::thread_main, &reactors[i]))
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(threads[i]);
+	}
+	printf("coro_echoserv: %d reactors on port %s (%s)\n", g_threads, g_port, 
+		(FRAME_U32 == g_frame_type)?"u32 frames":"raw");
+	fflush(stdout);
+	
+	int sig = 0;
+	sigdelset(&sigs, SIGPIPE);
+	sigwait(&sigs, &sig);
+	
+	// 不等待reactor线程退出，直接输出统计后结束进程
+	printf("\nexit on signal %d\n", sig);
+	for(i = 0; i < g_threads; ++i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "reactor %d frames", i);
+		printf("reactor %d: accepts=%lu open=%lu\n", i, 
+			(unsigned long)reactors[i].accepts(), (unsigned long)reactors[i].num_conns());
+		reactors[i].frames().report(stdout, name);
+	}
+	fflush(stdout);
+	_exit(0);	// reactors are still running, skip the static destructors
+}
@@ -0,0 +1,521 @@
+/*
+ * echobench.c
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* ************************
+ * 端到端的echo基准测试：
+ * 	1. 按参数启动一个echoserv子进程（线程数、backend、tcp或unix传输），等它开始接受连接
+ * 	2. 建立 -c 个连接，分给 -C 个客户端线程，每个线程一个epoll实例，
+ * 	   每个连接闭环地发送一条 -m 字节的消息，收齐回显并校验后立即发送下一条
+ * 	3. 预热 -w 秒后开始计数，运行 -d 秒，每个请求的延迟（发出第一个字节到收齐回显）记入HDR直方图
+ * 	4. 结束echoserv，在stdout上输出一行JSON：配置、吞吐量和延迟的百分位（纳秒）
+ * 用 -A ADDR 可以测试一个已经在运行的服务器，这时不启动echoserv。
+ * echoserv的stdout（退出时的统计）重定向到stderr，stdout上只有结果。
+ * tcp默认给echoserv加上 -N nodelay：echoserv每读到16 KB回显一次，Nagle下超过16 KB的消息
+ * 最后一小段要等客户端的delayed ACK（约40 ms），测到的就只是这个定时器了。
+ * -- 之后的 -N 可以覆盖这个默认值，实际使用的策略记在结果的tcp_policy中。
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "transport.h"
+#include "metrics.h"
+
+#define MAX_CLIENT_THREADS (64)
+#define MAX_EVENTS (256)
+#define SERVER_START_TIMEOUT_MS (5000)
+#define DEFAULT_PORT "8081"
+
+typedef struct bench_conn
+{
+	int fd;
+	size_t sent;
+	size_t received;
+	uint64_t t_start;
+	unsigned char * rbuf;
+}bench_conn_t;
+
+typedef struct bench_thread
+{
+	pthread_t th;
+	int efd;
+	int num_conns;
+	bench_conn_t * conns;
+	
+	// 只由所属线程写入
+	uint64_t requests;
+	uint64_t errors;
+	hdr_hist_t latency;
+}bench_thread_t;
+
+static const char * g_server = "./echoserv";
+static const char * g_backend = "epoll";
+static const char * g_transport = "tcp";
+static const char * g_address = NULL;	// -A: benchmark a running server
+static const char * g_tcp_policy = "";	// echoserv -N of a launched tcp server
+static int g_server_threads = 1;
+static int g_client_threads = 1;
+static int g_conns = 16;
+static size_t g_msg_size = 64;
+static int g_duration = 10;
+static int g_warmup = 1;
+static const char * g_port = DEFAULT_PORT;
+
+static unsigned char * g_payload;
+static uint64_t g_t_measure;	// 预热结束的时间
+static uint64_t g_t_stop;
+static bench_thread_t g_threads[MAX_CLIENT_THREADS];
+
+static inline uint64_t clock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char * prog)
+{
+	fprintf(stderr, "usage: %s [-s echoserv] [-t threads] [-b epoll|uring] [-x tcp|unix] [-P port]\n"
+		"\t\t[-A address] [-c conns] [-C client_threads] [-m bytes] [-d seconds] [-w seconds]\n"
+		"\t\t[-- echoserv options...]\n"
+		"\t-s, --server=PATH\techoserv binary to launch (default: %s)\n"
+		"\t-t, --threads=N\techoserv reactor threads (default: %d)\n"
+		"\t-b, --backend=NAME\techoserv backend: epoll (default) or uring\n"
+		"\t-x, --transport=NAME\ttcp (127.0.0.1, default) or unix (abstract AF_UNIX stream socket)\n"
+		"\t-P, --port=PORT\ttcp port (default: %s)\n"
+		"\t-A, --address=ADDR\tdo not launch echoserv, benchmark the server at ADDR (transport.h syntax)\n"
+		"\t-c, --conns=N\tconnections, each with one request in flight (default: %d)\n"
+		"\t-C, --client-threads=N\tload generator threads (default: %d)\n"
+		"\t-m, --msg-size=BYTES\tmessage size (default: %lu)\n"
+		"\t-d, --duration=SECONDS\tmeasurement time (default: %d)\n"
+		"\t-w, --warmup=SECONDS\ttime before measuring (default: %d)\n"
+		"Options after -- are passed to echoserv; over tcp it runs with -N nodelay unless -N is given.\n",
+		prog, g_server, g_server_threads, DEFAULT_PORT, g_conns, g_client_threads,
+		(unsigned long)g_msg_size, g_duration, g_warmup);
+	exit(1);
+}
+
+// 传给echoserv的参数中最后一个 -N 的值，没有时是默认的nodelay
+static const char * server_tcp_policy(char ** extra_args, int num_extra)
+{
+	const char * policy = "nodelay";
+	int i;
+	for(i = 0; i < num_extra; ++i)
+	{
+		const char * arg = extra_args[i];
+		if(0 == strcmp(arg, "--")) break;
+		if((0 == strcmp(arg, "-N") || 0 == strcmp(arg, "--tcp-policy")) && i + 1 < num_extra) policy = extra_args[++i];
+		else if(0 == strncmp(arg, "--tcp-policy=", 13)) policy = arg + 13;
+		else if(0 == strncmp(arg, "-N", 2)) policy = arg + 2;
+	}
+	return policy;
+}
+
+/* ************************
+ * 启动echoserv：-L 指定的地址，-l warn 去掉每个连接的日志，stdout重定向到stderr
+ * */
+static pid_t server_launch(const char * listen_spec, char ** extra_args, int num_extra)
+{
+	char threads[16];
+	const char * argv[32 + num_extra];
+	int argc = 0;
+	int i;
+	snprintf(threads, sizeof(threads), "%d", g_server_threads);
+	argv[argc++] = g_server;
+	argv[argc++] = "-t";
+	argv[argc++] = threads;
+	argv[argc++] = "-b";
+	argv[argc++] = g_backend;
+	argv[argc++] = "-L";
+	argv[argc++] = listen_spec;
+	argv[argc++] = "-l";
+	argv[argc++] = "warn";
+	if(*g_tcp_policy)
+	{
+		argv[argc++] = "-N";
+		argv[argc++] = "nodelay";	// -N in extra_args comes later and wins
+	}
+	for(i = 0; i < num_extra; ++i) argv[argc++] = extra_args[i];
+	argv[argc] = NULL;
+	
+	pid_t pid = fork();
+	if(-1 == pid)
+	{
+		perror("fork");
+		return -1;
+	}
+	if(0 == pid)
+	{
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv(g_server, (char * const *)argv);
+		perror(g_server);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int bench_connect(const transport_addr_t * addr, const struct addrinfo * ai)
+{
+	int fd;
+	int on = 1;
+	if(AF_UNIX == addr->family)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0) return -1;
+		if(connect(fd, (const struct sockaddr *)&addr->un, addr->un_len))
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	if(fd < 0) return -1;
+	if(connect(fd, ai->ai_addr, ai->ai_addrlen))
+	{
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+// 发送下一条消息，尽量一次写完，剩下的等EPOLLOUT
+static int conn_send(bench_conn_t * c)
+{
+	while(c->sent < g_msg_size)
+	{
+		ssize_t n = send(c->fd, g_payload + c->sent, g_msg_size - c->sent, MSG_NOSIGNAL);
+		if(n > 0)
+		{
+			c->sent += n;
+			continue;
+		}
+		if(-1 == n && EINTR == errno) continue;
+		if(-1 == n && (EAGAIN == errno || EWOULDBLOCK == errno)) return 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void conn_start(bench_thread_t * t, bench_conn_t * c)
+{
+	c->sent = 0;
+	c->received = 0;
+	c->t_start = clock_now_ns();
+	if(conn_send(c))
+	{
+		metric_add(&t->errors, 1);
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static void conn_on_event(bench_thread_t * t, bench_conn_t * c, uint32_t events)
+{
+	if(events & EPOLLOUT)
+	{
+		if(conn_send(c)) goto label_error;
+	}
+	while(c->received < g_msg_size)
+	{
+		ssize_t n = recv(c->fd, c->rbuf + c->received, g_msg_size - c->received, 0);
+		if(n > 0)
+		{
+			c->received += n;
+			continue;
+		}
+		if(-1 == n && EINTR == errno) continue;
+		if(-1 == n && (EAGAIN == errno || EWOULDBLOCK == errno)) return;
+		goto label_error;	// closed by the server
+	}
+	
+	uint64_t now = clock_now_ns();
+	if(memcmp(c->rbuf, g_payload, g_msg_size)) goto label_error;
+	if(c->t_start >= g_t_measure && now <= g_t_stop)
+	{
+		hdr_hist_record(&t->latency, now - c->t_start);
+		metric_add(&t->requests, 1);
+	}
+	if(now < g_t_stop) conn_start(t, c);
+	return;
+	
+label_error:
+	metric_add(&t->errors, 1);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void * bench_thread(void * param)
+{
+	bench_thread_t * t = param;
+	struct epoll_event events[MAX_EVENTS];
+	int i;
+	for(i = 0; i < t->num_conns; ++i) conn_start(t, &t->conns[i]);
+	while(clock_now_ns() < g_t_stop)
+	{
+		int n = epoll_wait(t->efd, events, MAX_EVENTS, 100);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			perror("epoll_wait");
+			break;
+		}
+		for(i = 0; i < n; ++i)
+		{
+			bench_conn_t * c = events[i].data.ptr;
+			if(c->fd >= 0) conn_on_event(t, c, events[i].events);
+		}
+	}
+	return NULL;
+}
+
+/* ************************
+ * 在所有客户端线程之间平均分配连接，每个连接注册一次EPOLLIN | EPOLLOUT | EPOLLET
+ * */
+static int bench_setup(const transport_addr_t * addr, uint64_t timeout_ms)
+{
+	struct addrinfo hints, * serv_info = NULL;
+	int i, k;
+	int rc;
+	if(AF_UNIX != addr->family)
+	{
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		rc = getaddrinfo(addr->host, addr->port, &hints, &serv_info);
+		if(rc)
+		{
+			fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
+			return -1;
+		}
+	}
+	
+	// 服务器刚启动时还没有开始侦听，重试到超时
+	uint64_t deadline = clock_now_ns() + timeout_ms * 1000000;
+	int fd;
+	while((fd = bench_connect(addr, serv_info)) < 0)
+	{
+		if(clock_now_ns() > deadline)
+		{
+			perror("connect");
+			if(serv_info) freeaddrinfo(serv_info);
+			return -1;
+		}
+		usleep(10000);
+	}
+	
+	for(k = 0; k < g_client_threads; ++k)
+	{
+		bench_thread_t * t = &g_threads[k];
+		t->num_conns = g_conns / g_client_threads + ((k < g_conns % g_client_threads)?1:0);
+		t->conns = calloc(t->num_conns, sizeof(*t->conns));
+		t->efd = epoll_create1(EPOLL_CLOEXEC);
+		if(NULL == t->conns || -1 == t->efd)
+		{
+			perror("bench_setup");
+			return -1;
+		}
+		for(i = 0; i < t->num_conns; ++i)
+		{
+			bench_conn_t * c = &t->conns[i];
+			if(fd < 0) fd = bench_connect(addr, serv_info);
+			if(fd < 0)
+			{
+				perror("connect");
+				return -1;
+			}
+			
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			ev.data.ptr = c;
+			c->fd = fd;
+			fd = -1;
+			c->rbuf = malloc(g_msg_size);
+			if(NULL == c->rbuf || fcntl(c->fd, F_SETFL, O_NONBLOCK)
+				|| epoll_ctl(t->efd, EPOLL_CTL_ADD, c->fd, &ev))
+			{
+				perror("bench_setup");
+				return -1;
+			}
+		}
+	}
+	if(fd >= 0) close(fd);
+	if(serv_info) freeaddrinfo(serv_info);
+	return 0;
+}
+
+static void bench_report(const char * address, double elapsed)
+{
+	static hdr_hist_t latency;
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+	int k;
+	for(k = 0; k < g_client_threads; ++k)
+	{
+		hdr_hist_merge(&latency, &g_threads[k].latency);
+		requests += metric_get(&g_threads[k].requests);
+		errors += metric_get(&g_threads[k].errors);
+	}
+	printf("{\"server\":{\"address\":\"%s\",\"backend\":\"%s\",\"threads\":%d,\"tcp_policy\":\"%s\",\"launched\":%s},"
+		"\"client\":{\"conns\":%d,\"threads\":%d,\"msg_size\":%lu,\"duration_s\":%.3f},"
+		"\"requests\":%lu,\"errors\":%lu,\"req_per_s\":%.1f,\"mb_per_s\":%.3f,\"latency_ns\":",
+		address, g_address?"":g_backend, g_address?0:g_server_threads, g_tcp_policy, g_address?"false":"true",
+		g_conns, g_client_threads, (unsigned long)g_msg_size, elapsed,
+		(unsigned long)requests, (unsigned long)errors, 
+		(double)requests / elapsed,
+		(double)requests * (double)g_msg_size / elapsed / 1e6);
+	hdr_hist_print_json(&latency, stdout);
+	printf("}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static struct option options[] = 
+	{
+		{"server", required_argument, 0, 's'},
+		{"threads", required_argument, 0, 't'},
+		{"backend", required_argument, 0, 'b'},
+		{"transport", required_argument, 0, 'x'},
+		{"port", required_argument, 0, 'P'},
+		{"address", required_argument, 0, 'A'},
+		{"conns", required_argument, 0, 'c'},
+		{"client-threads", required_argument, 0, 'C'},
+		{"msg-size", required_argument, 0, 'm'},
+		{"duration", required_argument, 0, 'd'},
+		{"warmup", required_argument, 0, 'w'},
+		{"help", no_argument, 0, 'h'},
+		{NULL, 0, 0, 0}
+	};
+	int c;
+	while(-1 != (c = getopt_long(argc, argv, "s:t:b:x:P:A:c:C:m:d:w:h", options, NULL)))
+	{
+		switch(c)
+		{
+		case 's': g_server = optarg; break;
+		case 't': g_server_threads = atoi(optarg); break;
+		case 'b': g_backend = optarg; break;
+		case 'x': g_transport = optarg; break;
+		case 'P': g_port = optarg; break;
+		case 'A': g_address = optarg; break;
+		case 'c': g_conns = atoi(optarg); break;
+		case 'C': g_client_threads = atoi(optarg); break;
+		case 'm': g_msg_size = strtoul(optarg, NULL, 0); break;
+		case 'd': g_duration = atoi(optarg); break;
+		case 'w': g_warmup = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(g_server_threads < 1 || g_conns < 1 || 0 == g_msg_size || g_duration < 1 || g_warmup < 0
+		|| g_client_threads < 1 || g_client_threads > MAX_CLIENT_THREADS
+		|| (strcmp(g_transport, "tcp") && strcmp(g_transport, "unix")))
+	{
+		usage(argv[0]);
+	}
+	if(g_client_threads > g_conns) g_client_threads = g_conns;
+	
+	// 默认的地址：tcp用127.0.0.1，unix用带pid的抽象地址，不会和其他实例冲突
+	char buf[64];
+	const char * spec = g_address;
+	if(NULL == spec)
+	{
+		if(0 == strcmp(g_transport, "unix")) snprintf(buf, sizeof(buf), "unix:@echobench-%d", (int)getpid());
+		else snprintf(buf, sizeof(buf), "tcp:127.0.0.1:%.16s", g_port);
+		spec = buf;
+	}
+	
+	transport_addr_t addr;
+	if(transport_addr_parse(&addr, spec, "127.0.0.1", DEFAULT_PORT) || SOCK_STREAM != addr.socktype)
+	{
+		fprintf(stderr, "invalid address: %s\n", spec);
+		return 1;
+	}
+	
+	g_payload = malloc(g_msg_size);
+	if(NULL == g_payload)
+	{
+		perror("malloc");
+		return 1;
+	}
+	size_t i;
+	for(i = 0; i < g_msg_size; ++i) g_payload[i] = (unsigned char)(i * 131 + 7);
+	
+	pid_t pid = -1;
+	if(NULL == g_address)
+	{
+		if(AF_UNIX != addr.family) g_tcp_policy = server_tcp_policy(argv + optind, argc - optind);
+		pid = server_launch(spec, argv + optind, argc - optind);
+		if(pid < 0) return 1;
+	}
+	
+	int rc = bench_setup(&addr, g_address?0:SERVER_START_TIMEOUT_MS);
+	if(0 == rc)
+	{
+		uint64_t t_begin = clock_now_ns();
+		g_t_measure = t_begin + (uint64_t)g_warmup * 1000000000;
+		g_t_stop = g_t_measure + (uint64_t)g_duration * 1000000000;
+		int k;
+		for(k = 0; k < g_client_threads; ++k)
+		{
+			rc = pthread_create(&g_threads[k].th, NULL, bench_thread, &g_threads[k]);
+			if(rc)
+			{
+				fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+				exit(1);
+			}
+		}
+		for(k = 0; k < g_client_threads; ++k) pthread_join(g_threads[k].th, NULL);
+		bench_report(spec, (double)g_duration);
+	}
+	
+	if(pid > 0)
+	{
+		int status = 0;
+		kill(pid, SIGINT);
+		waitpid(pid, &status, 0);
+	}
+	return rc?1:0;
+}
@@ -32,29 +32,282 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 
+#include "transport.h"
+#include "metrics.h"
+#include "trace.h"
+
 #define PORT "8031"
 #define SERV_NAME "localhost"
 
-static int client_run();
+#define MAX_LOAD_THREADS (64)
+#define MAX_EVENTS (256)
+#define MAX_WINDOW (1024)
+#define LOAD_IOV_MAX (64)		// iovecs per writev()
+#define LOAD_RECV_SIZE (65536)
+#define RECONNECT_MIN_MS (100)
+#define RECONNECT_MAX_MS (10000)
+#define SETUP_TIMEOUT_MS (5000)	// waiting for the initial connections
+#define DRAIN_TIMEOUT_MS (2000)	// waiting for the responses after each run
+
+/* ************************
+ * 开环负载（-r）：每个线程有自己的epoll实例和一组长连接，
+ * 按固定的时间表产生请求：第i个请求的预定发送时间是 t0 + i * interval，与服务器的响应速度无关。
+ * 所有连接的窗口都满了时，到期的请求在客户端排队，
+ * 延迟从预定发送时间算起（latency_ns），排队的时间也计入，避免coordinated omission：
+ * 服务器变慢时闭环客户端会少发请求，只测到少数几个慢请求，低估高百分位。
+ * 从实际发送时间算起的延迟另外记在service_ns中，两者的差就是客户端排队的时间。
+ * 没有 -r 时是闭环的吞吐量测试：每个连接上总是保持窗口中的请求数。
+ * 
+ * 流水线（-w K）：每个连接上最多K个请求在等待响应，同一个连接上到期的请求合并成一次writev()。
+ * 每个请求的前8个字节是连接内的序号，其余是固定的数据，收到的回显逐字节校验，
+ * 内容或顺序不对时计入corrupt并断开连接。
+ * -s MIN:MAX 从MIN字节到MAX字节按2倍递增，每个大小运行 -d 秒，分别输出一行结果。
+ * 
+ * 连接池：地址只解析一次，连接用非阻塞的connect()建立，建立的时间单独记在connect_ns中；
+ * 连接出错或被对端关闭后按指数退避重连（RECONNECT_MIN_MS ~ RECONNECT_MAX_MS，带随机抖动，
+ * 服务器重启时不会所有连接同时重连），连接成功后退避时间复位。
+ * -k 是同一套机制的探测模式：默认每秒1个请求、1个连接、一直运行到SIGINT。
+ * */
+enum LOAD_CONN_STATE
+{
+	LOAD_CONN_CLOSED = 0,	// waiting for the reconnect time
+	LOAD_CONN_CONNECTING,
+	LOAD_CONN_OPEN,
+};
+
+typedef struct load_request
+{
+	uint64_t seq;			// sent as the first bytes of the request
+	uint64_t t_intended;	// 预定的发送时间
+	uint64_t t_sent;		// 实际的发送时间
+}load_request_t;
+
+typedef struct load_conn
+{
+	int fd;
+	int state;
+	int in_idle;			// on the idle list, entries are removed lazily
+	
+	// 等待响应的请求，环形队列，最多g_window个
+	load_request_t * reqs;
+	unsigned q_head;
+	unsigned q_len;
+	unsigned tx_count;		// requests from q_head that are completely written
+	size_t tx_off;			// bytes written of the next one
+	size_t rx_off;			// bytes received of the request at q_head
+	uint64_t seq_next;
+	
+	uint64_t t_connect;		// connect()开始的时间，CLOSED状态下是重连的时间
+	unsigned backoff_ms;
+	struct load_conn * next_idle;
+	struct load_conn * next_retry;
+}load_conn_t;
+
+typedef struct load_thread
+{
+	pthread_t th;
+	int id;
+	int efd;
+	int num_conns;
+	load_conn_t * conns;
+	load_conn_t * idle;		// 窗口没有满的连接
+	load_conn_t * retry;	// 等待重连的连接
+	uint64_t t_retry;		// retry中最早的重连时间
+	unsigned seed;
+	uint64_t interval_ns;
+	uint64_t t_next;		// 下一个请求的预定发送时间
+	uint64_t outstanding;	// requests waiting for a response on all connections
+	unsigned char * rbuf;
+	
+	// 只由所属线程写入，主线程用metric_get()读取；每次运行之前由主线程清零
+	uint64_t requests;		// 发出的请求
+	uint64_t responses;
+	uint64_t errors;		// 连接断开时丢失的请求
+	uint64_t corrupt;		// 回显的内容不对
+	uint64_t backlog;		// 已经到期但还没有发出的请求
+	hdr_hist_t latency;		// from the intended send time
+	hdr_hist_t service;		// from the actual send time
+	
+	// 整个测试期间累计
+	uint64_t connects;
+	uint64_t connect_failures;
+	uint64_t open;			// established connections
+	hdr_hist_t connect;
+}load_thread_t;
+
+static int g_keepalive = 0;
+static int g_conns = 0;		// 0: the mode's default
+static int g_threads = 1;
+static double g_rate = 0;	// requests per second, 0 == closed loop
+static unsigned g_window = 0;	// 0: not set (1)
+static size_t g_msg_size = 64;
+static size_t g_sweep_min = 0;	// -s MIN:MAX, 0 == no sweep
+static size_t g_sweep_max = 0;
+static int g_duration = -1;	// seconds, 0 == until SIGINT, -1 == the mode's default
+static const char * g_replay_path;	// -P FILE
+static double g_speed = 1;	// replay speed, 0 == max
+
+static struct sockaddr_storage g_target;	// resolved once
+static socklen_t g_target_len;
+static int g_socktype;
+static unsigned char * g_payload;
+static uint64_t g_t_start;
+static uint64_t g_t_stop;	// 收到SIGINT时由主线程提前
+static int g_finished;
+static pthread_barrier_t g_barrier;
+static load_thread_t g_load_threads[MAX_LOAD_THREADS];
 
+static int client_run(const transport_addr_t * addr);
+static int load_run(const transport_addr_t * addr);
+static int replay_run(const transport_addr_t * addr);
+
+static inline uint64_t clock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char * prog)
+{
+	fprintf(stderr, "usage: %s [-r rate | -k] [-w window] [-s min:max] [-c conns] [-t threads] [-m bytes] [-d seconds]\n"
+		"\t\t[tcp[:[HOST:]PORT] | unix:PATH | unix:@NAME | seqpacket:PATH]\n"
+		"       %s -P file [-x speed] [-t threads] [tcp[:[HOST:]PORT] | unix:PATH | unix:@NAME]\n"
+		"\twithout -r, -k, -w, -s or -P: connect, write \"hello\" and close once a second\n"
+		"\t-r, --rate=N\topen-loop load: N requests per second in total (default: closed loop)\n"
+		"\t-k, --keepalive\tprobe over a pool of persistent connections\n"
+		"\t\t\t(default: -r 1 -c 1, until interrupted)\n"
+		"\t-w, --window=K\tup to K requests in flight per connection (default: 1, max: %d)\n"
+		"\t-s, --sweep=MIN:MAX\trun once per request size from MIN to MAX bytes, doubling\n"
+		"\t-c, --conns=N\tpersistent connections (default: 100, 1 with -k or -s)\n"
+		"\t-t, --threads=N\tthreads, each with its own epoll instance (default: %d)\n"
+		"\t-m, --msg-size=BYTES\trequest size (default: %lu)\n"
+		"\t-d, --duration=SECONDS\ttest duration, per size with -s, 0 == until interrupted\n"
+		"\t\t\t(default: 10, 2 with -s)\n"
+		"\t-P, --replay=FILE\treplay the connections captured by echoserv -C FILE\n"
+		"\t-x, --speed=N\treplay N times as fast, max: without waiting (default: 1)\n",
+		prog, prog, MAX_WINDOW, g_threads, (unsigned long)g_msg_size);
+	exit(1);
+}
+
+/* ************************
+ * usage: echoclnt [options] [address]
+ * address的写法见transport.h，例如 tcp:HOST:PORT, unix:PATH, unix:@NAME, seqpacket:PATH
+ * */
 int main(int argc, char **argv)
 {
-	client_run();
+	static struct option options[] = 
+	{
+		{"rate", required_argument, 0, 'r'},
+		{"keepalive", no_argument, 0, 'k'},
+		{"window", required_argument, 0, 'w'},
+		{"sweep", required_argument, 0, 's'},
+		{"conns", required_argument, 0, 'c'},
+		{"threads", required_argument, 0, 't'},
+		{"msg-size", required_argument, 0, 'm'},
+		{"duration", required_argument, 0, 'd'},
+		{"replay", required_argument, 0, 'P'},
+		{"speed", required_argument, 0, 'x'},
+		{"help", no_argument, 0, 'h'},
+		{NULL, 0, 0, 0}
+	};
+	int c;
+	char * p;
+	while(-1 != (c = getopt_long(argc, argv, "r:kw:s:c:t:m:d:P:x:h", options, NULL)))
+	{
+		switch(c)
+		{
+		case 'r': g_rate = strtod(optarg, NULL); if(g_rate <= 0) usage(argv[0]); break;
+		case 'k': g_keepalive = 1; break;
+		case 'w': 
+			g_window = (unsigned)atoi(optarg);
+			if(g_window < 1 || g_window > MAX_WINDOW) usage(argv[0]);
+			break;
+		case 's':
+			g_sweep_min = strtoul(optarg, &p, 0);
+			if(':' != *p) usage(argv[0]);
+			g_sweep_max = strtoul(p + 1, NULL, 0);
+			if(0 == g_sweep_min || g_sweep_max < g_sweep_min) usage(argv[0]);
+			break;
+		case 'c': g_conns = atoi(optarg); if(g_conns < 1) usage(argv[0]); break;
+		case 't': g_threads = atoi(optarg); break;
+		case 'm': g_msg_size = strtoul(optarg, NULL, 0); break;
+		case 'd': g_duration = atoi(optarg); if(g_duration < 0) usage(argv[0]); break;
+		case 'P': g_replay_path = optarg; break;
+		case 'x':
+			g_speed = strcmp(optarg, "max")?strtod(optarg, NULL):0;
+			if(g_speed < 0) usage(argv[0]);
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if(g_threads < 1 || g_threads > MAX_LOAD_THREADS || 0 == g_msg_size) usage(argv[0]);
+	
+	transport_addr_t addr;
+	if(transport_addr_parse(&addr, (optind < argc)?argv[optind]:"tcp", SERV_NAME, PORT))
+	{
+		usage(argv[0]);
+	}
+	if(g_replay_path) return replay_run(&addr)?1:0;
+	if(g_keepalive)
+	{
+		if(0 == g_rate) g_rate = 1;
+		if(0 == g_conns) g_conns = 1;
+		if(g_duration < 0) g_duration = 0;
+	}
+	if(g_sweep_min)
+	{
+		if(0 == g_conns) g_conns = 1;
+		if(g_duration <= 0) g_duration = 2;
+	}
+	if(g_rate > 0 || g_window || g_sweep_min)
+	{
+		if(0 == g_window) g_window = 1;
+		if(0 == g_conns) g_conns = 100;
+		if(g_duration < 0) g_duration = 10;
+		if(g_threads > g_conns) g_threads = g_conns;
+		return load_run(&addr)?1:0;
+	}
+	client_run(&addr);
 	return 0;
 }
 
-static int client_run()
+static int unix_connect(const transport_addr_t * addr)
+{
+	int fd = socket(AF_UNIX, addr->socktype, 0);
+	if(fd < 0) return -1;
+	if(connect(fd, (const struct sockaddr *)&addr->un, addr->un_len))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int client_run(const transport_addr_t * addr)
 {
 	int fd;
 	//~ struct pollfd pfd;
 	int rc;
+	char name[TRANSPORT_NAME_MAX];
 	
 	struct addrinfo hints, * serv_info, * p;
 	memset(&hints, 0, sizeof(hints));
@@ -65,7 +318,22 @@ static int client_run()
 	
 	while(1)
 	{
-		rc = getaddrinfo(SERV_NAME, PORT, &hints, &serv_info);
+		if(AF_UNIX == addr->family)
+		{
+			fd = unix_connect(addr);
+			if(fd < 0)
+			{
+				perror("connect");
+				exit(1);
+			}
+			printf("connected to %s\n", transport_addr_name(addr, name, sizeof(name)));
+			write(fd, "hello", 5);
+			close(fd);
+			sleep(1);
+			continue;
+		}
+		
+		rc = getaddrinfo(addr->host, addr->port, &hints, &serv_info);
 		if(rc)
 		{
 			fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
@@ -107,3 +375,1099 @@ static int client_run()
 	}
 	
 }
+
+
+/* ************************
+ * 负载模式
+ * */
+static int load_resolve(const transport_addr_t * addr)
+{
+	struct addrinfo hints, * serv_info;
+	int rc;
+	g_socktype = addr->socktype;
+	if(AF_UNIX == addr->family)
+	{
+		memcpy(&g_target, &addr->un, addr->un_len);
+		g_target_len = addr->un_len;
+		return 0;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(addr->host, addr->port, &hints, &serv_info);
+	if(rc)
+	{
+		fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
+		return -1;
+	}
+	memcpy(&g_target, serv_info->ai_addr, serv_info->ai_addrlen);
+	g_target_len = serv_info->ai_addrlen;
+	freeaddrinfo(serv_info);
+	return 0;
+}
+
+static load_conn_t * load_idle_pop(load_thread_t * t)
+{
+	while(t->idle)
+	{
+		load_conn_t * c = t->idle;
+		t->idle = c->next_idle;
+		c->in_idle = 0;
+		if(LOAD_CONN_OPEN == c->state && c->q_len < g_window) return c;
+	}
+	return NULL;
+}
+
+static void load_idle_push(load_thread_t * t, load_conn_t * c)
+{
+	if(c->in_idle) return;
+	c->in_idle = 1;
+	c->next_idle = t->idle;
+	t->idle = c;
+}
+
+// 关闭连接，按指数退避安排重连：等待时间在 [backoff/2, backoff] 之间随机
+static void load_conn_fail(load_thread_t * t, load_conn_t * c, uint64_t now)
+{
+	if(LOAD_CONN_CONNECTING == c->state) metric_add(&t->connect_failures, 1);
+	if(LOAD_CONN_OPEN == c->state) metric_sub(&t->open, 1);
+	metric_add(&t->errors, c->q_len);
+	t->outstanding -= c->q_len;
+	c->q_len = 0;
+	if(c->fd >= 0) close(c->fd);
+	c->fd = -1;
+	c->state = LOAD_CONN_CLOSED;
+	
+	c->backoff_ms = c->backoff_ms?(c->backoff_ms * 2):RECONNECT_MIN_MS;
+	if(c->backoff_ms > RECONNECT_MAX_MS) c->backoff_ms = RECONNECT_MAX_MS;
+	unsigned delay = c->backoff_ms / 2 + (unsigned)rand_r(&t->seed) % (c->backoff_ms / 2 + 1);
+	c->t_connect = now + (uint64_t)delay * 1000000;
+	if(NULL == t->retry || c->t_connect < t->t_retry) t->t_retry = c->t_connect;
+	c->next_retry = t->retry;
+	t->retry = c;
+}
+
+static void load_conn_established(load_thread_t * t, load_conn_t * c, uint64_t now)
+{
+	hdr_hist_record(&t->connect, now - c->t_connect);
+	metric_add(&t->connects, 1);
+	metric_add(&t->open, 1);
+	c->state = LOAD_CONN_OPEN;
+	c->backoff_ms = 0;
+	c->q_head = c->q_len = c->tx_count = 0;
+	c->tx_off = c->rx_off = 0;
+	load_idle_push(t, c);
+}
+
+static void load_conn_connect(load_thread_t * t, load_conn_t * c, uint64_t now)
+{
+	int on = 1;
+	struct epoll_event ev;
+	c->state = LOAD_CONN_CONNECTING;
+	c->t_connect = now;
+	c->fd = socket(g_target.ss_family, g_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(c->fd < 0)
+	{
+		load_conn_fail(t, c, now);
+		return;
+	}
+	if(AF_UNIX != g_target.ss_family) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if(epoll_ctl(t->efd, EPOLL_CTL_ADD, c->fd, &ev))
+	{
+		load_conn_fail(t, c, now);
+		return;
+	}
+	if(0 == connect(c->fd, (struct sockaddr *)&g_target, g_target_len)) load_conn_established(t, c, now);
+	else if(EINPROGRESS != errno) load_conn_fail(t, c, now);	// AF_UNIX: EAGAIN when the backlog is full
+}
+
+// 重连所有到期的连接，重新计算最早的重连时间
+static void load_retry(load_thread_t * t, uint64_t now)
+{
+	load_conn_t * list = t->retry;
+	t->retry = NULL;
+	while(list)
+	{
+		load_conn_t * c = list;
+		list = c->next_retry;
+		if(c->t_connect <= now) load_conn_connect(t, c, now);
+		else
+		{
+			if(NULL == t->retry || c->t_connect < t->t_retry) t->t_retry = c->t_connect;
+			c->next_retry = t->retry;
+			t->retry = c;
+		}
+	}
+}
+
+static inline size_t load_header_size(void)
+{
+	return (g_msg_size < sizeof(uint64_t))?g_msg_size:sizeof(uint64_t);
+}
+
+/* ************************
+ * 把所有还没有写完的请求用writev()发出去：每个请求两段，序号和公共的数据，
+ * 返回0（写完或者EAGAIN）或者-1（出错）
+ * */
+static int load_conn_flush(load_conn_t * c)
+{
+	size_t header = load_header_size();
+	while(c->tx_count < c->q_len)
+	{
+		struct iovec iov[LOAD_IOV_MAX];
+		int niov = 0;
+		unsigned i;
+		size_t off = c->tx_off;
+		for(i = c->tx_count; i < c->q_len && niov + 2 <= LOAD_IOV_MAX; ++i, off = 0)
+		{
+			load_request_t * req = &c->reqs[(c->q_head + i) % g_window];
+			if(off < header)
+			{
+				iov[niov].iov_base = (unsigned char *)&req->seq + off;
+				iov[niov].iov_len = header - off;
+				++niov;
+				off = header;
+			}
+			if(off < g_msg_size)
+			{
+				iov[niov].iov_base = g_payload + off;
+				iov[niov].iov_len = g_msg_size - off;
+				++niov;
+			}
+		}
+		
+		ssize_t n = writev(c->fd, iov, niov);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno) return 0;
+			return -1;
+		}
+		c->tx_off += n;
+		while(c->tx_count < c->q_len && c->tx_off >= g_msg_size)
+		{
+			c->tx_off -= g_msg_size;
+			++c->tx_count;
+		}
+	}
+	return 0;
+}
+
+static void load_conn_enqueue(load_thread_t * t, load_conn_t * c, uint64_t t_intended, uint64_t now)
+{
+	load_request_t * req = &c->reqs[(c->q_head + c->q_len) % g_window];
+	req->seq = c->seq_next++;
+	req->t_intended = t_intended;
+	req->t_sent = now;
+	++c->q_len;
+	++t->outstanding;
+	metric_add(&t->requests, 1);
+}
+
+// 回显的数据应当与请求完全相同：off是在当前请求中的偏移
+static int load_conn_verify(load_conn_t * c, const unsigned char * p, size_t n)
+{
+	const load_request_t * req = &c->reqs[c->q_head];
+	size_t header = load_header_size();
+	size_t off = c->rx_off;
+	if(off < header)
+	{
+		size_t len = (n < header - off)?n:(header - off);
+		if(memcmp((const unsigned char *)&req->seq + off, p, len)) return -1;
+		off += len;
+		p += len;
+		n -= len;
+	}
+	return (n > 0 && memcmp(g_payload + off, p, n))?-1:0;
+}
+
+static int load_conn_receive(load_thread_t * t, load_conn_t * c)
+{
+	while(1)
+	{
+		ssize_t n = recv(c->fd, t->rbuf, LOAD_RECV_SIZE, 0);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno) return 0;
+			return -1;
+		}
+		if(0 == n) return -1;
+		
+		const unsigned char * p = t->rbuf;
+		uint64_t now = clock_now_ns();
+		while(n > 0)
+		{
+			if(0 == c->q_len)	// nothing was sent that could be echoed
+			{
+				metric_add(&t->corrupt, 1);
+				return -1;
+			}
+			size_t len = g_msg_size - c->rx_off;
+			if((size_t)n < len) len = n;
+			if(load_conn_verify(c, p, len))
+			{
+				metric_add(&t->corrupt, 1);
+				return -1;
+			}
+			c->rx_off += len;
+			p += len;
+			n -= len;
+			if(c->rx_off < g_msg_size) break;
+			
+			// 最早的请求完成了，只统计在测试时间内完成的
+			const load_request_t * req = &c->reqs[c->q_head];
+			if(now <= __atomic_load_n(&g_t_stop, __ATOMIC_RELAXED))
+			{
+				hdr_hist_record(&t->latency, now - req->t_intended);
+				hdr_hist_record(&t->service, now - req->t_sent);
+				metric_add(&t->responses, 1);
+			}
+			c->q_head = (c->q_head + 1) % g_window;
+			--c->q_len;
+			--c->tx_count;
+			--t->outstanding;
+			c->rx_off = 0;
+			load_idle_push(t, c);
+		}
+	}
+}
+
+static void load_conn_event(load_thread_t * t, load_conn_t * c, uint32_t events)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if(LOAD_CONN_CONNECTING == c->state)
+	{
+		if(0 == (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err || (events & EPOLLHUP))
+		{
+			load_conn_fail(t, c, clock_now_ns());
+			return;
+		}
+		load_conn_established(t, c, clock_now_ns());
+		return;
+	}
+	if(LOAD_CONN_OPEN != c->state) return;
+	
+	if((events & EPOLLOUT) && load_conn_flush(c))
+	{
+		load_conn_fail(t, c, clock_now_ns());
+		return;
+	}
+	// 空闲的连接上有事件多半是对端关闭了连接，也由recv()判断
+	if((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && load_conn_receive(t, c))
+	{
+		load_conn_fail(t, c, clock_now_ns());
+	}
+}
+
+static int load_poll(load_thread_t * t, uint64_t timeout_ns)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec timeout = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+	int i;
+	int n = epoll_pwait2(t->efd, events, MAX_EVENTS, &timeout, NULL);
+	if(n < 0)
+	{
+		if(EINTR == errno) return 0;
+		perror("epoll_pwait2");
+		return -1;
+	}
+	for(i = 0; i < n; ++i)
+	{
+		load_conn_t * c = events[i].data.ptr;
+		if(c->fd >= 0) load_conn_event(t, c, events[i].events);
+	}
+	return 0;
+}
+
+/* ************************
+ * 一次运行：从g_t_start到g_t_stop按时间表（或者闭环）发出请求，
+ * 然后最多等DRAIN_TIMEOUT_MS收完剩下的响应，仍然没有响应的连接被断开重连，
+ * 下一次运行（下一个大小）不会收到这一次的回显
+ * */
+static void load_thread_run(load_thread_t * t)
+{
+	int closed_loop = (0 == g_rate);
+	uint64_t now;
+	while(1)
+	{
+		load_conn_t * c;
+		uint64_t stop = __atomic_load_n(&g_t_stop, __ATOMIC_RELAXED);
+		now = clock_now_ns();
+		if(now >= stop) break;
+		if(t->retry && t->t_retry <= now) load_retry(t, now);
+		
+		// 把到期的请求填进有空位的连接，一个连接上的请求一次writev()发出；
+		// 空位不够时留在backlog里，预定时间不变
+		while((closed_loop || t->t_next <= now) && NULL != (c = load_idle_pop(t)))
+		{
+			while(c->q_len < g_window && (closed_loop || t->t_next <= now))
+			{
+				load_conn_enqueue(t, c, closed_loop?now:t->t_next, now);
+				t->t_next += t->interval_ns;
+			}
+			if(load_conn_flush(c)) load_conn_fail(t, c, now);
+			else if(c->q_len < g_window) load_idle_push(t, c);
+		}
+		uint64_t due = (!closed_loop && t->t_next <= now)?((now - t->t_next) / t->interval_ns + 1):0;
+		metric_sub(&t->backlog, metric_get(&t->backlog));
+		metric_add(&t->backlog, due);
+		
+		// 有空位时睡到下一个请求的预定时间，否则等响应或者重连
+		uint64_t wake = stop;
+		if(!closed_loop && t->idle && t->t_next < wake) wake = t->t_next;
+		if(t->retry && t->t_retry < wake) wake = t->t_retry;
+		if(wake > now + 100000000) wake = now + 100000000;
+		if(load_poll(t, (wake > now)?(wake - now):0)) return;
+	}
+	
+	uint64_t deadline = now + (uint64_t)DRAIN_TIMEOUT_MS * 1000000;
+	while(t->outstanding > 0 && now < deadline)
+	{
+		if(load_poll(t, 10000000)) break;
+		now = clock_now_ns();
+	}
+	int i;
+	for(i = 0; i < t->num_conns; ++i)
+	{
+		if(t->conns[i].q_len > 0) load_conn_fail(t, &t->conns[i], now);
+	}
+}
+
+static void * load_thread(void * param)
+{
+	load_thread_t * t = param;
+	int i;
+	prctl(PR_SET_TIMERSLACK, 1UL);	// the default 50 us slack would delay every scheduled send
+	
+	// 先建立连接池，所有线程都准备好以后主线程才确定开始时间
+	uint64_t now = clock_now_ns();
+	uint64_t deadline = now + (uint64_t)SETUP_TIMEOUT_MS * 1000000;
+	for(i = 0; i < t->num_conns; ++i) load_conn_connect(t, &t->conns[i], now);
+	while(now < deadline)
+	{
+		int pending = 0;
+		for(i = 0; i < t->num_conns; ++i) pending += (LOAD_CONN_CONNECTING == t->conns[i].state);
+		if(0 == pending || load_poll(t, 10000000)) break;
+		now = clock_now_ns();
+	}
+	pthread_barrier_wait(&g_barrier);
+	
+	// 每次运行前后各同步一次：之前主线程设置大小和时间，之后主线程输出结果
+	while(1)
+	{
+		pthread_barrier_wait(&g_barrier);
+		if(g_finished) break;
+		load_thread_run(t);
+		pthread_barrier_wait(&g_barrier);
+	}
+	return NULL;
+}
+
+// 连接数可能超过默认的1024个fd
+static void raise_nofile_limit(void)
+{
+	struct rlimit rl;
+	if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static int load_setup(void)
+{
+	int i, k;
+	for(k = 0; k < g_threads; ++k)
+	{
+		load_thread_t * t = &g_load_threads[k];
+		t->id = k;
+		t->seed = (unsigned)(getpid() * 31 + k);
+		t->num_conns = g_conns / g_threads + ((k < g_conns % g_threads)?1:0);
+		t->conns = calloc(t->num_conns, sizeof(*t->conns));
+		t->rbuf = malloc(LOAD_RECV_SIZE);
+		t->efd = epoll_create1(EPOLL_CLOEXEC);
+		if(NULL == t->conns || NULL == t->rbuf || -1 == t->efd)
+		{
+			perror("load_setup");
+			return -1;
+		}
+		for(i = 0; i < t->num_conns; ++i)
+		{
+			t->conns[i].fd = -1;
+			t->conns[i].reqs = calloc(g_window, sizeof(load_request_t));
+			if(NULL == t->conns[i].reqs)
+			{
+				perror("load_setup");
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// 返回service_ns的p50，-s用来检查Nagle造成的延迟跳变
+static uint64_t load_report(const transport_addr_t * addr, double elapsed)
+{
+	static hdr_hist_t latency, service, connect;
+	uint64_t requests = 0, responses = 0, errors = 0, corrupt = 0, backlog = 0, connects = 0, connect_failures = 0;
+	char name[TRANSPORT_NAME_MAX];
+	int k;
+	memset(&latency, 0, sizeof(latency));
+	memset(&service, 0, sizeof(service));
+	memset(&connect, 0, sizeof(connect));
+	for(k = 0; k < g_threads; ++k)
+	{
+		load_thread_t * t = &g_load_threads[k];
+		hdr_hist_merge(&latency, &t->latency);
+		hdr_hist_merge(&service, &t->service);
+		hdr_hist_merge(&connect, &t->connect);
+		requests += metric_get(&t->requests);
+		responses += metric_get(&t->responses);
+		errors += metric_get(&t->errors);
+		corrupt += metric_get(&t->corrupt);
+		backlog += metric_get(&t->backlog);
+		connects += metric_get(&t->connects);
+		connect_failures += metric_get(&t->connect_failures);
+	}
+	printf("{\"address\":\"%s\",\"conns\":%d,\"threads\":%d,\"window\":%u,\"msg_size\":%lu,\"duration_s\":%.3f,"
+		"\"target_rate\":%.1f,\"rate\":%.1f,\"mb_per_s\":%.3f,\"requests\":%lu,\"responses\":%lu,"
+		"\"errors\":%lu,\"corrupt\":%lu,\"backlog\":%lu,\"connects\":%lu,\"connect_failures\":%lu,\"latency_ns\":",
+		transport_addr_name(addr, name, sizeof(name)), g_conns, g_threads, g_window, (unsigned long)g_msg_size, elapsed,
+		g_rate, (double)responses / elapsed, (double)responses * (double)g_msg_size / elapsed / 1e6,
+		(unsigned long)requests, (unsigned long)responses, (unsigned long)errors, (unsigned long)corrupt,
+		(unsigned long)backlog, (unsigned long)connects, (unsigned long)connect_failures);
+	hdr_hist_print_json(&latency, stdout);
+	printf(",\"service_ns\":");
+	hdr_hist_print_json(&service, stdout);
+	printf(",\"connect_ns\":");
+	hdr_hist_print_json(&connect, stdout);
+	printf("}\n");
+	fflush(stdout);
+	return hdr_hist_percentile(&service, 50.0);
+}
+
+/* ************************
+ * 主线程：按大小依次运行，每秒在stderr上输出一次进度，
+ * backlog持续增长说明服务器（或客户端）已经饱和；收到SIGINT/SIGTERM时结束当前这一次并输出结果
+ * 返回1表示被中断
+ * */
+static int load_monitor(sigset_t * sigs)
+{
+	uint64_t last = 0;
+	int k;
+	while(1)
+	{
+		uint64_t now = clock_now_ns();
+		if(now >= g_t_stop) return 0;
+		uint64_t wait_ns = (g_t_stop - now > 1000000000)?1000000000:(g_t_stop - now);
+		struct timespec timeout = {(time_t)(wait_ns / 1000000000), (long)(wait_ns % 1000000000)};
+		if(sigtimedwait(sigs, NULL, &timeout) > 0)
+		{
+			__atomic_store_n(&g_t_stop, clock_now_ns(), __ATOMIC_RELAXED);
+			return 1;
+		}
+		uint64_t responses = 0, backlog = 0, errors = 0, open = 0, connects = 0;
+		for(k = 0; k < g_threads; ++k)
+		{
+			responses += metric_get(&g_load_threads[k].responses);
+			backlog += metric_get(&g_load_threads[k].backlog);
+			errors += metric_get(&g_load_threads[k].errors);
+			open += metric_get(&g_load_threads[k].open);
+			connects += metric_get(&g_load_threads[k].connects);
+		}
+		fprintf(stderr, "%lu bytes %.1fs: responses=%lu (+%lu) backlog=%lu errors=%lu open=%lu/%d connects=%lu\n", 
+			(unsigned long)g_msg_size, (double)(clock_now_ns() - g_t_start) / 1e9, (unsigned long)responses, 
+			(unsigned long)(responses - last), (unsigned long)backlog, (unsigned long)errors,
+			(unsigned long)open, g_conns, (unsigned long)connects);
+		last = responses;
+	}
+}
+
+static int load_run(const transport_addr_t * addr)
+{
+	int k;
+	int rc;
+	size_t size;
+	raise_nofile_limit();
+	size_t max_size = g_sweep_min?g_sweep_max:g_msg_size;
+	g_payload = malloc(max_size);
+	if(NULL == g_payload)
+	{
+		perror("malloc");
+		return -1;
+	}
+	for(size = 0; size < max_size; ++size) g_payload[size] = (unsigned char)(size * 131 + 7);
+	if(load_resolve(addr) || load_setup()) return -1;
+	
+	// 工作线程继承屏蔽的信号，SIGINT/SIGTERM由主线程处理
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	
+	pthread_barrier_init(&g_barrier, NULL, g_threads + 1);
+	g_t_stop = UINT64_MAX;
+	for(k = 0; k < g_threads; ++k)
+	{
+		rc = pthread_create(&g_load_threads[k].th, NULL, load_thread, &g_load_threads[k]);
+		if(rc)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			return -1;
+		}
+	}
+	pthread_barrier_wait(&g_barrier);
+	
+	// 每个线程承担1/threads的速率，起始时间错开，合起来是均匀的时间表
+	double interval = g_rate?(1e9 * (double)g_threads / g_rate):0;
+	size = g_sweep_min?g_sweep_min:g_msg_size;
+	uint64_t prev_p50 = 0;
+	while(1)
+	{
+		g_msg_size = size;
+		g_t_start = clock_now_ns();
+		g_t_stop = g_duration?(g_t_start + (uint64_t)g_duration * 1000000000):UINT64_MAX;
+		for(k = 0; k < g_threads; ++k)
+		{
+			load_thread_t * t = &g_load_threads[k];
+			t->requests = t->responses = t->errors = t->corrupt = t->backlog = 0;
+			memset(&t->latency, 0, sizeof(t->latency));
+			memset(&t->service, 0, sizeof(t->service));
+			t->interval_ns = (interval < 1)?1:(uint64_t)interval;
+			t->t_next = g_t_start + (uint64_t)(interval * k / g_threads);
+		}
+		pthread_barrier_wait(&g_barrier);
+		int interrupted = load_monitor(&sigs);
+		uint64_t elapsed = g_t_stop - g_t_start;
+		pthread_barrier_wait(&g_barrier);
+		uint64_t p50 = load_report(addr, (double)elapsed / 1e9);
+		
+		// 服务器用Nagle时，超过它一次读的大小（echoserv是16 KB）的回显最后一小段要等delayed ACK，
+		// p50突然跳到40 ms左右，这不是吞吐量的拐点
+		if(g_sweep_min && AF_UNIX != addr->family && prev_p50 && prev_p50 < 10000000
+			&& p50 >= 30000000 && p50 <= 60000000)
+		{
+			fprintf(stderr, "warning: p50 jumped from %lu us to %lu ms at %lu bytes, probably the delayed ACK:\n"
+				"\tthe server is using Nagle (run echoserv with -N nodelay)\n",
+				(unsigned long)(prev_p50 / 1000), (unsigned long)(p50 / 1000000), (unsigned long)size);
+		}
+		prev_p50 = p50;
+		
+		if(interrupted || 0 == g_sweep_min || size >= g_sweep_max) break;
+		size = (size * 2 > g_sweep_max)?g_sweep_max:(size * 2);
+	}
+	g_finished = 1;
+	pthread_barrier_wait(&g_barrier);
+	for(k = 0; k < g_threads; ++k) pthread_join(g_load_threads[k].th, NULL);
+	return 0;
+}
+
+
+/* ************************
+ * 回放（-P FILE）：按echoserv -C记录的时间重现每个连接的建立、关闭和每次收到的数据量。
+ * 记录文件整个mmap进来，各线程直接顺序读映射的内存，不解析也不复制，
+ * 连接编号对线程数取模决定由哪个线程回放，每个线程跳过其他线程的记录。
+ * 记录的预定时间是 开始时间 + time_us / speed，-x max 时不等待，每轮最多处理REPLAY_BATCH条记录。
+ * 发送的内容是固定的数据（按连接内的字节偏移取），回显逐字节校验；
+ * 每个TRACE_DATA的延迟从预定时间算到最后一个字节的回显收到为止（latency_ns），
+ * 记录被处理得比预定时间晚多少记在lag_ns中，lag很大说明回放端跟不上这个速度。
+ * 记录中的TRACE_CLOSE在回显全部收到以后才执行；开始记录以前就已经建立的连接在第一个TRACE_DATA时建立，
+ * 记录结束时仍然打开的连接在回显收完以后关闭；只有连续DRAIN_TIMEOUT_MS没有收发任何数据时，
+ * 剩下的连接才计为错误（-x max 回放大的记录时，记录处理完以后可能还有几个GB在路上）。
+ * */
+#define REPLAY_PAYLOAD_SIZE (65536)
+#define REPLAY_PENDING (16)		// DATA records per connection tracked for latency
+#define REPLAY_BATCH (1024)		// records per iteration at max speed
+
+enum REPLAY_CONN_STATE
+{
+	REPLAY_CONN_NONE = 0,	// not opened yet
+	REPLAY_CONN_CONNECTING,
+	REPLAY_CONN_OPEN,
+	REPLAY_CONN_DONE,		// closed or failed, later records are ignored
+};
+
+typedef struct replay_pending
+{
+	uint64_t end;			// tx_total after the record
+	uint64_t t_intended;
+}replay_pending_t;
+
+typedef struct replay_conn
+{
+	int fd;
+	int state;
+	int closing;			// TRACE_CLOSE seen, close when everything is echoed
+	uint64_t tx_total;		// bytes to send
+	uint64_t tx_done;
+	uint64_t rx_done;
+	uint64_t t_connect;
+	
+	// 等待回显的DATA记录，环形队列，满了的时候新的记录不统计延迟
+	replay_pending_t pending[REPLAY_PENDING];
+	unsigned p_head;
+	unsigned p_len;
+}replay_conn_t;
+
+typedef struct replay_thread
+{
+	pthread_t th;
+	int id;
+	int efd;
+	size_t cursor;			// next record in the trace
+	unsigned char * rbuf;
+	
+	// 只由所属线程写入，主线程用metric_get()读取
+	uint64_t active;		// connecting or open connections
+	uint64_t records;		// records replayed
+	uint64_t opens;
+	uint64_t closes;
+	uint64_t errors;		// connections that failed or were not fully echoed
+	uint64_t corrupt;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t t_done;		// 回放结束的时间，0 == still running
+	hdr_hist_t latency;
+	hdr_hist_t connect;
+	hdr_hist_t lag;
+}replay_thread_t;
+
+static trace_map_t g_trace;
+static replay_conn_t * g_replay_conns;	// indexed by the trace connection id
+static uint32_t g_replay_max_conn;
+static replay_thread_t g_replay_threads[MAX_LOAD_THREADS];
+
+static void replay_conn_fail(replay_thread_t * t, replay_conn_t * c)
+{
+	if(REPLAY_CONN_CONNECTING != c->state && REPLAY_CONN_OPEN != c->state) return;
+	close(c->fd);
+	c->fd = -1;
+	c->state = REPLAY_CONN_DONE;
+	metric_sub(&t->active, 1);
+	metric_add(&t->errors, 1);
+}
+
+// 回显全部收到以后才执行记录中的关闭
+static void replay_conn_try_close(replay_thread_t * t, replay_conn_t * c)
+{
+	if(!c->closing || REPLAY_CONN_OPEN != c->state || c->rx_done < c->tx_total) return;
+	close(c->fd);
+	c->fd = -1;
+	c->state = REPLAY_CONN_DONE;
+	metric_sub(&t->active, 1);
+	metric_add(&t->closes, 1);
+}
+
+static int replay_conn_flush(replay_thread_t * t, replay_conn_t * c)
+{
+	while(c->tx_done < c->tx_total)
+	{
+		size_t off = c->tx_done % REPLAY_PAYLOAD_SIZE;
+		size_t len = REPLAY_PAYLOAD_SIZE - off;
+		if(c->tx_total - c->tx_done < len) len = c->tx_total - c->tx_done;
+		ssize_t n = send(c->fd, g_payload + off, len, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno) return 0;
+			return -1;
+		}
+		c->tx_done += n;
+		metric_add(&t->tx_bytes, n);
+	}
+	return 0;
+}
+
+static void replay_conn_established(replay_thread_t * t, replay_conn_t * c, uint64_t now)
+{
+	hdr_hist_record(&t->connect, now - c->t_connect);
+	metric_add(&t->opens, 1);
+	c->state = REPLAY_CONN_OPEN;
+	if(replay_conn_flush(t, c)) replay_conn_fail(t, c);
+	else replay_conn_try_close(t, c);
+}
+
+static void replay_conn_connect(replay_thread_t * t, replay_conn_t * c, uint64_t now)
+{
+	int on = 1;
+	struct epoll_event ev;
+	c->state = REPLAY_CONN_CONNECTING;
+	c->t_connect = now;
+	metric_add(&t->active, 1);
+	c->fd = socket(g_target.ss_family, g_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(c->fd < 0)
+	{
+		replay_conn_fail(t, c);
+		return;
+	}
+	if(AF_UNIX != g_target.ss_family) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if(epoll_ctl(t->efd, EPOLL_CTL_ADD, c->fd, &ev))
+	{
+		replay_conn_fail(t, c);
+		return;
+	}
+	if(0 == connect(c->fd, (struct sockaddr *)&g_target, g_target_len)) replay_conn_established(t, c, now);
+	else if(EINPROGRESS != errno) replay_conn_fail(t, c);
+}
+
+// 回显的数据应当与发出的完全相同，而且不能超过已经发出的字节数
+static int replay_conn_verify(const replay_conn_t * c, const unsigned char * p, size_t n)
+{
+	uint64_t pos = c->rx_done;
+	if(pos + n > c->tx_done) return -1;
+	while(n > 0)
+	{
+		size_t off = pos % REPLAY_PAYLOAD_SIZE;
+		size_t len = REPLAY_PAYLOAD_SIZE - off;
+		if(n < len) len = n;
+		if(memcmp(g_payload + off, p, len)) return -1;
+		pos += len;
+		p += len;
+		n -= len;
+	}
+	return 0;
+}
+
+static int replay_conn_receive(replay_thread_t * t, replay_conn_t * c)
+{
+	while(1)
+	{
+		ssize_t n = recv(c->fd, t->rbuf, LOAD_RECV_SIZE, 0);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno) return 0;
+			return -1;
+		}
+		if(0 == n) return -1;
+		if(replay_conn_verify(c, t->rbuf, n))
+		{
+			metric_add(&t->corrupt, 1);
+			return -1;
+		}
+		c->rx_done += n;
+		metric_add(&t->rx_bytes, n);
+		
+		uint64_t now = clock_now_ns();
+		while(c->p_len > 0 && c->pending[c->p_head].end <= c->rx_done)
+		{
+			hdr_hist_record(&t->latency, now - c->pending[c->p_head].t_intended);
+			c->p_head = (c->p_head + 1) % REPLAY_PENDING;
+			--c->p_len;
+		}
+	}
+}
+
+static void replay_conn_event(replay_thread_t * t, replay_conn_t * c, uint32_t events)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if(REPLAY_CONN_CONNECTING == c->state)
+	{
+		if(0 == (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err || (events & EPOLLHUP))
+		{
+			replay_conn_fail(t, c);
+			return;
+		}
+		replay_conn_established(t, c, clock_now_ns());
+		if(REPLAY_CONN_OPEN != c->state) return;
+	}
+	if(REPLAY_CONN_OPEN != c->state) return;
+	
+	if((events & EPOLLOUT) && replay_conn_flush(t, c))
+	{
+		replay_conn_fail(t, c);
+		return;
+	}
+	if((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && replay_conn_receive(t, c))
+	{
+		replay_conn_fail(t, c);
+		return;
+	}
+	replay_conn_try_close(t, c);
+}
+
+static int replay_poll(replay_thread_t * t, uint64_t timeout_ns)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec timeout = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+	int i;
+	int n = epoll_pwait2(t->efd, events, MAX_EVENTS, &timeout, NULL);
+	if(n < 0)
+	{
+		if(EINTR == errno) return 0;
+		perror("epoll_pwait2");
+		return -1;
+	}
+	for(i = 0; i < n; ++i) replay_conn_event(t, events[i].data.ptr, events[i].events);
+	return 0;
+}
+
+static void replay_record(replay_thread_t * t, const trace_record_t * rec, uint64_t due, uint64_t now)
+{
+	replay_conn_t * c = &g_replay_conns[rec->conn];
+	int type = trace_record_type(rec);
+	metric_add(&t->records, 1);
+	if(g_speed > 0) hdr_hist_record(&t->lag, now - due);
+	
+	if(REPLAY_CONN_NONE == c->state)
+	{
+		if(TRACE_CLOSE == type)
+		{
+			c->state = REPLAY_CONN_DONE;
+			return;
+		}
+		replay_conn_connect(t, c, now);
+	}
+	if(REPLAY_CONN_DONE == c->state) return;
+	
+	if(TRACE_DATA == type)
+	{
+		uint32_t size = trace_record_size(rec);
+		if(0 == size) return;
+		c->tx_total += size;
+		if(c->p_len < REPLAY_PENDING)
+		{
+			replay_pending_t * pending = &c->pending[(c->p_head + c->p_len) % REPLAY_PENDING];
+			pending->end = c->tx_total;
+			pending->t_intended = due;
+			++c->p_len;
+		}
+		if(REPLAY_CONN_OPEN == c->state && replay_conn_flush(t, c)) replay_conn_fail(t, c);
+	}
+	else if(TRACE_CLOSE == type)
+	{
+		c->closing = 1;
+		replay_conn_try_close(t, c);
+	}
+}
+
+static void replay_thread_run(replay_thread_t * t)
+{
+	const trace_record_t * records = g_trace.records;
+	uint64_t now = clock_now_ns();
+	uint32_t id;
+	while(t->cursor < g_trace.count)
+	{
+		uint64_t stop = __atomic_load_n(&g_t_stop, __ATOMIC_RELAXED);
+		uint64_t wake = now + 100000000;
+		int n = 0;
+		if(now >= stop) return;
+		
+		// 处理所有到期的记录，停在本线程的第一条未到期的记录上
+		while(t->cursor < g_trace.count)
+		{
+			const trace_record_t * rec = &records[t->cursor];
+			if((int)(rec->conn % (uint32_t)g_threads) != t->id)
+			{
+				++t->cursor;
+				continue;
+			}
+			uint64_t due = now;
+			if(g_speed > 0) due = g_t_start + (uint64_t)((double)rec->time_us * 1000.0 / g_speed);
+			if(due > now)
+			{
+				if(due < wake) wake = due;
+				break;
+			}
+			if(0 == g_speed && n >= REPLAY_BATCH)
+			{
+				wake = now;
+				break;
+			}
+			replay_record(t, rec, due, now);
+			++t->cursor;
+			++n;
+		}
+		if(replay_poll(t, (wake > now)?(wake - now):0)) return;
+		now = clock_now_ns();
+	}
+	
+	// 记录结束时仍然打开的连接，回显收完以后关闭
+	for(id = (uint32_t)t->id; id <= g_replay_max_conn; id += (uint32_t)g_threads)
+	{
+		g_replay_conns[id].closing = 1;
+		replay_conn_try_close(t, &g_replay_conns[id]);
+	}
+	// 只要还在收发数据就继续等，DRAIN_TIMEOUT_MS内没有任何进展才认为服务器停住了
+	uint64_t deadline = now + (uint64_t)DRAIN_TIMEOUT_MS * 1000000;
+	uint64_t progress = t->tx_bytes + t->rx_bytes;
+	while(metric_get(&t->active) > 0 && now < deadline && now < __atomic_load_n(&g_t_stop, __ATOMIC_RELAXED))
+	{
+		if(replay_poll(t, 10000000)) break;
+		now = clock_now_ns();
+		if(t->tx_bytes + t->rx_bytes != progress)
+		{
+			progress = t->tx_bytes + t->rx_bytes;
+			deadline = now + (uint64_t)DRAIN_TIMEOUT_MS * 1000000;
+		}
+	}
+}
+
+static void * replay_thread(void * param)
+{
+	replay_thread_t * t = param;
+	uint32_t id;
+	prctl(PR_SET_TIMERSLACK, 1UL);
+	pthread_barrier_wait(&g_barrier);
+	replay_thread_run(t);
+	
+	// 中断或者等待超时，没有收完回显的连接计为错误
+	for(id = (uint32_t)t->id; id <= g_replay_max_conn; id += (uint32_t)g_threads)
+	{
+		replay_conn_fail(t, &g_replay_conns[id]);
+	}
+	__atomic_store_n(&t->t_done, clock_now_ns(), __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void replay_report(double elapsed)
+{
+	static hdr_hist_t latency, connect, lag;
+	uint64_t records = 0, opens = 0, closes = 0, errors = 0, corrupt = 0, tx_bytes = 0, rx_bytes = 0;
+	int k;
+	memset(&latency, 0, sizeof(latency));
+	memset(&connect, 0, sizeof(connect));
+	memset(&lag, 0, sizeof(lag));
+	for(k = 0; k < g_threads; ++k)
+	{
+		replay_thread_t * t = &g_replay_threads[k];
+		hdr_hist_merge(&latency, &t->latency);
+		hdr_hist_merge(&connect, &t->connect);
+		hdr_hist_merge(&lag, &t->lag);
+		records += metric_get(&t->records);
+		opens += metric_get(&t->opens);
+		closes += metric_get(&t->closes);
+		errors += metric_get(&t->errors);
+		corrupt += metric_get(&t->corrupt);
+		tx_bytes += metric_get(&t->tx_bytes);
+		rx_bytes += metric_get(&t->rx_bytes);
+	}
+	uint64_t trace_us = g_trace.count?g_trace.records[g_trace.count - 1].time_us:0;
+	printf("{\"trace\":\"%s\",\"trace_records\":%lu,\"trace_duration_s\":%.3f,\"threads\":%d,\"speed\":%.3f,"
+		"\"duration_s\":%.3f,\"records\":%lu,\"opens\":%lu,\"closes\":%lu,\"errors\":%lu,\"corrupt\":%lu,"
+		"\"tx_bytes\":%lu,\"rx_bytes\":%lu,\"mb_per_s\":%.3f,\"latency_ns\":",
+		g_replay_path, (unsigned long)g_trace.count, (double)trace_us / 1e6, g_threads, g_speed,
+		elapsed, (unsigned long)records, (unsigned long)opens, (unsigned long)closes, (unsigned long)errors,
+		(unsigned long)corrupt, (unsigned long)tx_bytes, (unsigned long)rx_bytes, (double)rx_bytes / elapsed / 1e6);
+	hdr_hist_print_json(&latency, stdout);
+	printf(",\"connect_ns\":");
+	hdr_hist_print_json(&connect, stdout);
+	printf(",\"lag_ns\":");
+	hdr_hist_print_json(&lag, stdout);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static int replay_run(const transport_addr_t * addr)
+{
+	int k;
+	int rc;
+	size_t i;
+	if(SOCK_STREAM != addr->socktype)
+	{
+		fprintf(stderr, "replay needs a stream transport (tcp or unix)\n");
+		return -1;
+	}
+	if(trace_map_open(&g_trace, g_replay_path))
+	{
+		fprintf(stderr, "%s: %s\n", g_replay_path, (EINVAL == errno)?"not a capture file":strerror(errno));
+		return -1;
+	}
+	for(i = 0; i < g_trace.count; ++i)
+	{
+		if(g_trace.records[i].conn > g_replay_max_conn) g_replay_max_conn = g_trace.records[i].conn;
+	}
+	raise_nofile_limit();
+	g_replay_conns = calloc((size_t)g_replay_max_conn + 1, sizeof(replay_conn_t));
+	g_payload = malloc(REPLAY_PAYLOAD_SIZE);
+	if(NULL == g_replay_conns || NULL == g_payload)
+	{
+		perror("malloc");
+		return -1;
+	}
+	for(i = 0; i < REPLAY_PAYLOAD_SIZE; ++i) g_payload[i] = (unsigned char)(i * 131 + 7);
+	if(load_resolve(addr)) return -1;
+	for(k = 0; k < g_threads; ++k)
+	{
+		replay_thread_t * t = &g_replay_threads[k];
+		t->id = k;
+		t->rbuf = malloc(LOAD_RECV_SIZE);
+		t->efd = epoll_create1(EPOLL_CLOEXEC);
+		if(NULL == t->rbuf || -1 == t->efd)
+		{
+			perror("replay_setup");
+			return -1;
+		}
+	}
+	
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	
+	pthread_barrier_init(&g_barrier, NULL, g_threads + 1);
+	g_t_stop = UINT64_MAX;
+	for(k = 0; k < g_threads; ++k)
+	{
+		rc = pthread_create(&g_replay_threads[k].th, NULL, replay_thread, &g_replay_threads[k]);
+		if(rc)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			return -1;
+		}
+	}
+	g_t_start = clock_now_ns();
+	pthread_barrier_wait(&g_barrier);
+	
+	// 每秒在stderr上输出一次进度，收到SIGINT/SIGTERM时停止回放
+	uint64_t last = 0;
+	uint64_t t_report = g_t_start + 1000000000;
+	uint64_t t_end = 0;
+	while(1)
+	{
+		uint64_t records = 0, errors = 0, active = 0;
+		int done = 0;
+		struct timespec timeout = {0, 100000000};
+		if(sigtimedwait(&sigs, NULL, &timeout) > 0) __atomic_store_n(&g_t_stop, clock_now_ns(), __ATOMIC_RELAXED);
+		for(k = 0; k < g_threads; ++k)
+		{
+			uint64_t t_done = __atomic_load_n(&g_replay_threads[k].t_done, __ATOMIC_ACQUIRE);
+			if(t_done)
+			{
+				++done;
+				if(t_done > t_end) t_end = t_done;
+			}
+			records += metric_get(&g_replay_threads[k].records);
+			errors += metric_get(&g_replay_threads[k].errors);
+			active += metric_get(&g_replay_threads[k].active);
+		}
+		if(done == g_threads) break;
+		uint64_t now = clock_now_ns();
+		if(now < t_report) continue;
+		t_report += 1000000000;
+		fprintf(stderr, "replay %.1fs: records=%lu/%lu (+%lu) open=%lu errors=%lu\n",
+			(double)(now - g_t_start) / 1e9, (unsigned long)records, (unsigned long)g_trace.count,
+			(unsigned long)(records - last), (unsigned long)active, (unsigned long)errors);
+		last = records;
+	}
+	uint64_t elapsed = t_end - g_t_start;
+	for(k = 0; k < g_threads; ++k) pthread_join(g_replay_threads[k].th, NULL);
+	replay_report((double)elapsed / 1e9);
+	trace_map_close(&g_trace);
+	return 0;
+}
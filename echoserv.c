@@ -27,6 +27,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,12 +40,455 @@
 #include <sys/epoll.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "uring.h"
+#include "slab.h"
+#include "bufpool.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "alog.h"
+#include "frame.h"
+#include "transport.h"
+#include "handover.h"
+#include "trace.h"
 
 #define PORT "8081"
 #define MAX_EVENTS 64
+#define MAX_REACTORS (256)
+#define MAX_LISTEN_ADDRS (8)	// -L
+#define MAX_LISTENERS (MAX_REACTORS + MAX_LISTEN_ADDRS)	// including sockets taken over with -H
+
+// 输出队列的高低水位线：超过高水位时暂停读取对端数据，降到低水位以下再恢复
+#define OUT_HIGH_WATER (256 * 1024)
+#define OUT_LOW_WATER (64 * 1024)
+
+// io_uring backend
+#define URING_ENTRIES (1024)
+#define URING_CQ_ENTRIES (8 * URING_ENTRIES)
+#define URING_NUM_BUFS (1024)	// provided buffers per reactor, power of 2
+#define URING_BUF_SIZE (4096)
+#define URING_BGID (0)
+#define URING_MAX_LINKED_SENDS (16)
+
+#define CONNS_PER_SLAB (256)
+#define CHUNKS_PER_SLAB (1024)
+
+// splice模式下每个连接的管道容量，管道写满时暂停读取
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+// 接收缓冲区池 (epoll backend)
+#define RECV_BUF_SIZE (16 * 1024)
+#define RECV_BUF_PREALLOC (64)
+
+// 每个连接每次事件最多读取的字节数和read()次数，用完后排到ready list队尾 (-r)
+#define READ_BUDGET_BYTES (256 * 1024)
+#define READ_BUDGET_CALLS (16)
+
+// framing mode: iovecs gathered into one writev(), must not exceed IOV_MAX
+#define FRAME_BATCH_IOV (256)
+
+// MSG_ZEROCOPY (-Z)：关闭连接时最多再等待多久让内核报告发送完成
+#define ZEROCOPY_LINGER_MS (5000)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY (60)
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY (0x4000000)
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY (5)
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED (1)
+#endif
+
+// 超时检查的精度
+#define TIMER_TICK_MS (10)
+
+// acceptor模式下，每个reactor的待接管连接队列的容量，必须是2的幂
+#define ACCEPT_QUEUE_SIZE (4096)
+
+// 平滑重启 (-H)：旧进程交出侦听socket之后，最多再等待多久让已有连接结束
+#define HANDOVER_DRAIN_MS (30 * 1000)
+#define HANDOVER_POLL_MS (100)
+#define HANDOVER_IO_TIMEOUT_MS (1000)	// send/recv on the handover channel
+
+// UDP模式：每次recvmmsg()/sendmmsg()处理的数据报个数和每个缓冲区的大小
+#define UDP_BATCH (64)
+#define UDP_BUF_SIZE (2048)
+#define UDP_GRO_BATCH (16)	// 开启GRO后每个缓冲区可能收到合并后的64KB数据
+#define UDP_GRO_BUF_SIZE (65536)
+#define UDP_SOCK_BUF_SIZE (4 * 1024 * 1024)	// SO_RCVBUF/SO_SNDBUF, capped by net.core.[rw]mem_max
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO (104)
+#endif
+
+// busy-poll模式：SO_BUSY_POLL_BUDGET和epoll的EPIOCSPARAMS (Linux 6.9) 使用的每次轮询的包数
+#define BUSY_POLL_BUDGET (64)
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL (69)
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET (70)
+#endif
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+enum BACKEND
+{
+	BACKEND_EPOLL,
+	BACKEND_URING
+};
+
+enum TCP_POLICY
+{
+	TCP_POLICY_DEFAULT,		// Nagle
+	TCP_POLICY_NODELAY,		// TCP_NODELAY: every write goes out at once
+	TCP_POLICY_CORK			// TCP_CORK while handling a read event, the echoes leave in full segments
+};
+
+enum ACCEPTOR
+{
+	ACCEPTOR_NONE,			// 每个reactor自己accept (SO_REUSEPORT)
+	ACCEPTOR_ROUND_ROBIN,
+	ACCEPTOR_LEAST_LOADED
+};
+
+/* ************************
+ * 单生产者（acceptor线程）/单消费者（reactor）的无锁fd队列
+ * */
+typedef struct fd_queue
+{
+	unsigned head __attribute__((aligned(64)));	// written by the consumer
+	unsigned tail __attribute__((aligned(64)));	// written by the producer
+	int fds[ACCEPT_QUEUE_SIZE] __attribute__((aligned(64)));
+}fd_queue_t;
+
+static inline int fd_queue_push(fd_queue_t * q, int fd)
+{
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if((tail - head) >= ACCEPT_QUEUE_SIZE) return -1; // full
+	q->fds[tail & (ACCEPT_QUEUE_SIZE - 1)] = fd;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline int fd_queue_pop(fd_queue_t * q)
+{
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if(head == tail) return -1; // empty
+	int fd = q->fds[head & (ACCEPT_QUEUE_SIZE - 1)];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return fd;
+}
+
+static inline unsigned fd_queue_length(fd_queue_t * q)
+{
+	return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+// UDP模式下每个reactor预先分配的recvmmsg()/sendmmsg()数组和缓冲区
+typedef struct udp_batch
+{
+	int fd;
+	int batch;
+	size_t buf_size;
+	int gro;	// UDP_GRO enabled on the socket
+	struct mmsghdr * msgs;
+	struct iovec * iovs;
+	struct sockaddr_storage * addrs;
+	unsigned char * bufs;
+	unsigned char * ctrls;	// one control buffer per message
+}udp_batch_t;
+
+/* ************************
+ * 每个reactor的统计：只由reactor线程写入，主线程随时读取输出（见stats_dump()）
+ * */
+typedef struct reactor_metrics
+{
+	uint64_t accepts;
+	uint64_t closes;
+	uint64_t timeouts;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t eagain_read;
+	uint64_t eagain_write;
+	uint64_t wakeups;		// epoll_wait()/io_uring_enter() returned with events
+	uint64_t events;
+	uint64_t frames;		// framing mode: requests dispatched
+	uint64_t out_queued;	// gauge: bytes waiting in output queues and splice pipes
+	uint64_t deferred;		// reads stopped by the read budget, resumed from the ready list
+	uint64_t throttled;		// reads stopped by the token bucket
+	uint64_t spin_ns;		// busy-poll mode: time spent in epoll_wait(..., 0)
+	uint64_t sleep_ns;		// busy-poll mode: time blocked after the spin budget ran out
+	uint64_t sleeps;
+	uint64_t zc_sends;		// sends with MSG_ZEROCOPY
+	uint64_t zc_copied;		// of which the kernel reported having copied the data anyway
+	hdr_hist_t batch;		// events per wakeup
+	hdr_hist_t latency;		// ns from the wakeup to the event being handled
+}reactor_metrics_t;
+
+/* ************************
+ * 侦听地址 (-L)：
+ * TCP由每个reactor各自绑定一个SO_REUSEPORT socket，由内核分配连接；
+ * AF_UNIX没有SO_REUSEPORT的负载均衡，所有reactor共享同一个侦听socket，
+ * 用EPOLLEXCLUSIVE注册，每个新连接只唤醒其中一个reactor。
+ * 连接建立以后，各种传输方式的处理完全相同。
+ * 从旧进程接管 (-H) 的socket各占一项，个数与reactor相同时每个reactor一个，否则共享。
+ * */
+typedef struct listener
+{
+	transport_addr_t addr;
+	char name[TRANSPORT_NAME_MAX];
+	int fd;	// shared by all reactors (AF_UNIX) or owned by the acceptor, -1 == one socket per reactor
+	int reactor;	// taken over per-reactor socket: the only reactor using fd, -1 == any
+}listener_t;
+
+typedef struct reactor_listener
+{
+	int fd;
+	listener_t * listener;
+}reactor_listener_t;
+
+/* ************************
+ * multi-reactor:
+ * 每个reactor线程拥有自己的epoll实例和一个SO_REUSEPORT的侦听socket，
+ * 由内核在各个侦听socket之间分配新连接，
+ * 连接被哪个reactor接受，之后就一直由该reactor处理，线程之间不共享任何状态。
+ * 
+ * acceptor模式 (-a)：
+ * 由一个单独的acceptor线程负责accept，reactor不再侦听端口，
+ * 新连接通过各reactor的无锁队列(accept_queue)交给reactor，再用eventfd唤醒。
+ * */
+typedef struct reactor
+{
+	int id;
+	int efd;	// epoll fd
+	reactor_listener_t listeners[MAX_LISTENERS];	// none in acceptor mode
+	int num_listeners;
+	int cpu;	// cpu to pin on, -1 == not pinned
+	pthread_t th;
+	
+	// acceptor and handover modes
+	int evfd;	// eventfd, signaled after new fds are pushed to accept_queue/handover_queue or to start draining
+	uint64_t evfd_value;
+	fd_queue_t * accept_queue;
+	fd_queue_t * handover_queue;	// connections taken over from the old process, pushed by the main thread
+	int num_conns;	// written by the reactor only, read by the acceptor
+	int draining;	// listeners handed over to a new process, no longer accepting
+	struct conn * conns;	// all connections of this reactor
+	
+	// connections that used up their read budget, served again after the current batch of events
+	struct conn * ready_head;
+	struct conn * ready_tail;
+	
+	// idle/read/write timeouts and rate limiting, NULL when neither is configured
+	timer_wheel_t * wheel;
+	uint64_t now_ms;	// CLOCK_MONOTONIC, updated once per loop iteration
+	
+	// io_uring backend
+	uring_t ring;
+	uring_buf_ring_t bufs;
+	struct conn * starved;	// connections waiting for free provided buffers
+	
+	slab_cache_t conn_slab;	// conn_t objects owned by this reactor
+	slab_cache_t chunk_slab;	// out_chunk_t objects
+	buffer_pool_t pool;		// receive buffers
+	
+	udp_batch_t * udp;	// UDP mode, listeners[0] is a datagram socket
+	
+	reactor_metrics_t metrics;
+}reactor_t;
+
+/* ************************
+ * 每个连接的输出队列：
+ * write()返回EAGAIN时，未发送完的数据挂到队列尾部，
+ * 并注册EPOLLOUT，等socket可写时再继续发送。
+ * 队列中的数据块只引用接收缓冲区（增加引用计数），不复制数据。
+ * */
+typedef struct out_chunk
+{
+	struct out_chunk * next;
+	char * data;
+	size_t length;
+	size_t offset;	// bytes already sent
+	pool_buf_t * buf;	// referenced receive buffer, NULL for io_uring provided buffers
+	int bid;		// io_uring provided buffer id, -1 == not a provided buffer
+	uint32_t zc_id;	// MSG_ZEROCOPY notification id (c->zc_head list)
+}out_chunk_t;
+
+typedef struct conn
+{
+	int fd;
+	struct conn * conn_prev;	// reactor's connection list
+	struct conn * conn_next;
+	uint32_t events;	// events currently registered in epoll
+	int read_paused;	// output queue above OUT_HIGH_WATER
+	int seqpacket;		// AF_UNIX SOCK_SEQPACKET: every read is one whole message
+	int ready;			// on the reactor's ready list
+	struct conn * ready_prev;
+	struct conn * ready_next;
+	size_t out_bytes;	// bytes pending in the output queue
+	out_chunk_t * out_head;
+	out_chunk_t * out_tail;
+	
+	// io_uring backend
+	int uring_ops;		// sqes in flight that reference this connection
+	int recv_armed;		// multishot recv in flight
+	int send_inflight;	// linked sends in flight, always the first ones in the queue
+	int closing;
+	int starved;		// recv stopped with ENOBUFS
+	struct conn * next_starved;
+	
+	// splice mode: socket -> pipe -> socket, pipe[0] == -1 when not used
+	int pipe[2];
+	size_t pipe_bytes;	// bytes spliced into the pipe but not yet out of it
+	size_t pipe_size;
+	
+	// timeouts: activity only updates the timestamps,
+	// the timer is re-armed lazily when it expires
+	timer_node_t timer;
+	uint64_t last_read_ms;
+	uint64_t last_write_ms;	// last send progress, or when output became pending
+	
+	// framing mode: received bytes not yet parsed into complete frames
+	pool_buf_t * in_buf;
+	size_t in_start;
+	size_t in_end;
+	
+	// token bucket (-T): reading stops while empty, the timer resumes it
+	uint64_t tokens;
+	uint64_t tokens_ms;	// last refill
+	uint64_t throttle_until;	// 0 == not throttled
+	
+	// MSG_ZEROCOPY (-Z): sent buffers stay referenced until the kernel reports completion
+	int zc_socket;		// SO_ZEROCOPY set, EPOLLERR may just mean completions are queued
+	int zerocopy;		// still worth it: cleared when the kernel reports having copied
+	uint32_t zc_next_id;	// notification id of the next MSG_ZEROCOPY send
+	out_chunk_t * zc_head;
+	out_chunk_t * zc_tail;
+	uint64_t zc_linger_until;	// closing, waiting for the last completions
+	int cork;			// TCP_CORK around each read event
+	
+	uint32_t trace_id;	// -C: connection id in the capture
+	uint64_t accepted_ms;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+}conn_t;
+
+/* ************************
+ * 连接表：以fd为下标的平面数组，O(1)查找。
+ * 表项本身从所属reactor的slab中分配，accept路径上没有malloc；
+ * 每个fd同一时刻只属于一个reactor，各reactor只读写自己的表项，不需要加锁。
+ * */
+static conn_t ** g_conn_table = NULL;
+static size_t g_conn_table_size = 0;
+
+static int g_num_reactors = 0;	// 0 == number of online cpus
+static int g_pin_cpu = 0;
+static unsigned g_busy_poll = 0;	// us to spin before blocking in epoll_wait(), 0 == disabled
+static int g_backend = BACKEND_EPOLL;
+static int g_splice = 0;
+static int g_udp = 0;
+static int g_framing = FRAME_NONE;
+static listener_t g_listeners[MAX_LISTENERS];
+static int g_num_listeners = 0;	// none given == tcp
+static int g_seqpacket = 0;	// any SOCK_SEQPACKET listener
+static int g_acceptor = ACCEPTOR_NONE;
+static unsigned g_idle_timeout = 0;	// ms, 0 == disabled
+static unsigned g_read_timeout = 0;
+static unsigned g_write_timeout = 0;
+static size_t g_read_budget_bytes = READ_BUDGET_BYTES;	// 0 == read until EAGAIN
+static unsigned g_read_budget_calls = READ_BUDGET_CALLS;
+static uint64_t g_rate_limit = 0;	// bytes per second per connection, 0 == unlimited
+static uint64_t g_rate_burst = 0;
+static size_t g_zerocopy = 0;	// MSG_ZEROCOPY for sends of at least this many bytes, 0 == disabled
+static int g_tcp_policy = TCP_POLICY_DEFAULT;
+static const char * g_stats_path = NULL;	// unix socket serving stats_dump()
+static const char * g_capture_path = NULL;	// -C: record connections and reads (trace.h)
+static trace_capture_t g_capture;	// one ring per reactor
+static uint32_t g_trace_conn_id = 0;
+static const char * g_handover_path = NULL;	// -H
+static transport_addr_t g_handover_addr;
+static int g_takeover_conns = 0;	// -K: ask the running instance for its idle connections too
+static int g_draining = 0;	// set by the main thread after the listeners are handed over
+static int g_handover_fd = -1;	// draining: channel to the new process
+static int g_handover_conns = 0;	// draining: reactors pass idle connections over g_handover_fd
+static int g_acceptor_efd = -1;
+static reactor_t g_reactors[MAX_REACTORS];
 
 static int serv_run();
-static int on_recv(int fd);
+static int serv_listen(const listener_t * l);
+static void * reactor_thread(void * param);
+static void * acceptor_thread(void * param);
+static int takeover_listeners(void);
+static int takeover_recv_conns(int sock);
+static int handover_start(int * sfd);
+static int handover_drained(uint64_t deadline);
+static int epoll_reactor_run(reactor_t * r);
+static int uring_reactor_run(reactor_t * r);
+static int on_recv(reactor_t * r, conn_t * c);
+static int on_send(reactor_t * r, conn_t * c);
+static int on_frame_recv(reactor_t * r, conn_t * c);
+static void conn_ready_push(reactor_t * r, conn_t * c);
+static void conn_ready_remove(reactor_t * r, conn_t * c);
+static void conn_ready_run(reactor_t * r);
+static void conn_close(reactor_t * r, conn_t * c);
+static void conn_zc_complete(reactor_t * r, conn_t * c);
+static int conn_zc_linger(reactor_t * r, conn_t * c);
+static int conn_table_init(void);
+static conn_t * conn_new(reactor_t * r, int fd);
+static int conn_splice_init(conn_t * c);
+static void stats_dump(FILE * fp);
+static int stats_listen(const char * path);
+static void stats_serve(int sfd);
+static udp_batch_t * udp_batch_new(int sfd);
+static void udp_on_readable(reactor_t * r);
+
+static inline uint64_t clock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t clock_now_ms(void)
+{
+	return clock_now_ns() / 1000000;
+}
 
 static int chutil_make_non_blocking(int fd)
 {
@@ -66,177 +511,3158 @@ static int chutil_make_non_blocking(int fd)
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* ************************
+ * busy-poll模式下让内核在socket/epoll上也忙轮询网卡队列，而不是等中断：
+ * 需要网卡驱动支持NAPI，loopback上没有效果；
+ * SO_BUSY_POLL超过net.core.busy_read时需要CAP_NET_ADMIN，失败只警告一次，不影响用户态的自旋
+ * */
+static void busy_poll_setup_socket(int fd)
 {
-	serv_run();
-	return 0;
+	static int warned = 0;
+	int usecs = (int)g_busy_poll;
+	int on = 1;
+	int budget = BUSY_POLL_BUDGET;
+	if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs))
+		|| setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on))
+		|| setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)))
+	{
+		if(!warned) fprintf(stderr, "busy-poll socket options: %s (kernel busy polling disabled)\n", strerror(errno));
+		warned = 1;
+	}
 }
 
-static int serv_run()
+static void busy_poll_setup_epoll(int efd)
 {
-	int rc;
-	int efd;
-	int sfd = -1;
-	struct addrinfo hints, * serv_info, * p;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	
-	rc = getaddrinfo("127.0.0.1", PORT, &hints, &serv_info);
-	if(rc)
+	static int warned = 0;
+	struct epoll_params params;
+	memset(&params, 0, sizeof(params));
+	params.busy_poll_usecs = g_busy_poll;
+	params.busy_poll_budget = BUSY_POLL_BUDGET;
+	params.prefer_busy_poll = 1;
+	if(ioctl(efd, EPIOCSPARAMS, &params))
 	{
-		fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
-		exit(1);
+		if(!warned) fprintf(stderr, "ioctl(EPIOCSPARAMS): %s (epoll busy polling disabled)\n", strerror(errno));
+		warned = 1;
 	}
-	for(p = serv_info; NULL != p; p = p->ai_next)
+}
+
+static void usage(const char * prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-p] [-B us] [-b epoll|uring] [-s] [-u] [-a rr|least]\n"
+		"\t\t[-L address]... [-f u32|varint] [-r bytes[,calls]] [-T rate[,burst]] [-I idle_ms] [-R read_ms] [-W write_ms]\n"
+		"\t\t[-Z bytes] [-N nagle|nodelay|cork] [-S stats_socket] [-C capture] [-H handover_socket [-K]] [-l level]\n"
+		"\t-t, --threads=N\tnumber of reactor threads (default: online cpus)\n"
+		"\t-p, --pin\tpin each reactor thread to one cpu\n"
+		"\t-B, --busy-poll=US\tspin on epoll_wait(..., 0) for up to US us before blocking,\n"
+		"\t\t\tset SO_BUSY_POLL/SO_PREFER_BUSY_POLL and pin reactors (epoll only)\n"
+		"\t-b, --backend=NAME\tevent loop backend: epoll (default) or uring\n"
+		"\t-s, --splice\techo with splice() through a per-connection pipe (epoll only)\n"
+		"\t-u, --udp\techo UDP datagrams with recvmmsg()/sendmmsg() (epoll only)\n"
+		"\t-L, --listen=ADDR\tlisten on ADDR, may be repeated (default: tcp):\n"
+		"\t\t\ttcp[:[HOST:]PORT], unix:PATH, unix:@NAME (abstract namespace),\n"
+		"\t\t\tseqpacket:PATH or seqpacket:@NAME\n"
+		"\t-f, --framing=TYPE\techo length-prefixed frames instead of raw bytes (epoll only):\n"
+		"\t\t\tu32 (4-byte big-endian length) or varint (LEB128 length)\n"
+		"\t-a, --acceptor=POLICY\taccept on a dedicated thread and hand connections\n"
+		"\t\t\tto reactors round-robin (rr) or to the least loaded one (least)\n"
+		"\t-r, --read-budget=BYTES[,CALLS]\tread at most BYTES bytes in at most CALLS reads per event,\n"
+		"\t\t\tthen serve the other ready connections first (default: %d,%d, 0 == unlimited; epoll only)\n"
+		"\t-T, --rate-limit=RATE[,BURST]\tlimit every connection to RATE bytes/s with a token bucket\n"
+		"\t\t\tof BURST bytes (default: RATE/10, at least %d; epoll only)\n"
+		"\t-Z, --zerocopy=BYTES\tsend echoes of at least BYTES bytes with MSG_ZEROCOPY (epoll only)\n"
+		"\t-N, --tcp-policy=POLICY\tnagle (default), nodelay (TCP_NODELAY) or cork\n"
+		"\t\t\t(TCP_CORK while handling each read event, epoll only);\n"
+		"\t\t\tunder nagle, echoes larger than 16 KB (one read) stall ~40 ms on the peer's\n"
+		"\t\t\tdelayed ACK, use nodelay for request/response traffic\n"
+		"\t-I, --idle-timeout=MS\tclose connections without any traffic for MS ms\n"
+		"\t-R, --read-timeout=MS\tclose connections that sent nothing for MS ms\n"
+		"\t-W, --write-timeout=MS\tclose connections whose pending output made no progress for MS ms\n"
+		"\t-S, --stats=PATH\tserve JSON statistics on the unix socket PATH\n"
+		"\t\t\t(SIGUSR1 always prints them to stdout)\n"
+		"\t-C, --capture=PATH\trecord connection opens, closes and read sizes to PATH (trace.h),\n"
+		"\t\t\tfor replay with echoclnt -P\n"
+		"\t-H, --handover=PATH\ttake over the listening sockets of the instance running with the\n"
+		"\t\t\tsame PATH (if any), then wait on PATH to hand them to the next one\n"
+		"\t-K, --handover-conns\talso take over the idle connections of the old instance\n"
+		"\t-l, --log-level=LEVEL\toff, error, warn, info (default), debug or trace;\n"
+		"\t\t\tthe ALOG_LEVEL environment variable takes precedence\n",
+		prog, READ_BUDGET_BYTES, READ_BUDGET_CALLS, RECV_BUF_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	static struct option options[] = 
 	{
-		sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if(-1 ==  sfd) continue;
-		
-		rc = bind(sfd, p->ai_addr, p->ai_addrlen);
-		if(rc)
+		{"threads", required_argument, 0, 't'},
+		{"pin", no_argument, 0, 'p'},
+		{"busy-poll", required_argument, 0, 'B'},
+		{"backend", required_argument, 0, 'b'},
+		{"splice", no_argument, 0, 's'},
+		{"udp", no_argument, 0, 'u'},
+		{"acceptor", required_argument, 0, 'a'},
+		{"framing", required_argument, 0, 'f'},
+		{"listen", required_argument, 0, 'L'},
+		{"read-budget", required_argument, 0, 'r'},
+		{"rate-limit", required_argument, 0, 'T'},
+		{"zerocopy", required_argument, 0, 'Z'},
+		{"tcp-policy", required_argument, 0, 'N'},
+		{"idle-timeout", required_argument, 0, 'I'},
+		{"read-timeout", required_argument, 0, 'R'},
+		{"write-timeout", required_argument, 0, 'W'},
+		{"stats", required_argument, 0, 'S'},
+		{"capture", required_argument, 0, 'C'},
+		{"handover", required_argument, 0, 'H'},
+		{"handover-conns", no_argument, 0, 'K'},
+		{"log-level", required_argument, 0, 'l'},
+		{"help", no_argument, 0, 'h'},
+		{NULL, 0, 0, 0}
+	};
+	int c;
+	int log_level = ALOG_INFO;
+	while(-1 != (c = getopt_long(argc, argv, "t:pB:b:sua:f:L:r:T:Z:N:I:R:W:S:C:H:Kl:h", options, NULL)))
+	{
+		switch(c)
 		{
-			perror("bind");
-			close(sfd);
-			continue;
+			case 't': g_num_reactors = atoi(optarg); break;
+			case 'p': g_pin_cpu = 1; break;
+			case 'B': g_busy_poll = (unsigned)atoi(optarg); break;
+			case 'b':
+				if(0 == strcmp(optarg, "epoll")) g_backend = BACKEND_EPOLL;
+				else if(0 == strcmp(optarg, "uring")) g_backend = BACKEND_URING;
+				else
+				{
+					fprintf(stderr, "unknown backend: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 's': g_splice = 1; break;
+			case 'u': g_udp = 1; break;
+			case 'a':
+				if(0 == strcmp(optarg, "rr")) g_acceptor = ACCEPTOR_ROUND_ROBIN;
+				else if(0 == strcmp(optarg, "least")) g_acceptor = ACCEPTOR_LEAST_LOADED;
+				else
+				{
+					fprintf(stderr, "unknown acceptor policy: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'f':
+				if(0 == strcmp(optarg, "u32")) g_framing = FRAME_U32;
+				else if(0 == strcmp(optarg, "varint")) g_framing = FRAME_VARINT;
+				else if(0 == strcmp(optarg, "none")) g_framing = FRAME_NONE;
+				else
+				{
+					fprintf(stderr, "unknown framing: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'L':
+				if(MAX_LISTEN_ADDRS == g_num_listeners)
+				{
+					fprintf(stderr, "too many listen addresses, at most %d.\n", MAX_LISTEN_ADDRS);
+					return 1;
+				}
+				if(transport_addr_parse(&g_listeners[g_num_listeners].addr, optarg, "127.0.0.1", PORT))
+				{
+					fprintf(stderr, "invalid listen address: %s\n", optarg);
+					return 1;
+				}
+				if(SOCK_SEQPACKET == g_listeners[g_num_listeners].addr.socktype) g_seqpacket = 1;
+				++g_num_listeners;
+				break;
+			case 'r':
+				{
+					unsigned long bytes = 0, calls = 0;
+					int n = sscanf(optarg, "%lu,%lu", &bytes, &calls);
+					if(n < 1)
+					{
+						fprintf(stderr, "invalid read budget: %s\n", optarg);
+						return 1;
+					}
+					g_read_budget_bytes = bytes;
+					g_read_budget_calls = (n > 1)?(unsigned)calls:(bytes?READ_BUDGET_CALLS:0);
+				}
+				break;
+			case 'T':
+				{
+					unsigned long rate = 0, burst = 0;
+					if(sscanf(optarg, "%lu,%lu", &rate, &burst) < 1)
+					{
+						fprintf(stderr, "invalid rate limit: %s\n", optarg);
+						return 1;
+					}
+					g_rate_limit = rate;
+					g_rate_burst = burst;
+				}
+				break;
+			case 'Z': g_zerocopy = (size_t)strtoul(optarg, NULL, 0); break;
+			case 'N':
+				if(0 == strcmp(optarg, "nagle")) g_tcp_policy = TCP_POLICY_DEFAULT;
+				else if(0 == strcmp(optarg, "nodelay")) g_tcp_policy = TCP_POLICY_NODELAY;
+				else if(0 == strcmp(optarg, "cork")) g_tcp_policy = TCP_POLICY_CORK;
+				else
+				{
+					fprintf(stderr, "unknown tcp policy: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'I': g_idle_timeout = (unsigned)atoi(optarg); break;
+			case 'R': g_read_timeout = (unsigned)atoi(optarg); break;
+			case 'W': g_write_timeout = (unsigned)atoi(optarg); break;
+			case 'S': g_stats_path = optarg; break;
+			case 'C': g_capture_path = optarg; break;
+			case 'H':
+				{
+					char spec[16 + sizeof(g_handover_addr.un.sun_path)];
+					snprintf(spec, sizeof(spec), "seqpacket:%s", optarg);
+					if(transport_addr_parse(&g_handover_addr, spec, NULL, NULL))
+					{
+						fprintf(stderr, "invalid handover socket: %s\n", optarg);
+						return 1;
+					}
+					g_handover_path = optarg;
+				}
+				break;
+			case 'K': g_takeover_conns = 1; break;
+			case 'l':
+				log_level = alog_parse_level(optarg);
+				if(log_level < 0)
+				{
+					fprintf(stderr, "unknown log level: %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return (c == 'h')?0:1;
 		}
-		break;
 	}
 	
-	if(NULL == p)
+	if(g_splice && BACKEND_EPOLL != g_backend)
 	{
-		perror("getaddrinfo");
-		freeaddrinfo(serv_info);
-		close(sfd);
-		exit(1);
+		fprintf(stderr, "splice mode is only available with the epoll backend, ignored.\n");
+		g_splice = 0;
 	}
-	
-	char hbuf[NI_MAXHOST] = "", sbuf[NI_MAXSERV] = "";
-	rc = getnameinfo(p->ai_addr, p->ai_addrlen, 
-		hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
-		NI_NUMERICHOST | NI_NUMERICSERV);
-	if(0 == rc)
-	{	
-		printf("listening on %s:%s\n", hbuf, sbuf);
+	if(g_busy_poll)
+	{
+		if(BACKEND_EPOLL != g_backend)
+		{
+			fprintf(stderr, "busy-poll mode is only available with the epoll backend.\n");
+			return 1;
+		}
+		// 自旋的线程不能在cpu之间迁移，也不应该和其他reactor共用一个cpu
+		g_pin_cpu = 1;
 	}
-	freeaddrinfo(serv_info);
-	chutil_make_non_blocking(sfd);	
-	rc = listen(sfd, SOMAXCONN);
-	if(-1 == rc)
+	if(g_rate_limit && 0 == g_rate_burst)
 	{
-		perror("listen");
-		abort();
+		g_rate_burst = g_rate_limit / 10;
+		if(g_rate_burst < RECV_BUF_SIZE) g_rate_burst = RECV_BUF_SIZE;
 	}
-	
-	struct epoll_event events[1 + MAX_EVENTS];
-	efd = epoll_create1(0);
-	
-	memset(events, 0, sizeof(events));
-	events[MAX_EVENTS].data.fd = sfd;
-	events[MAX_EVENTS].events = EPOLLIN | EPOLLET;
-	
-	rc = epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &events[MAX_EVENTS]);
-	do
+	if(g_rate_limit && g_rate_burst < g_rate_limit * 2 * TIMER_TICK_MS / 1000)
 	{
-		int n, i;
-		int fd;
-		n = epoll_wait(efd, &events[0], MAX_EVENTS, -1);
-		if(n <= 0)
+		// 桶太小时，定时器的精度不够维持RATE
+		g_rate_burst = g_rate_limit * 2 * TIMER_TICK_MS / 1000;
+		fprintf(stderr, "rate limit burst raised to %lu bytes (two timer ticks).\n", (unsigned long)g_rate_burst);
+	}
+	if(g_rate_limit && BACKEND_EPOLL != g_backend)
+	{
+		fprintf(stderr, "rate limiting is only available with the epoll backend, ignored.\n");
+		g_rate_limit = 0;
+	}
+	if(g_zerocopy && (BACKEND_EPOLL != g_backend || g_splice))
+	{
+		fprintf(stderr, "zerocopy sends are only available with the epoll backend without splice, ignored.\n");
+		g_zerocopy = 0;
+	}
+	if(TCP_POLICY_CORK == g_tcp_policy && BACKEND_EPOLL != g_backend)
+	{
+		fprintf(stderr, "tcp policy cork is only available with the epoll backend, ignored.\n");
+		g_tcp_policy = TCP_POLICY_DEFAULT;
+	}
+	if(0 == g_num_listeners) transport_addr_parse(&g_listeners[g_num_listeners++].addr, "tcp", "127.0.0.1", PORT);
+	if(g_seqpacket && BACKEND_EPOLL != g_backend)
+	{
+		// provided buffers are smaller than a message may be, recv would truncate it
+		fprintf(stderr, "seqpacket listeners are only available with the epoll backend.\n");
+		return 1;
+	}
+	if(g_framing && !g_udp)
+	{
+		if(BACKEND_EPOLL != g_backend)
 		{
-			perror("epoll_wait");
-			break;
+			fprintf(stderr, "framing is only available with the epoll backend.\n");
+			return 1;
 		}
-		
-		for(i = 0; i < n; ++i)
+		if(g_splice)
 		{
-			if(events[i].events & EPOLLERR ||
-				events[i].events & EPOLLHUP ||
-				events[i].events & EPOLLRDHUP ||
-				!(events[i].events & EPOLLIN)
-				)
-			{
-				perror("epoll_wait");
-				close(events[i].data.fd);
-				continue;
-			}
-			
-			if(events[i].data.fd == sfd) // incomming connections
-			{
-				struct sockaddr_storage ss;
-				socklen_t slen = 0;
-				fd = accept(sfd, (struct sockaddr *)&ss, &slen); 
-				if(-1 == fd)
-				{
-					if(errno == EAGAIN || errno == EWOULDBLOCK)
-					{
-						break;
-					}else 
-					{
-						perror("accept");
-						break;
-					}
-				}
-				rc = getnameinfo((struct sockaddr *)&ss, slen, 
-					hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
-					NI_NUMERICHOST | NI_NUMERICSERV);
-				if(0 == rc)
-				{
-					printf("connected from %s:%s\n", hbuf, sbuf);
-				}
-				chutil_make_non_blocking(fd);
-				events[MAX_EVENTS].data.fd = fd;
-				events[MAX_EVENTS].events = EPOLLIN | EPOLLET;
-				rc = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &events[MAX_EVENTS]);
-				if(rc)
-				{
-					perror("epoll_ctl");
-					abort();
-				}
-				continue;
-			}else
-			{
-				rc = on_recv(fd);
-				continue;
-			}
+			fprintf(stderr, "splice mode cannot parse frames, ignored.\n");
+			g_splice = 0;
 		}
-		
-	}while(1);
+	}
+	if(g_udp)
+	{
+		if(BACKEND_EPOLL != g_backend)
+		{
+			fprintf(stderr, "UDP mode is only available with the epoll backend.\n");
+			return 1;
+		}
+		if(1 != g_num_listeners || AF_UNIX == g_listeners[0].addr.family)
+		{
+			fprintf(stderr, "UDP mode needs exactly one tcp listen address.\n");
+			return 1;
+		}
+		if(g_handover_path)
+		{
+			fprintf(stderr, "handover mode is not available for UDP.\n");
+			return 1;
+		}
+		if(g_splice || g_framing || ACCEPTOR_NONE != g_acceptor || g_zerocopy || TCP_POLICY_DEFAULT != g_tcp_policy
+			|| g_capture_path)
+		{
+			fprintf(stderr, "splice, framing, acceptor, zerocopy, tcp policy and capture options do not apply to UDP, ignored.\n");
+			g_capture_path = NULL;
+			g_splice = 0;
+			g_framing = FRAME_NONE;
+			g_acceptor = ACCEPTOR_NONE;
+			g_zerocopy = 0;
+			g_tcp_policy = TCP_POLICY_DEFAULT;
+		}
+	}
 	
+	if(g_takeover_conns && NULL == g_handover_path)
+	{
+		fprintf(stderr, "-K needs a handover socket (-H), ignored.\n");
+		g_takeover_conns = 0;
+	}
 	
-	close(sfd);
+	if(alog_init(STDERR_FILENO, log_level)) perror("alog_init");
+	serv_run();
+	alog_shutdown();
 	return 0;
 }
 
-
-static int on_recv(int fd)
+static int serv_run()
 {
-	int done = 0;
-	ssize_t cb;
-	char buf[4096];
-	while(1)
+	int rc;
+	int i, k;
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_cpus < 1) num_cpus = 1;
+	
+	if(g_num_reactors <= 0) g_num_reactors = (int)num_cpus;
+	if(g_num_reactors > MAX_REACTORS) g_num_reactors = MAX_REACTORS;
+	
+	if(conn_table_init()) exit(1);
+	
+	pthread_t acceptor_th;
+	for(k = 0; k < g_num_listeners; ++k)
 	{
-		cb = read(fd, buf, sizeof(buf));
-		if(-1 == cb)
+		listener_t * l = &g_listeners[k];
+		transport_addr_name(&l->addr, l->name, sizeof(l->name));
+		l->fd = -1;
+		l->reactor = -1;
+	}
+	
+	// 有旧进程在运行时直接使用它的侦听socket，不需要bind
+	int takeover_fd = -1;
+	if(g_handover_path) takeover_fd = takeover_listeners();
+	
+	// AF_UNIX的侦听socket只创建一个，所有reactor共享；acceptor模式下所有侦听socket都归acceptor
+	for(k = 0; k < g_num_listeners; ++k)
+	{
+		listener_t * l = &g_listeners[k];
+		if(l->fd >= 0 || (AF_UNIX != l->addr.family && ACCEPTOR_NONE == g_acceptor)) continue;
+		l->fd = serv_listen(l);
+		if(l->fd < 0) exit(1);
+	}
+	
+	// 先在主线程中创建所有的侦听socket，任何一个bind失败都直接退出
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		reactor_t * r = &g_reactors[i];
+		r->id = i;
+		r->cpu = g_pin_cpu?(int)(i % num_cpus):-1;
+		slab_cache_init(&r->conn_slab, sizeof(conn_t), CONNS_PER_SLAB);
+		r->now_ms = clock_now_ms();
+		if(g_idle_timeout || g_read_timeout || g_write_timeout || g_rate_limit || g_zerocopy)
 		{
-			if(EAGAIN != errno)
+			r->wheel = malloc(sizeof(timer_wheel_t));
+			if(NULL == r->wheel)
 			{
-				perror("read");
-				done = 1;
+				perror("malloc");
+				exit(1);
 			}
-			break;
-		}else if(0 == cb) // remote close the connection
+			timer_wheel_init(r->wheel, TIMER_TICK_MS, r->now_ms);
+		}
+		slab_cache_init(&r->chunk_slab, sizeof(out_chunk_t), CHUNKS_PER_SLAB);
+		if(BACKEND_EPOLL == g_backend && buffer_pool_init(&r->pool, RECV_BUF_SIZE, RECV_BUF_PREALLOC))
 		{
-			done = 1;
-			break;
+			perror("buffer_pool_init");
+			exit(1);
+		}
+		r->evfd = -1;
+		if(ACCEPTOR_NONE == g_acceptor)
+		{
+			for(k = 0; k < g_num_listeners; ++k)
+			{
+				listener_t * l = &g_listeners[k];
+				if(l->reactor >= 0 && l->reactor != i) continue;
+				reactor_listener_t * rl = &r->listeners[r->num_listeners++];
+				rl->listener = l;
+				rl->fd = (l->fd >= 0)?l->fd:serv_listen(l);
+				if(rl->fd < 0) exit(1);
+			}
+			if(g_udp && NULL == (r->udp = udp_batch_new(r->listeners[0].fd))) exit(1);
+			if(g_udp && 0 == i) printf("udp: batch %d x %lu bytes, GRO/GSO %s\n", r->udp->batch, 
+				(unsigned long)r->udp->buf_size, r->udp->gro?"on":"off");
 		}else
 		{
-			fprintf(stdout, "cb = %d\n", (int)cb);			
+			r->accept_queue = aligned_alloc(64, sizeof(fd_queue_t));
+			if(NULL == r->accept_queue)
+			{
+				perror("aligned_alloc");
+				exit(1);
+			}
+			memset(r->accept_queue, 0, sizeof(fd_queue_t));
+		}
+		if(takeover_fd >= 0 && g_takeover_conns)
+		{
+			r->handover_queue = aligned_alloc(64, sizeof(fd_queue_t));
+			if(NULL == r->handover_queue)
+			{
+				perror("aligned_alloc");
+				exit(1);
+			}
+			memset(r->handover_queue, 0, sizeof(fd_queue_t));
+		}
+		if(ACCEPTOR_NONE != g_acceptor || g_handover_path)
+		{
+			r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(r->evfd < 0)
+			{
+				perror("eventfd");
+				exit(1);
+			}
+		}
+		
+		// io_uring实例在reactor线程中创建 (IORING_SETUP_SINGLE_ISSUER)
+		r->efd = -1;
+		r->ring.fd = -1;
+		if(BACKEND_EPOLL != g_backend) continue;
+		
+		r->efd = epoll_create1(0);
+		if(-1 == r->efd)
+		{
+			perror("epoll_create1");
+			exit(1);
 		}
+		if(g_busy_poll) busy_poll_setup_epoll(r->efd);
 	}
-	if(done)
+	if(g_busy_poll)
 	{
-		printf("close connection on [%d]\n", fd);
-		close(fd);
+		printf("busy-poll: spin up to %u us before blocking\n", g_busy_poll);
+		if(g_num_reactors > num_cpus) fprintf(stderr, "busy-poll: %d reactors share %ld cpus, spinning threads will compete.\n", 
+			g_num_reactors, num_cpus);
 	}
-	return done;
+	
+	int stats_sfd = -1;
+	if(g_stats_path)
+	{
+		stats_sfd = stats_listen(g_stats_path);
+		if(stats_sfd < 0) exit(1);
+	}
+	
+	if(g_capture_path)
+	{
+		if(trace_capture_init(&g_capture, g_capture_path, g_num_reactors))
+		{
+			fprintf(stderr, "capture %s: %s\n", g_capture_path, strerror(errno));
+			exit(1);
+		}
+		printf("capturing connections to %s\n", g_capture_path);
+	}
+	
+	// 旧进程交出侦听socket时已经关闭了handover socket，这里接着侦听，等待下一次重启
+	int handover_sfd = -1;
+	if(g_handover_path)
+	{
+		handover_sfd = handover_listen(&g_handover_addr);
+		if(handover_sfd < 0)
+		{
+			fprintf(stderr, "handover socket %s: %s\n", g_handover_path, strerror(errno));
+			exit(1);
+		}
+		printf("handover on %s\n", g_handover_path);
+	}
+	
+	// 在创建reactor线程之前屏蔽信号，统一由主线程通过signalfd处理
+	sigset_t sigs;
+	int sig = 0;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	int sigfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	if(sigfd < 0)
+	{
+		perror("signalfd");
+		exit(1);
+	}
+	
+	printf("%d %s reactor(s) started%s\n", g_num_reactors, 
+		(BACKEND_URING == g_backend)?"io_uring":"epoll",
+		g_pin_cpu?", pinned to cpus":"");
+	
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		rc = pthread_create(&g_reactors[i].th, NULL, reactor_thread, &g_reactors[i]);
+		if(0 != rc)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			exit(1);
+		}
+	}
+	if(ACCEPTOR_NONE != g_acceptor)
+	{
+		rc = pthread_create(&acceptor_th, NULL, acceptor_thread, NULL);
+		if(0 != rc)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			exit(1);
+		}
+		printf("acceptor thread started (%s)\n", (ACCEPTOR_ROUND_ROBIN == g_acceptor)?"round-robin":"least-loaded");
+	}
+	
+	/* ************************
+	 * 主线程只负责信号、统计socket和平滑重启：SIGUSR1输出一次统计，SIGINT/SIGTERM退出；
+	 * 交出侦听socket之后定期检查，已有的连接都结束了（或者超过HANDOVER_DRAIN_MS）就退出
+	 * */
+	struct pollfd pfds[4];	// poll() ignores negative fds
+	uint64_t drain_deadline = 0;
+	pfds[0].fd = sigfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = stats_sfd;
+	pfds[1].events = POLLIN;
+	pfds[2].fd = handover_sfd;
+	pfds[2].events = POLLIN;
+	pfds[3].fd = takeover_fd;	// connections from the old process (-K)
+	pfds[3].events = POLLIN;
+	while(0 == sig)
+	{
+		rc = poll(pfds, 4, drain_deadline?HANDOVER_POLL_MS:-1);
+		if(rc < 0)
+		{
+			if(EINTR == errno) continue;
+			perror("poll");
+			break;
+		}
+		if(stats_sfd >= 0 && (pfds[1].revents & POLLIN)) stats_serve(stats_sfd);
+		if(pfds[2].fd >= 0 && (pfds[2].revents & POLLIN))
+		{
+			if(0 == handover_start(&pfds[2].fd)) drain_deadline = clock_now_ms() + HANDOVER_DRAIN_MS;
+		}
+		if(pfds[3].fd >= 0 && pfds[3].revents) pfds[3].fd = takeover_recv_conns(pfds[3].fd);
+		if(drain_deadline && handover_drained(drain_deadline)) break;
+		if(pfds[0].revents & POLLIN)
+		{
+			struct signalfd_siginfo si;
+			if(read(sigfd, &si, sizeof(si)) != sizeof(si)) continue;
+			if(SIGUSR1 == si.ssi_signo)
+			{
+				stats_dump(stdout);
+				fflush(stdout);
+				continue;
+			}
+			sig = (int)si.ssi_signo;
+		}
+	}
+	if(sig) printf("\n%s received, exit.\n", strsignal(sig));
+	else printf("handover finished, exit.\n");
+	stats_dump(stdout);
+	if(g_capture_path)
+	{
+		uint64_t dropped = trace_capture_shutdown(&g_capture);
+		printf("capture: %lu records written to %s, %lu dropped\n", 
+			(unsigned long)g_capture.records, g_capture_path, (unsigned long)dropped);
+	}
+	// 交出去以后这些路径已经属于新进程
+	if(!drain_deadline)
+	{
+		if(stats_sfd >= 0) unlink(g_stats_path);
+		if(handover_sfd >= 0 && !transport_addr_is_abstract(&g_handover_addr)) unlink(g_handover_addr.un.sun_path);
+		for(k = 0; k < g_num_listeners; ++k)
+		{
+			const transport_addr_t * addr = &g_listeners[k].addr;
+			if(AF_UNIX == addr->family && !transport_addr_is_abstract(addr)) unlink(addr->un.sun_path);
+		}
+	}
+	
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		char name[32];
+		if(BACKEND_EPOLL != g_backend) break;
+		snprintf(name, sizeof(name), "reactor [%d] recv pool", i);
+		buffer_pool_report(&g_reactors[i].pool, stdout, name);
+	}
+	return 0;
+}
+
+/* ************************
+ * AF_UNIX：文件系统中的路径先删除旧文件再bind，退出时删除；
+ * 抽象地址随最后一个引用它的socket关闭而消失，不需要清理
+ * */
+static int serv_listen_unix(const listener_t * l)
+{
+	const transport_addr_t * addr = &l->addr;
+	int sfd = socket(AF_UNIX, addr->socktype | SOCK_CLOEXEC, 0);
+	if(-1 == sfd)
+	{
+		perror("socket");
+		return -1;
+	}
+	if(!transport_addr_is_abstract(addr)) unlink(addr->un.sun_path);
+	if(bind(sfd, (const struct sockaddr *)&addr->un, addr->un_len))
+	{
+		fprintf(stderr, "bind %s: %s\n", l->name, strerror(errno));
+		close(sfd);
+		return -1;
+	}
+	chutil_make_non_blocking(sfd);
+	if(listen(sfd, SOMAXCONN))
+	{
+		perror("listen");
+		abort();
+	}
+	printf("listening on %s\n", l->name);
+	return sfd;
+}
+
+static int serv_listen(const listener_t * l)
+{
+	int rc;
+	int sfd = -1;
+	int on = 1;
+	int socktype = g_udp?SOCK_DGRAM:SOCK_STREAM;
+	if(AF_UNIX == l->addr.family) return serv_listen_unix(l);
+	
+	struct addrinfo hints, * serv_info, * p;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	
+	rc = getaddrinfo(l->addr.host, l->addr.port, &hints, &serv_info);
+	if(rc)
+	{
+		fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(rc));
+		return -1;
+	}
+	for(p = serv_info; NULL != p; p = p->ai_next)
+	{
+		sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if(-1 ==  sfd) continue;
+		
+		// 所有reactor绑定同一个端口，由内核做负载均衡
+		rc = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		if(rc)
+		{
+			perror("setsockopt(SO_REUSEPORT)");
+			close(sfd);
+			continue;
+		}
+		
+		rc = bind(sfd, p->ai_addr, p->ai_addrlen);
+		if(rc)
+		{
+			perror("bind");
+			close(sfd);
+			continue;
+		}
+		break;
+	}
+	
+	if(NULL == p)
+	{
+		fprintf(stderr, "no address to listen on.\n");
+		freeaddrinfo(serv_info);
+		return -1;
+	}
+	
+	char hbuf[NI_MAXHOST] = "", sbuf[NI_MAXSERV] = "";
+	rc = getnameinfo(p->ai_addr, p->ai_addrlen, 
+		hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+		NI_NUMERICHOST | NI_NUMERICSERV);
+	if(0 == rc)
+	{	
+		printf("listening on %s:%s%s\n", hbuf, sbuf, (SOCK_DGRAM == socktype)?" (udp)":"");
+	}
+	freeaddrinfo(serv_info);
+	chutil_make_non_blocking(sfd);	
+	if(g_busy_poll) busy_poll_setup_socket(sfd);	// inherited by accepted sockets
+	if(SOCK_DGRAM == socktype) return sfd;
+	rc = listen(sfd, SOMAXCONN);
+	if(-1 == rc)
+	{
+		perror("listen");
+		abort();
+	}
+	return sfd;
+}
+
+static void * reactor_thread(void * param)
+{
+	reactor_t * r = (reactor_t *)param;
+	int rc;
+	char name[16];
+	
+	snprintf(name, sizeof(name), "reactor-%d", r->id);
+	alog_set_thread_name(name);
+	if(r->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(r->cpu, &cpus);
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if(rc) fprintf(stderr, "reactor [%d]: pthread_setaffinity_np failed: %s\n", r->id, strerror(rc));
+	}
+	
+	if(BACKEND_URING == g_backend) rc = uring_reactor_run(r);
+	else rc = epoll_reactor_run(r);
+	
+	pthread_exit((void *)(long)rc);
+}
+
+/* ************************
+ * 统计输出：每次输出一行JSON，
+ * 包括每个reactor的计数器、当前队列深度、每次唤醒处理的事件数和事件处理延迟的分布，
+ * 以及所有reactor合计的结果。
+ * 计数器由各reactor无锁更新，这里读到的是近似一致的快照。
+ * */
+static inline void reactor_metrics_wakeup(reactor_t * r, int n)
+{
+	metric_add(&r->metrics.wakeups, 1);
+	metric_add(&r->metrics.events, (uint64_t)n);
+	hdr_hist_record(&r->metrics.batch, (uint64_t)n);
+}
+
+static void stats_print_counters(FILE * fp, const reactor_metrics_t * m, uint64_t conns, uint64_t accept_queue)
+{
+	fprintf(fp, "\"conns\":%lu,\"accepts\":%lu,\"closes\":%lu,\"timeouts\":%lu,"
+		"\"bytes_in\":%lu,\"bytes_out\":%lu,\"eagain_read\":%lu,\"eagain_write\":%lu,"
+		"\"wakeups\":%lu,\"events\":%lu,\"frames\":%lu,\"out_queued\":%lu,\"accept_queue\":%lu,"
+		"\"deferred\":%lu,\"throttled\":%lu,\"spin_ns\":%lu,\"sleep_ns\":%lu,\"sleeps\":%lu,"
+		"\"zc_sends\":%lu,\"zc_copied\":%lu",
+		(unsigned long)conns,
+		(unsigned long)metric_get(&m->accepts),
+		(unsigned long)metric_get(&m->closes),
+		(unsigned long)metric_get(&m->timeouts),
+		(unsigned long)metric_get(&m->bytes_in),
+		(unsigned long)metric_get(&m->bytes_out),
+		(unsigned long)metric_get(&m->eagain_read),
+		(unsigned long)metric_get(&m->eagain_write),
+		(unsigned long)metric_get(&m->wakeups),
+		(unsigned long)metric_get(&m->events),
+		(unsigned long)metric_get(&m->frames),
+		(unsigned long)metric_get(&m->out_queued),
+		(unsigned long)accept_queue,
+		(unsigned long)metric_get(&m->deferred),
+		(unsigned long)metric_get(&m->throttled),
+		(unsigned long)metric_get(&m->spin_ns),
+		(unsigned long)metric_get(&m->sleep_ns),
+		(unsigned long)metric_get(&m->sleeps),
+		(unsigned long)metric_get(&m->zc_sends),
+		(unsigned long)metric_get(&m->zc_copied));
+}
+
+static void stats_dump(FILE * fp)
+{
+	int i;
+	// 每个直方图约9KB，放在堆上，主线程的栈不需要很大
+	reactor_metrics_t * total = calloc(1, sizeof(reactor_metrics_t));
+	hdr_hist_t * hist = malloc(sizeof(hdr_hist_t));
+	uint64_t total_conns = 0, total_queued = 0;
+	if(NULL == total || NULL == hist)
+	{
+		perror("stats_dump");
+		free(total);
+		free(hist);
+		return;
+	}
+	
+	fprintf(fp, "{\"time_ms\":%lu,\"backend\":\"%s\",\"reactors\":[",
+		(unsigned long)clock_now_ms(), (BACKEND_URING == g_backend)?"uring":"epoll");
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		reactor_t * r = &g_reactors[i];
+		reactor_metrics_t * m = &r->metrics;
+		uint64_t conns = (uint64_t)__atomic_load_n(&r->num_conns, __ATOMIC_RELAXED);
+		uint64_t queued = r->accept_queue?fd_queue_length(r->accept_queue):0;
+		
+		fprintf(fp, "%s{\"id\":%d,", i?",":"", r->id);
+		stats_print_counters(fp, m, conns, queued);
+		memset(hist, 0, sizeof(*hist));
+		hdr_hist_merge(hist, &m->batch);
+		fprintf(fp, ",\"batch\":");
+		hdr_hist_print_json(hist, fp);
+		memset(hist, 0, sizeof(*hist));
+		hdr_hist_merge(hist, &m->latency);
+		fprintf(fp, ",\"latency_ns\":");
+		hdr_hist_print_json(hist, fp);
+		fprintf(fp, "}");
+		
+		total_conns += conns;
+		total_queued += queued;
+		total->accepts += metric_get(&m->accepts);
+		total->closes += metric_get(&m->closes);
+		total->timeouts += metric_get(&m->timeouts);
+		total->bytes_in += metric_get(&m->bytes_in);
+		total->bytes_out += metric_get(&m->bytes_out);
+		total->eagain_read += metric_get(&m->eagain_read);
+		total->eagain_write += metric_get(&m->eagain_write);
+		total->wakeups += metric_get(&m->wakeups);
+		total->events += metric_get(&m->events);
+		total->frames += metric_get(&m->frames);
+		total->out_queued += metric_get(&m->out_queued);
+		total->deferred += metric_get(&m->deferred);
+		total->throttled += metric_get(&m->throttled);
+		total->spin_ns += metric_get(&m->spin_ns);
+		total->sleep_ns += metric_get(&m->sleep_ns);
+		total->sleeps += metric_get(&m->sleeps);
+		total->zc_sends += metric_get(&m->zc_sends);
+		total->zc_copied += metric_get(&m->zc_copied);
+		hdr_hist_merge(&total->batch, &m->batch);
+		hdr_hist_merge(&total->latency, &m->latency);
+	}
+	fprintf(fp, "],\"total\":{");
+	stats_print_counters(fp, total, total_conns, total_queued);
+	fprintf(fp, ",\"batch\":");
+	hdr_hist_print_json(&total->batch, fp);
+	fprintf(fp, ",\"latency_ns\":");
+	hdr_hist_print_json(&total->latency, fp);
+	fprintf(fp, "}}\n");
+	
+	free(hist);
+	free(total);
+}
+
+static int stats_listen(const char * path)
+{
+	struct sockaddr_un addr;
+	int sfd;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "stats socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(-1 == sfd)
+	{
+		perror("socket");
+		return -1;
+	}
+	unlink(path); // 上次运行遗留的socket文件
+	if(bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(sfd, 16))
+	{
+		perror("bind stats socket");
+		close(sfd);
+		return -1;
+	}
+	printf("stats on unix:%s\n", path);
+	return sfd;
+}
+
+// 每个连接输出一次统计后关闭，例如: socat - UNIX-CONNECT:PATH
+static void stats_serve(int sfd)
+{
+	char * text = NULL;
+	size_t size = 0;
+	int fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+	if(-1 == fd)
+	{
+		if(EINTR != errno && EAGAIN != errno) perror("accept4");
+		return;
+	}
+	
+	// 不读取的客户端不能让主线程一直阻塞
+	struct timeval tv = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	
+	FILE * fp = open_memstream(&text, &size);
+	if(NULL == fp)
+	{
+		perror("open_memstream");
+		close(fd);
+		return;
+	}
+	stats_dump(fp);
+	fclose(fp);
+	
+	size_t offset = 0;
+	while(offset < size)
+	{
+		ssize_t cb = send(fd, text + offset, size - offset, MSG_NOSIGNAL);
+		if(cb <= 0)
+		{
+			if(cb < 0 && EINTR == errno) continue;
+			break;
+		}
+		offset += cb;
+	}
+	free(text);
+	close(fd);
+}
+
+/* ************************
+ * acceptor线程：
+ * 侦听socket有新连接时，一直用accept4()接受到EAGAIN为止，
+ * 按round-robin或最少连接数选择reactor，把fd放入该reactor的无锁队列，
+ * 一批连接分发完之后，每个收到新连接的reactor只用eventfd唤醒一次。
+ * */
+static int acceptor_pick(unsigned * next)
+{
+	int i;
+	if(ACCEPTOR_ROUND_ROBIN == g_acceptor)
+	{
+		i = (int)(*next % (unsigned)g_num_reactors);
+		++*next;
+		return i;
+	}
+	
+	// least loaded: 已有连接数 + 队列中尚未接管的连接数
+	int best = 0;
+	unsigned best_load = (unsigned)-1;
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		reactor_t * r = &g_reactors[(*next + i) % g_num_reactors];
+		unsigned load = (unsigned)__atomic_load_n(&r->num_conns, __ATOMIC_RELAXED) + fd_queue_length(r->accept_queue);
+		if(load < best_load)
+		{
+			best_load = load;
+			best = r->id;
+		}
+	}
+	++*next; // 负载相同时轮流选择
+	return best;
+}
+
+static inline void reactor_wakeup(reactor_t * r)
+{
+	uint64_t one = 1;
+	if(write(r->evfd, &one, sizeof(one)) < 0 && EAGAIN != errno) alog_error("write eventfd: %s", strerror(errno));
+}
+
+// edge-triggered: 必须accept到EAGAIN为止
+static void acceptor_drain(int sfd, unsigned * next, char * pending)
+{
+	int i;
+	while(1)
+	{
+		int fd = accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(-1 == fd)
+		{
+			if(EINTR == errno || ECONNABORTED == errno) continue;
+			if(EAGAIN != errno && EWOULDBLOCK != errno) alog_error("accept4: %s", strerror(errno));
+			break;
+		}
+		
+		// 队列已满时依次尝试其他reactor，全部满了则拒绝该连接
+		int id = acceptor_pick(next);
+		for(i = 0; i < g_num_reactors; ++i)
+		{
+			reactor_t * r = &g_reactors[(id + i) % g_num_reactors];
+			if(0 == fd_queue_push(r->accept_queue, fd))
+			{
+				pending[r->id] = 1;
+				break;
+			}
+		}
+		if(i == g_num_reactors)
+		{
+			alog_warn("all reactors are overloaded, drop connection [%d]", fd);
+			close(fd);
+		}
+	}
+}
+
+static void * acceptor_thread(void * param)
+{
+	int efd;
+	int rc;
+	int i, k;
+	unsigned next = 0;
+	char * pending = calloc(g_num_reactors, 1); // reactors to wake up
+	struct epoll_event ev[MAX_LISTENERS];
+	(void)param;
+	
+	alog_set_thread_name("acceptor");
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if(-1 == efd || NULL == pending)
+	{
+		perror("acceptor");
+		abort();
+	}
+	__atomic_store_n(&g_acceptor_efd, efd, __ATOMIC_RELEASE);
+	for(k = 0; k < g_num_listeners; ++k)
+	{
+		memset(&ev[0], 0, sizeof(ev[0]));
+		ev[0].data.fd = g_listeners[k].fd;
+		ev[0].events = EPOLLIN | EPOLLET;
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, g_listeners[k].fd, &ev[0]);
+		if(rc)
+		{
+			perror("epoll_ctl");
+			abort();
+		}
+	}
+	
+	while(1)
+	{
+		int n = epoll_wait(efd, ev, MAX_LISTENERS, -1);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			perror("epoll_wait");
+			break;
+		}
+		
+		for(k = 0; k < n; ++k) acceptor_drain(ev[k].data.fd, &next, pending);
+		
+		for(i = 0; i < g_num_reactors; ++i)
+		{
+			if(!pending[i]) continue;
+			pending[i] = 0;
+			reactor_wakeup(&g_reactors[i]);
+		}
+	}
+	
+	free(pending);
+	close(efd);
+	pthread_exit((void *)(long)0);
+}
+
+/* ************************
+ * 平滑重启 (-H，协议见handover.h)：
+ * 新进程启动时连接旧进程，接管它的侦听socket，不需要bind，backlog中的连接也不会丢失；
+ * 之后由主线程接收旧进程转交的空闲连接 (-K)，按round-robin放入各reactor的handover_queue。
+ * 旧进程的主线程accept新进程的连接，发出所有侦听socket，然后通知各reactor停止accept，
+ * （-K时reactor还把空闲的连接逐个转交出去），等剩下的连接都结束后退出。
+ * */
+static void handover_set_timeout(int sock)
+{
+	struct timeval tv;
+	tv.tv_sec = HANDOVER_IO_TIMEOUT_MS / 1000;
+	tv.tv_usec = (HANDOVER_IO_TIMEOUT_MS % 1000) * 1000;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) 
+		|| setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+	{
+		perror("setsockopt(SO_RCVTIMEO/SO_SNDTIMEO)");
+	}
+}
+
+// 新进程：返回与旧进程之间的连接，没有旧进程在运行时返回-1
+static int takeover_listeners(void)
+{
+	handover_msg_t msg;
+	int sock, fd, rc;
+	int k, n;
+	int num_addrs = g_num_listeners;
+	int taken[MAX_LISTEN_ADDRS] = {0};	// sockets taken over for each -L address
+	int origin[MAX_LISTENERS];
+	
+	sock = handover_connect(&g_handover_addr);
+	if(sock < 0)
+	{
+		if(ENOENT != errno && ECONNREFUSED != errno) fprintf(stderr, "connect %s: %s\n", g_handover_path, strerror(errno));
+		printf("no running instance on %s\n", g_handover_path);
+		return -1;
+	}
+	handover_set_timeout(sock);
+	handover_msg_init(&msg, HANDOVER_REQUEST, NULL);
+	if(g_takeover_conns) msg.flags |= HANDOVER_F_CONNS;
+	if(handover_send(sock, &msg, -1))
+	{
+		fprintf(stderr, "handover request: %s\n", strerror(errno));
+		exit(1);
+	}
+	
+	while(1)
+	{
+		rc = handover_recv(sock, &msg, &fd);
+		if(rc <= 0)
+		{
+			// 旧进程在收到HANDOVER_LISTENERS_DONE之前出错会继续服务
+			fprintf(stderr, "handover: %s\n", rc?strerror(errno):"closed by the running instance");
+			exit(1);
+		}
+		if(HANDOVER_LISTENERS_DONE == msg.type) break;
+		if(HANDOVER_LISTENER != msg.type || fd < 0)
+		{
+			if(fd >= 0) close(fd);
+			continue;
+		}
+		
+		for(k = 0; k < num_addrs; ++k)
+		{
+			if(0 == strcmp(g_listeners[k].name, msg.name)) break;
+		}
+		if(k == num_addrs || MAX_LISTENERS == g_num_listeners)
+		{
+			fprintf(stderr, "handover: %s is not a listen address of this instance, closed.\n", msg.name);
+			close(fd);
+			continue;
+		}
+		origin[g_num_listeners] = k;
+		listener_t * l = &g_listeners[g_num_listeners++];
+		*l = g_listeners[k];
+		l->fd = fd;
+		l->reactor = taken[k]++;
+	}
+	
+	// 每个reactor一个的侦听socket，个数与reactor相同时仍然各用一个，否则由所有reactor共享
+	for(k = num_addrs; k < g_num_listeners; ++k)
+	{
+		listener_t * l = &g_listeners[k];
+		if(ACCEPTOR_NONE != g_acceptor || AF_UNIX == l->addr.family || taken[origin[k]] != g_num_reactors) l->reactor = -1;
+	}
+	for(k = 0; k < num_addrs; ++k)
+	{
+		if(taken[k]) printf("took over %d socket(s) listening on %s\n", taken[k], g_listeners[k].name);
+	}
+	// 被接管的socket替换掉对应的-L地址，剩下的地址照常bind
+	n = 0;
+	for(k = 0; k < g_num_listeners; ++k)
+	{
+		if(k < num_addrs && taken[k]) continue;
+		if(n != k) g_listeners[n] = g_listeners[k];
+		++n;
+	}
+	g_num_listeners = n;
+	chutil_make_non_blocking(sock);
+	return sock;
+}
+
+// 新进程：把旧进程转交过来的连接分给各reactor，旧进程关闭连接后返回-1
+static int takeover_recv_conns(int sock)
+{
+	static unsigned next = 0;
+	static unsigned long total = 0;
+	char pending[MAX_REACTORS];
+	handover_msg_t msg;
+	int fd, rc, i;
+	
+	memset(pending, 0, sizeof(pending));
+	while(1)
+	{
+		rc = handover_recv(sock, &msg, &fd);
+		if(rc < 0 && EPROTO == errno) continue;
+		if(rc <= 0) break;
+		if(HANDOVER_CONN != msg.type || fd < 0 || NULL == g_reactors[0].handover_queue)
+		{
+			if(fd >= 0) close(fd);
+			continue;
+		}
+		reactor_t * r = &g_reactors[next++ % g_num_reactors];
+		if(fd_queue_push(r->handover_queue, fd))
+		{
+			alog_warn("handover queue of reactor [%d] is full, drop connection [%d]", r->id, fd);
+			close(fd);
+			continue;
+		}
+		pending[r->id] = 1;
+		++total;
+	}
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		if(pending[i]) reactor_wakeup(&g_reactors[i]);
+	}
+	if(rc < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) return sock;
+	
+	if(rc < 0) fprintf(stderr, "handover: %s\n", strerror(errno));
+	printf("handover finished, took over %lu connection(s)\n", total);
+	fflush(stdout);
+	close(sock);
+	return -1;
+}
+
+// 旧进程：成功交出侦听socket返回0，*sfd为-1；失败时继续服务，*sfd为重新创建的handover socket
+static int handover_start(int * sfd)
+{
+	handover_msg_t msg;
+	int sock, fd, rc;
+	int i, k;
+	int count = 0;
+	uint32_t flags;
+	
+	sock = accept4(*sfd, NULL, NULL, SOCK_CLOEXEC);
+	if(sock < 0)
+	{
+		perror("accept handover socket");
+		return -1;
+	}
+	handover_set_timeout(sock);
+	rc = handover_recv(sock, &msg, &fd);
+	if(fd >= 0) close(fd);
+	if(rc <= 0 || HANDOVER_REQUEST != msg.type)
+	{
+		fprintf(stderr, "handover: invalid request\n");
+		close(sock);
+		return -1;
+	}
+	flags = msg.flags;
+	
+	// 新进程收到HANDOVER_LISTENERS_DONE以后要在同一地址上侦听，在此之前关闭；
+	// 文件路径留给新进程重新bind，不能删除
+	close(*sfd);
+	*sfd = -1;
+	
+	// 每个reactor自己的侦听socket逐个发送，共享的只发送一次
+	rc = 0;
+	for(i = 0; i < g_num_reactors && 0 == rc; ++i)
+	{
+		reactor_t * r = &g_reactors[i];
+		for(k = 0; k < r->num_listeners && 0 == rc; ++k)
+		{
+			const reactor_listener_t * rl = &r->listeners[k];
+			if(rl->listener->fd >= 0 && rl->listener->reactor < 0) continue;
+			handover_msg_init(&msg, HANDOVER_LISTENER, rl->listener->name);
+			rc = handover_send(sock, &msg, rl->fd);
+			++count;
+		}
+	}
+	for(k = 0; k < g_num_listeners && 0 == rc; ++k)
+	{
+		const listener_t * l = &g_listeners[k];
+		if(l->fd < 0 || l->reactor >= 0) continue;
+		handover_msg_init(&msg, HANDOVER_LISTENER, l->name);
+		rc = handover_send(sock, &msg, l->fd);
+		++count;
+	}
+	if(0 == rc)
+	{
+		handover_msg_init(&msg, HANDOVER_LISTENERS_DONE, NULL);
+		rc = handover_send(sock, &msg, -1);
+	}
+	if(rc)
+	{
+		fprintf(stderr, "handover: %s, keep serving\n", strerror(errno));
+		close(sock);
+		*sfd = handover_listen(&g_handover_addr);
+		if(*sfd < 0) fprintf(stderr, "handover socket %s: %s\n", g_handover_path, strerror(errno));
+		return -1;
+	}
+	printf("handed %d listening socket(s) over, draining\n", count);
+	
+	if((flags & HANDOVER_F_CONNS) && BACKEND_EPOLL != g_backend)
+	{
+		fprintf(stderr, "handover: the io_uring backend cannot hand over connections, draining them here.\n");
+		flags &= ~HANDOVER_F_CONNS;
+	}
+	if(flags & HANDOVER_F_CONNS)
+	{
+		g_handover_fd = sock;
+		__atomic_store_n(&g_handover_conns, 1, __ATOMIC_RELAXED);
+	}else close(sock);	// 新进程由此得知转交结束
+	
+	// acceptor线程：从它的epoll中删除即可，侦听socket还要留给新进程
+	int efd = __atomic_load_n(&g_acceptor_efd, __ATOMIC_ACQUIRE);
+	for(k = 0; k < g_num_listeners && efd >= 0; ++k)
+	{
+		if(g_listeners[k].fd >= 0) epoll_ctl(efd, EPOLL_CTL_DEL, g_listeners[k].fd, NULL);
+	}
+	__atomic_store_n(&g_draining, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < g_num_reactors; ++i) reactor_wakeup(&g_reactors[i]);
+	fflush(stdout);
+	return 0;
+}
+
+// 旧进程：剩下的连接都结束了，或者超过了deadline时返回1
+static int handover_drained(uint64_t deadline)
+{
+	int i;
+	unsigned conns = 0;
+	for(i = 0; i < g_num_reactors; ++i)
+	{
+		reactor_t * r = &g_reactors[i];
+		conns += (unsigned)__atomic_load_n(&r->num_conns, __ATOMIC_RELAXED);
+		if(r->accept_queue) conns += fd_queue_length(r->accept_queue);
+	}
+	if(0 == conns) return 1;
+	if(clock_now_ms() < deadline) return 0;
+	printf("handover: %u connection(s) still open after %d ms, closing them\n", conns, HANDOVER_DRAIN_MS);
+	return 1;
+}
+
+/* ************************
+ * 把一个新的（已经是非阻塞的）连接加入到reactor中
+ * */
+static void conn_on_timer(timer_node_t * node, void * user_data);
+
+// -Z/-N: AF_UNIX不支持这些选项，setsockopt()失败时保持默认
+static void conn_sockopt_init(conn_t * c)
+{
+	int on = 1;
+	if(TCP_POLICY_NODELAY == g_tcp_policy) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if(TCP_POLICY_CORK == g_tcp_policy)
+	{
+		int off = 0;
+		c->cork = (0 == setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)));
+	}
+	if(g_zerocopy && c->pipe[0] < 0 && 0 == setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
+	{
+		c->zc_socket = c->zerocopy = 1;
+	}
+}
+
+static int epoll_conn_add(reactor_t * r, int fd, int socktype)
+{
+	struct epoll_event ev;
+	conn_t * c = conn_new(r, fd);
+	if(NULL == c)
+	{
+		close(fd);
+		return -1;
+	}
+	c->seqpacket = (SOCK_SEQPACKET == socktype);
+	if(g_splice && !c->seqpacket) conn_splice_init(c);
+	if(!c->seqpacket) conn_sockopt_init(c);
+	c->events = EPOLLIN | EPOLLET;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = c;
+	ev.events = c->events;
+	if(epoll_ctl(r->efd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		perror("epoll_ctl");
+		abort();
+	}
+	return 0;
+}
+
+// acceptor交过来的只有fd，只在配置了seqpacket侦听地址时才需要查询类型
+static int conn_socktype(int fd)
+{
+	int type = SOCK_STREAM;
+	socklen_t len = sizeof(type);
+	if(g_seqpacket && getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)) type = SOCK_STREAM;
+	return type;
+}
+
+static inline reactor_listener_t * reactor_listener_of(reactor_t * r, void * ptr)
+{
+	uintptr_t p = (uintptr_t)ptr;
+	if(p < (uintptr_t)r->listeners || p >= (uintptr_t)(r->listeners + r->num_listeners)) return NULL;
+	return (reactor_listener_t *)ptr;
+}
+
+// edge-triggered: 一直accept到EAGAIN，否则积压在backlog中的连接不会再触发事件
+static void epoll_on_accept(reactor_t * r, reactor_listener_t * rl)
+{
+	int fd;
+	char hbuf[NI_MAXHOST] = "", sbuf[NI_MAXSERV] = "";
+	while(1)
+	{
+		struct sockaddr_storage ss;
+		socklen_t slen = sizeof(ss);
+		fd = accept4(rl->fd, (struct sockaddr *)&ss, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC); 
+		if(-1 == fd)
+		{
+			if(EINTR == errno || ECONNABORTED == errno) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) alog_error("accept4: %s", strerror(errno));
+			break;
+		}
+		// 日志关闭时连getnameinfo()也不调用；AF_UNIX的对端通常没有地址
+		if(alog_enabled(ALOG_INFO))
+		{
+			if(AF_UNIX == ss.ss_family) alog_info("[%d] connected via %s on [%d]", r->id, rl->listener->name, fd);
+			else if(0 == getnameinfo((struct sockaddr *)&ss, slen, 
+				hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+				NI_NUMERICHOST | NI_NUMERICSERV))
+			{
+				alog_info("[%d] connected from %s:%s on [%d]", r->id, hbuf, sbuf, fd);
+			}
+		}
+		epoll_conn_add(r, fd, rl->listener->addr.socktype);
+	}
+}
+
+/* ************************
+ * 唤醒通知：acceptor转交的新连接、从旧进程接管的连接 (-H -K)，
+ * 或者侦听socket已经交给了新进程，从epoll中删除（不能关闭，新进程还在使用）
+ * */
+static void epoll_on_wakeup(reactor_t * r)
+{
+	int fd, k;
+	if(read(r->evfd, &r->evfd_value, sizeof(r->evfd_value)) < 0 && EAGAIN != errno) alog_error("read eventfd: %s", strerror(errno));
+	while(r->accept_queue && -1 != (fd = fd_queue_pop(r->accept_queue)))
+	{
+		alog_info("[%d] connected on [%d]", r->id, fd);
+		epoll_conn_add(r, fd, conn_socktype(fd));
+	}
+	while(r->handover_queue && -1 != (fd = fd_queue_pop(r->handover_queue)))
+	{
+		alog_info("[%d] took over connection [%d]", r->id, fd);
+		epoll_conn_add(r, fd, conn_socktype(fd));
+	}
+	if(r->draining || !__atomic_load_n(&g_draining, __ATOMIC_ACQUIRE)) return;
+	r->draining = 1;
+	for(k = 0; k < r->num_listeners; ++k) epoll_ctl(r->efd, EPOLL_CTL_DEL, r->listeners[k].fd, NULL);
+	alog_info("[%d] stopped accepting, %d connection(s) left", r->id, r->num_conns);
+}
+
+/* ************************
+ * -K: 把空闲的连接转交给新进程，
+ * 输出队列或管道中还有数据、有未解析完的帧、还在ready list上、被限速或者还有零拷贝发送未完成的连接等下一轮再转交
+ * */
+static void epoll_handover_conns(reactor_t * r)
+{
+	conn_t * c, * next;
+	handover_msg_t msg;
+	handover_msg_init(&msg, HANDOVER_CONN, NULL);
+	for(c = r->conns; c; c = next)
+	{
+		next = c->conn_next;
+		if(c->out_head || c->pipe_bytes || c->in_buf || c->ready || c->throttle_until || c->zc_head) continue;
+		if(handover_send(g_handover_fd, &msg, c->fd))
+		{
+			alog_warn("handover connection [%d]: %s, stop handing over", c->fd, strerror(errno));
+			__atomic_store_n(&g_handover_conns, 0, __ATOMIC_RELAXED);
+			return;
+		}
+		// 新进程和这里共用同一个打开的socket，close()不会把它从epoll中删除
+		epoll_ctl(r->efd, EPOLL_CTL_DEL, c->fd, NULL);
+		alog_info("[%d] handed connection [%d] over", r->id, c->fd);
+		conn_close(r, c);
+	}
+}
+
+static void epoll_conn_event(reactor_t * r, conn_t * c, uint32_t events)
+{
+	if(c->zc_linger_until) // closing, only waiting for zerocopy completions
+	{
+		conn_close(r, c);
+		return;
+	}
+	if(c->zc_socket && (events & EPOLLERR))
+	{
+		// 完成通知放在错误队列中，也以EPOLLERR报告；取完通知后没有真正的错误就照常处理
+		int err = 0;
+		socklen_t len = sizeof(err);
+		conn_zc_complete(r, c);
+		if(0 == getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) && 0 == err) events &= ~EPOLLERR;
+	}
+	if(events & (EPOLLERR | EPOLLHUP))
+	{
+		conn_close(r, c);
+		return;
+	}
+	
+	// 先发送，有可能因此降到低水位以下而恢复读取
+	if(events & EPOLLOUT)
+	{
+		if(on_send(r, c)) return;
+	}
+	if(events & EPOLLIN)
+	{
+		on_recv(r, c);
+	}
+}
+
+/* ************************
+ * busy-poll: 先用epoll_wait(..., 0)自旋最多g_busy_poll微秒，
+ * 在这期间到达的事件不需要经过线程的睡眠和唤醒；预算用完仍然没有事件再阻塞等待。
+ * 自旋和阻塞的时间分别计入spin_ns/sleep_ns，用来调整预算：
+ * sleeps相对wakeups很多说明预算太小，spin_ns远大于处理事件的时间说明预算太大。
+ * */
+static int epoll_busy_wait(reactor_t * r, struct epoll_event * events, int timeout)
+{
+	int n;
+	uint64_t start = clock_now_ns();
+	uint64_t now = start;
+	uint64_t budget = (uint64_t)g_busy_poll * 1000;
+	if(timeout >= 0 && (uint64_t)timeout * 1000000 < budget) budget = (uint64_t)timeout * 1000000;
+	do
+	{
+		n = epoll_wait(r->efd, events, MAX_EVENTS, 0);
+		now = clock_now_ns();
+	}while(0 == n && now - start < budget);
+	metric_add(&r->metrics.spin_ns, now - start);
+	if(0 != n) return n;
+	
+	if(timeout > 0)
+	{
+		timeout -= (int)((now - start) / 1000000);
+		if(timeout < 0) timeout = 0;
+	}
+	if(0 == timeout) return 0;
+	n = epoll_wait(r->efd, events, MAX_EVENTS, timeout);
+	metric_add(&r->metrics.sleep_ns, clock_now_ns() - now);
+	metric_add(&r->metrics.sleeps, 1);
+	return n;
+}
+
+static int epoll_reactor_run(reactor_t * r)
+{
+	int rc;
+	int k;
+	int efd = r->efd;
+	
+	struct epoll_event events[1 + MAX_EVENTS];
+	
+	memset(events, 0, sizeof(events));
+	for(k = 0; k < r->num_listeners; ++k)
+	{
+		reactor_listener_t * rl = &r->listeners[k];
+		events[MAX_EVENTS].data.ptr = rl; // 用r->listeners[]中的地址来标识侦听socket
+		// UDP socket使用水平触发：每次事件只处理一批数据报，剩下的留给下一轮；
+		// 共享的AF_UNIX socket加上EPOLLEXCLUSIVE，新连接不会唤醒所有reactor
+		if(r->udp) events[MAX_EVENTS].events = EPOLLIN;
+		else events[MAX_EVENTS].events = EPOLLIN | EPOLLET | ((rl->listener->fd >= 0 && rl->listener->reactor < 0)?EPOLLEXCLUSIVE:0);
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, rl->fd, &events[MAX_EVENTS]);
+		if(rc)
+		{
+			perror("epoll_ctl");
+			abort();
+		}
+	}
+	if(r->evfd >= 0)
+	{
+		events[MAX_EVENTS].data.ptr = &r->evfd; // 用&r->evfd来标识acceptor和主线程的唤醒通知
+		events[MAX_EVENTS].events = EPOLLIN | EPOLLET;
+		rc = epoll_ctl(efd, EPOLL_CTL_ADD, r->evfd, &events[MAX_EVENTS]);
+		if(rc)
+		{
+			perror("epoll_ctl");
+			abort();
+		}
+	}
+	do
+	{
+		int n, i;
+		int timeout = r->wheel?timer_wheel_next_timeout(r->wheel, r->now_ms):-1;
+		if(r->ready_head) timeout = 0;	// 还有连接等着继续读，只检查一下新事件
+		if(g_busy_poll) n = epoll_busy_wait(r, &events[0], timeout);
+		else n = epoll_wait(efd, &events[0], MAX_EVENTS, timeout);
+		uint64_t t_ready = clock_now_ns();
+		r->now_ms = t_ready / 1000000;
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			perror("epoll_wait");
+			break;
+		}
+		if(n > 0) reactor_metrics_wakeup(r, n);
+		
+		for(i = 0; i < n; ++i)
+		{
+			reactor_listener_t * rl = reactor_listener_of(r, events[i].data.ptr);
+			if(rl && r->udp) // datagrams
+			{
+				udp_on_readable(r);
+			}else if(rl) // incomming connections
+			{
+				epoll_on_accept(r, rl);
+			}else if(events[i].data.ptr == &r->evfd) // notified by the acceptor or the main thread
+			{
+				epoll_on_wakeup(r);
+			}else
+			{
+				epoll_conn_event(r, events[i].data.ptr, events[i].events);
+			}
+			
+			// 包括在同一批事件中排队等待的时间
+			hdr_hist_record(&r->metrics.latency, clock_now_ns() - t_ready);
+		}
+		
+		// 每轮循环统一处理一次到期的定时器，再处理上一轮用完读取预算的连接
+		if(r->wheel) timer_wheel_advance(r->wheel, r->now_ms, conn_on_timer, r);
+		if(r->ready_head) conn_ready_run(r);
+		if(r->draining && __atomic_load_n(&g_handover_conns, __ATOMIC_RELAXED)) epoll_handover_conns(r);
+	}while(1);
+	
+	return 0;
+}
+
+
+/* ************************
+ * 连接的超时：
+ * 	idle  - 双方向都没有数据
+ * 	read  - 对端没有发来数据
+ * 	write - 输出队列非空，但一直没有发送出去
+ * 每个连接只有一个定时器，到期时间取三者中最早的一个。
+ * 收发数据时只更新时间戳，不操作时间轮；
+ * 定时器到期时再根据时间戳判断是真的超时，还是应该顺延。
+ * */
+static inline int conn_output_pending(const conn_t * c)
+{
+	return (NULL != c->out_head) || (0 != c->pipe_bytes);
+}
+
+static uint64_t conn_timeout_deadline(const conn_t * c)
+{
+	uint64_t deadline = UINT64_MAX;
+	uint64_t last_active = (c->last_read_ms > c->last_write_ms)?c->last_read_ms:c->last_write_ms;
+	if(g_idle_timeout && last_active + g_idle_timeout < deadline) deadline = last_active + g_idle_timeout;
+	if(g_read_timeout && c->last_read_ms + g_read_timeout < deadline) deadline = c->last_read_ms + g_read_timeout;
+	if(g_write_timeout && conn_output_pending(c) && c->last_write_ms + g_write_timeout < deadline)
+	{
+		deadline = c->last_write_ms + g_write_timeout;
+	}
+	return deadline;
+}
+
+// 限速中的连接也用同一个定时器，到期时间取超时和恢复读取中较早的一个；关闭中的连接只等零拷贝完成
+static uint64_t conn_deadline(const conn_t * c)
+{
+	if(c->zc_linger_until) return c->zc_linger_until;
+	uint64_t deadline = conn_timeout_deadline(c);
+	if(c->throttle_until && c->throttle_until < deadline) deadline = c->throttle_until;
+	return deadline;
+}
+
+// 定时器只会提前、不会推后：推后的情况留到定时器到期时再处理
+static void conn_timer_update(reactor_t * r, conn_t * c)
+{
+	uint64_t deadline = conn_deadline(c);
+	if(UINT64_MAX == deadline) return;
+	if(timer_node_pending(&c->timer) && c->timer.expire * r->wheel->tick_ms <= deadline) return;
+	timer_wheel_add(r->wheel, &c->timer, deadline);
+}
+
+static inline void conn_touch_write(reactor_t * r, conn_t * c)
+{
+	c->last_write_ms = r->now_ms;
+}
+
+static inline void conn_received(reactor_t * r, conn_t * c, size_t length)
+{
+	c->last_read_ms = r->now_ms;
+	c->bytes_in += length;
+	metric_add(&r->metrics.bytes_in, length);
+	if(g_capture_path) trace_capture_record(&g_capture, r->id, TRACE_DATA, c->trace_id, length);
+}
+
+static inline void conn_sent(reactor_t * r, conn_t * c, size_t length)
+{
+	c->last_write_ms = r->now_ms;
+	c->bytes_out += length;
+	metric_add(&r->metrics.bytes_out, length);
+}
+
+// 输出队列由空变为非空（调用时已经入队），开始计算write timeout
+static inline void conn_output_queued(reactor_t * r, conn_t * c)
+{
+	if(NULL == r->wheel) return;
+	c->last_write_ms = r->now_ms;
+	if(g_write_timeout) conn_timer_update(r, c);
+}
+
+static void uring_conn_close(reactor_t * r, conn_t * c);
+
+static void conn_on_timer(timer_node_t * node, void * user_data)
+{
+	reactor_t * r = (reactor_t *)user_data;
+	conn_t * c = (conn_t *)((char *)node - offsetof(conn_t, timer));
+	if(c->zc_linger_until)
+	{
+		conn_close(r, c);
+		return;
+	}
+	if(c->throttle_until && c->throttle_until <= r->now_ms)
+	{
+		// 令牌已经补充，在这一轮的ready list中继续读取
+		c->throttle_until = 0;
+		conn_ready_push(r, c);
+	}
+	
+	uint64_t deadline = conn_timeout_deadline(c);
+	if(deadline > r->now_ms)
+	{
+		deadline = conn_deadline(c);
+		if(UINT64_MAX != deadline) timer_wheel_add(r->wheel, &c->timer, deadline);
+		return;
+	}
+	
+	const char * reason = "idle";
+	if(g_write_timeout && conn_output_pending(c) && c->last_write_ms + g_write_timeout <= r->now_ms) reason = "write";
+	else if(g_read_timeout && c->last_read_ms + g_read_timeout <= r->now_ms) reason = "read";
+	alog_info("%s timeout on [%d]", reason, c->fd);
+	metric_add(&r->metrics.timeouts, 1);
+	
+	if(BACKEND_URING == g_backend) uring_conn_close(r, c);
+	else conn_close(r, c);
+}
+
+/* ************************
+ * 按RLIMIT_NOFILE分配连接表，并尽量把soft limit提高到hard limit
+ * */
+static int conn_table_init(void)
+{
+	struct rlimit rl;
+	if(0 == getrlimit(RLIMIT_NOFILE, &rl))
+	{
+		if(rl.rlim_cur < rl.rlim_max)
+		{
+			rl.rlim_cur = rl.rlim_max;
+			if(setrlimit(RLIMIT_NOFILE, &rl)) getrlimit(RLIMIT_NOFILE, &rl);
+		}
+		g_conn_table_size = (RLIM_INFINITY == rl.rlim_cur || rl.rlim_cur > (1 << 24))?(1 << 24):rl.rlim_cur;
+	}else
+	{
+		perror("getrlimit");
+		g_conn_table_size = 1024;
+	}
+	
+	// 只是保留虚拟地址空间，实际用到的页才会被分配
+	g_conn_table = calloc(g_conn_table_size, sizeof(conn_t *));
+	if(NULL == g_conn_table)
+	{
+		perror("calloc");
+		return -1;
+	}
+	printf("connection table: %lu entries\n", (unsigned long)g_conn_table_size);
+	return 0;
+}
+
+static inline conn_t * conn_lookup(int fd)
+{
+	if(fd < 0 || (size_t)fd >= g_conn_table_size) return NULL;
+	return g_conn_table[fd];
+}
+
+static conn_t * conn_new(reactor_t * r, int fd)
+{
+	conn_t * c;
+	if(fd < 0 || (size_t)fd >= g_conn_table_size)
+	{
+		alog_error("fd %d out of connection table range", fd);
+		return NULL;
+	}
+	assert(NULL == conn_lookup(fd));
+	
+	c = slab_alloc(&r->conn_slab);
+	if(NULL == c)
+	{
+		alog_error("slab_alloc: %s", strerror(errno));
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->conn_next = r->conns;
+	if(r->conns) r->conns->conn_prev = c;
+	r->conns = c;
+	c->pipe[0] = c->pipe[1] = -1;
+	c->accepted_ms = c->last_read_ms = c->last_write_ms = r->now_ms;
+	c->tokens = g_rate_burst;
+	c->tokens_ms = r->now_ms;
+	if(r->wheel) conn_timer_update(r, c);
+	if(g_capture_path)
+	{
+		c->trace_id = __atomic_add_fetch(&g_trace_conn_id, 1, __ATOMIC_RELAXED);
+		trace_capture_record(&g_capture, r->id, TRACE_OPEN, c->trace_id, 0);
+	}
+	metric_add(&r->metrics.accepts, 1);
+	g_conn_table[fd] = c;
+	__atomic_store_n(&r->num_conns, r->num_conns + 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+/* ************************
+ * 根据输出队列的状态调整在epoll中注册的事件：
+ * 队列非空时需要EPOLLOUT，超过高水位时去掉EPOLLIN
+ * */
+static int conn_update_events(reactor_t * r, conn_t * c)
+{
+	uint32_t events = EPOLLET;
+	if(!c->read_paused) events |= EPOLLIN;
+	if(NULL != c->out_head || c->pipe_bytes) events |= EPOLLOUT;
+	if(events == c->events) return 0;
+	
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = c;
+	ev.events = events;
+	if(epoll_ctl(r->efd, EPOLL_CTL_MOD, c->fd, &ev))
+	{
+		alog_error("epoll_ctl: %s", strerror(errno));
+		return -1;
+	}
+	c->events = events;
+	return 0;
+}
+
+static void out_chunk_free(reactor_t * r, out_chunk_t * chunk)
+{
+	if(chunk->bid >= 0)
+	{
+		uring_buf_ring_add(&r->bufs, chunk->bid);
+		uring_buf_ring_commit(&r->bufs);
+	}
+	pool_buf_unref(chunk->buf);
+	slab_free(&r->chunk_slab, chunk);
+}
+
+static void conn_close(reactor_t * r, conn_t * c)
+{
+	out_chunk_t * chunk = c->out_head;
+	if(c->zc_head && conn_zc_linger(r, c)) return;
+	if(g_capture_path) trace_capture_record(&g_capture, r->id, TRACE_CLOSE, c->trace_id, 0);
+	while(chunk)
+	{
+		out_chunk_t * next = chunk->next;
+		out_chunk_free(r, chunk);
+		chunk = next;
+	}
+	pool_buf_unref(c->in_buf);
+	conn_ready_remove(r, c);
+	if(c->conn_prev) c->conn_prev->conn_next = c->conn_next;
+	else r->conns = c->conn_next;
+	if(c->conn_next) c->conn_next->conn_prev = c->conn_prev;
+	alog_info("close connection on [%d]: %lu bytes in, %lu bytes out, %lu ms", c->fd,
+		(unsigned long)c->bytes_in, (unsigned long)c->bytes_out, (unsigned long)(r->now_ms - c->accepted_ms));
+	if(r->wheel) timer_wheel_del(r->wheel, &c->timer);
+	metric_add(&r->metrics.closes, 1);
+	metric_sub(&r->metrics.out_queued, c->out_bytes + c->pipe_bytes);
+	// 必须先清除表项再close()：fd关闭后可能立即被其他reactor的accept()复用
+	g_conn_table[c->fd] = NULL;
+	__atomic_store_n(&r->num_conns, r->num_conns - 1, __ATOMIC_RELAXED);
+	close(c->fd); // close() 会自动将fd从epoll中移除
+	if(c->pipe[0] >= 0)
+	{
+		close(c->pipe[0]);
+		close(c->pipe[1]);
+	}
+	slab_free(&r->conn_slab, c);
+}
+
+static out_chunk_t * out_chunk_new(reactor_t * r)
+{
+	out_chunk_t * chunk = slab_alloc(&r->chunk_slab);
+	if(NULL == chunk) return NULL;
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->bid = -1;
+	return chunk;
+}
+
+// 把slice挂到输出队列尾部，只增加缓冲区的引用计数
+static int conn_enqueue(reactor_t * r, conn_t * c, const buf_slice_t * slice)
+{
+	out_chunk_t * chunk = out_chunk_new(r);
+	if(NULL == chunk) return -1;
+	chunk->buf = pool_buf_ref(slice->buf);
+	chunk->data = (char *)buf_slice_data(slice);
+	chunk->length = slice->length;
+	
+	size_t length = slice->length;
+	if(c->out_tail) c->out_tail->next = chunk;
+	else c->out_head = chunk;
+	c->out_tail = chunk;
+	if(0 == c->out_bytes) conn_output_queued(r, c);
+	c->out_bytes += length;
+	metric_add(&r->metrics.out_queued, length);
+	return 0;
+}
+
+/* ************************
+ * 读取的公平性：
+ * edge-triggered模式下本来要一直读到EAGAIN，一个发送很快的连接会占住整个循环。
+ * 每次事件最多读g_read_budget_bytes字节、g_read_budget_calls次，
+ * 用完后连接排到ready list队尾，等这一批的其他事件处理完再继续读；
+ * ready list非空时epoll_wait()不阻塞，新到的事件和ready list中的连接轮流得到服务。
+ * -T 给每个连接一个令牌桶：令牌用完时停止读取，由连接的定时器在令牌补充后放回ready list。
+ * */
+typedef struct read_budget
+{
+	size_t bytes;
+	unsigned calls;
+}read_budget_t;
+
+static inline void read_budget_init(read_budget_t * budget)
+{
+	budget->bytes = g_read_budget_bytes;
+	budget->calls = g_read_budget_calls;
+}
+
+static void conn_ready_push(reactor_t * r, conn_t * c)
+{
+	if(c->ready) return;
+	c->ready = 1;
+	c->ready_next = NULL;
+	c->ready_prev = r->ready_tail;
+	if(r->ready_tail) r->ready_tail->ready_next = c;
+	else r->ready_head = c;
+	r->ready_tail = c;
+}
+
+static void conn_ready_remove(reactor_t * r, conn_t * c)
+{
+	if(!c->ready) return;
+	if(c->ready_prev) c->ready_prev->ready_next = c->ready_next;
+	else r->ready_head = c->ready_next;
+	if(c->ready_next) c->ready_next->ready_prev = c->ready_prev;
+	else r->ready_tail = c->ready_prev;
+	c->ready = 0;
+	c->ready_prev = c->ready_next = NULL;
+}
+
+// 只处理这一轮开始时已经在队列中的连接，再次用完预算的重新排到队尾，留给下一轮
+static void conn_ready_run(reactor_t * r)
+{
+	conn_t * last = r->ready_tail;
+	conn_t * c;
+	while(NULL != (c = r->ready_head))
+	{
+		int is_last = (c == last);
+		conn_ready_remove(r, c);
+		on_recv(r, c);
+		if(is_last) break;
+	}
+}
+
+/* ************************
+ * 令牌桶：返回这次最多可以读的字节数；
+ * 令牌用完时返回0，等到补充够一个接收缓冲区（或者半个BURST）时由定时器恢复读取
+ * */
+static size_t conn_read_quota(reactor_t * r, conn_t * c, size_t want)
+{
+	if(0 == g_rate_limit) return want;
+	if(c->throttle_until) return 0;
+	
+	// 不足1字节的部分留到下次，不更新tokens_ms
+	uint64_t refill = (r->now_ms - c->tokens_ms) * g_rate_limit / 1000;
+	if(refill)
+	{
+		c->tokens += refill;
+		if(c->tokens > g_rate_burst) c->tokens = g_rate_burst;
+		c->tokens_ms = r->now_ms;
+	}
+	if(c->tokens) return (want < c->tokens)?want:(size_t)c->tokens;
+	
+	// 定时器按tick向上取整，只等半个桶，醒来时补充的令牌才不会超过BURST而被丢掉
+	uint64_t need = (g_rate_burst / 2 < RECV_BUF_SIZE)?(g_rate_burst / 2):RECV_BUF_SIZE;
+	c->throttle_until = r->now_ms + (need * 1000 + g_rate_limit - 1) / g_rate_limit;
+	metric_add(&r->metrics.throttled, 1);
+	conn_timer_update(r, c);
+	return 0;
+}
+
+// 把读到的数据计入令牌桶和本次事件的预算，预算用完时返回1，连接排到ready list队尾
+static int conn_read_charge(reactor_t * r, conn_t * c, read_budget_t * budget, size_t length)
+{
+	int exhausted = 0;
+	if(g_rate_limit) c->tokens -= (length < c->tokens)?length:c->tokens;
+	if(g_read_budget_bytes)
+	{
+		if(length >= budget->bytes) exhausted = 1;
+		else budget->bytes -= length;
+	}
+	if(g_read_budget_calls && 0 == --budget->calls) exhausted = 1;
+	if(!exhausted) return 0;
+	
+	metric_add(&r->metrics.deferred, 1);
+	conn_ready_push(r, c);
+	return 1;
+}
+
+/* ************************
+ * MSG_ZEROCOPY (-Z)：
+ * 不小于g_zerocopy字节的发送使用MSG_ZEROCOPY，内核直接引用缓冲区的页面而不复制。
+ * 每次成功的send()按顺序得到一个通知id，内核用完这些页面后，完成通知（id的区间）
+ * 放入socket的错误队列，以EPOLLERR报告。在此之前缓冲区的引用挂在c->zc_head上，
+ * 不会被接收复用，也不会还给缓冲池。
+ * 内核报告还是复制了数据时（SO_EE_CODE_ZEROCOPY_COPIED，例如loopback或者网卡不支持），
+ * 这个连接以后不再使用MSG_ZEROCOPY：固定页面再复制比直接复制更慢。
+ * */
+static ssize_t conn_send(reactor_t * r, conn_t * c, const void * data, size_t length, pool_buf_t * buf)
+{
+	ssize_t cb;
+	if(c->zerocopy && buf && length >= g_zerocopy)
+	{
+		out_chunk_t * chunk = out_chunk_new(r);
+		if(NULL == chunk) return -1;
+		cb = send(c->fd, data, length, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if(cb >= 0)
+		{
+			chunk->buf = pool_buf_ref(buf);
+			chunk->length = cb;
+			chunk->zc_id = c->zc_next_id++;
+			if(c->zc_tail) c->zc_tail->next = chunk;
+			else c->zc_head = chunk;
+			c->zc_tail = chunk;
+			metric_add(&r->metrics.zc_sends, 1);
+			return cb;
+		}
+		int err = errno;
+		slab_free(&r->chunk_slab, chunk);
+		errno = err;
+		if(ENOBUFS != err) return -1;	// ENOBUFS: over the optmem limit, copy this time
+	}
+	return send(c->fd, data, length, MSG_NOSIGNAL);
+}
+
+// 通知的区间[lo, hi]可能合并了多次发送，id会回绕
+static void conn_zc_release(reactor_t * r, conn_t * c, uint32_t lo, uint32_t hi)
+{
+	out_chunk_t * prev = NULL;
+	out_chunk_t * chunk = c->zc_head;
+	while(chunk && (int32_t)(chunk->zc_id - hi) <= 0)
+	{
+		out_chunk_t * next = chunk->next;
+		if((int32_t)(chunk->zc_id - lo) >= 0)
+		{
+			if(prev) prev->next = next;
+			else c->zc_head = next;
+			if(c->zc_tail == chunk) c->zc_tail = prev;
+			out_chunk_free(r, chunk);
+		}else prev = chunk;
+		chunk = next;
+	}
+}
+
+static void conn_zc_complete(reactor_t * r, conn_t * c)
+{
+	char control[128];
+	while(c->zc_head)
+	{
+		struct msghdr msg;
+		struct cmsghdr * cmsg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0)
+		{
+			if(EINTR == errno) continue;
+			break;	// EAGAIN: no more notifications
+		}
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			struct sock_extended_err serr;
+			if(!(SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type) 
+				&& !(SOL_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type)) continue;
+			memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+			if(0 != serr.ee_errno || SO_EE_ORIGIN_ZEROCOPY != serr.ee_origin) continue;
+			if(serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			{
+				metric_add(&r->metrics.zc_copied, serr.ee_data - serr.ee_info + 1);
+				if(c->zerocopy) alog_debug("zerocopy sends on [%d] were copied, disabled", c->fd);
+				c->zerocopy = 0;
+			}
+			conn_zc_release(r, c, serr.ee_info, serr.ee_data);
+		}
+	}
+}
+
+/* ************************
+ * 关闭连接时内核可能还在发送（或重传）引用的页面，缓冲区这时被复用会发出错误的数据：
+ * 先shutdown()，连接留在reactor中只等完成通知，最多ZEROCOPY_LINGER_MS。
+ * 返回1表示还要等待，连接保持打开
+ * */
+static int conn_zc_linger(reactor_t * r, conn_t * c)
+{
+	conn_zc_complete(r, c);
+	if(NULL == c->zc_head) return 0;
+	if(0 == c->zc_linger_until)
+	{
+		struct epoll_event ev;
+		c->zc_linger_until = r->now_ms + ZEROCOPY_LINGER_MS;
+		c->read_paused = 1;
+		conn_ready_remove(r, c);
+		shutdown(c->fd, SHUT_RDWR);
+		// EPOLLERR总是会报告
+		memset(&ev, 0, sizeof(ev));
+		ev.data.ptr = c;
+		ev.events = EPOLLET;
+		if(0 == epoll_ctl(r->efd, EPOLL_CTL_MOD, c->fd, &ev)) c->events = ev.events;
+	}
+	if(r->now_ms < c->zc_linger_until)
+	{
+		conn_timer_update(r, c);
+		return 1;
+	}
+	
+	// 一直没有等到通知：宁可泄漏这些缓冲区，也不能让新数据覆盖可能还在发送的页面
+	size_t leaked = 0;
+	while(c->zc_head)
+	{
+		out_chunk_t * next = c->zc_head->next;
+		leaked += c->zc_head->length;
+		slab_free(&r->chunk_slab, c->zc_head);
+		c->zc_head = next;
+	}
+	c->zc_tail = NULL;
+	alog_warn("zerocopy completions missing on [%d], buffers of %lu bytes leaked", c->fd, (unsigned long)leaked);
+	return 0;
+}
+
+/* ************************
+ * 发送输出队列中的数据，直到队列为空或者socket不可写
+ * 返回值：0 == 正常； 1 == 连接已关闭
+ * */
+static int splice_flush(reactor_t * r, conn_t * c);
+static int on_splice_recv(reactor_t * r, conn_t * c);
+
+static int on_send(reactor_t * r, conn_t * c)
+{
+	ssize_t cb;
+	if(c->pipe_bytes)
+	{
+		if(splice_flush(r, c))
+		{
+			conn_close(r, c);
+			return 1;
+		}
+		if(c->read_paused && c->pipe_bytes <= c->pipe_size / 2) c->read_paused = 0;
+	}
+	while(c->out_head)
+	{
+		out_chunk_t * chunk = c->out_head;
+		cb = conn_send(r, c, chunk->data + chunk->offset, chunk->length - chunk->offset, chunk->buf);
+		if(-1 == cb)
+		{
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				metric_add(&r->metrics.eagain_write, 1);
+				break;
+			}
+			if(EINTR == errno) continue;
+			alog_error("send: %s", strerror(errno));
+			conn_close(r, c);
+			return 1;
+		}
+		chunk->offset += cb;
+		c->out_bytes -= cb;
+		conn_sent(r, c, cb);
+		metric_sub(&r->metrics.out_queued, cb);
+		if(chunk->offset == chunk->length)
+		{
+			c->out_head = chunk->next;
+			if(NULL == c->out_head) c->out_tail = NULL;
+			out_chunk_free(r, chunk);
+		}
+	}
+	
+	if(c->read_paused && c->out_bytes <= OUT_LOW_WATER)
+	{
+		c->read_paused = 0;
+	}
+	if(conn_update_events(r, c))
+	{
+		conn_close(r, c);
+		return 1;
+	}
+	return 0;
+}
+
+/* ************************
+ * 把收到的数据原样发回：
+ * 输出队列为空时直接发送，发不完的部分（EAGAIN）放入输出队列
+ * */
+static int conn_echo(reactor_t * r, conn_t * c, const buf_slice_t * slice)
+{
+	ssize_t cb;
+	buf_slice_t rest = *slice;
+	while(NULL == c->out_head && rest.length > 0)
+	{
+		cb = conn_send(r, c, buf_slice_data(&rest), rest.length, rest.buf);
+		if(-1 == cb)
+		{
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				metric_add(&r->metrics.eagain_write, 1);
+				break;
+			}
+			if(EINTR == errno) continue;
+			alog_error("send: %s", strerror(errno));
+			return -1;
+		}
+		rest.offset += cb;
+		rest.length -= cb;
+		conn_sent(r, c, cb);
+	}
+	if(rest.length > 0) return conn_enqueue(r, c, &rest);
+	return 0;
+}
+
+/* ************************
+ * 返回值：0 == 正常； 1 == 连接已关闭
+ * */
+static int conn_recv(reactor_t * r, conn_t * c)
+{
+	int done = 0;
+	ssize_t cb;
+	pool_buf_t * buf = NULL;
+	size_t used = 0;
+	read_budget_t budget;
+	if(c->pipe[0] >= 0) return on_splice_recv(r, c);
+	if(g_framing && !c->seqpacket) return on_frame_recv(r, c);
+	
+	read_budget_init(&budget);
+	while(!c->read_paused)
+	{
+		// 缓冲区已满时换一块新的；
+		// 被输出队列引用的部分保持不变，剩余空间继续用来接收。
+		// seqpacket的一个消息必须一次读完，只用空的缓冲区接收
+		if(NULL == buf || used == buf->size || (c->seqpacket && used > 0))
+		{
+			pool_buf_unref(buf);
+			buf = buffer_pool_get(&r->pool);
+			used = 0;
+			if(NULL == buf)
+			{
+				alog_error("buffer_pool_get: %s", strerror(errno));
+				done = 1;
+				break;
+			}
+		}
+		// seqpacket不能只读消息的一部分，令牌不够时也读完整的消息
+		size_t quota = conn_read_quota(r, c, buf->size - used);
+		if(0 == quota) break;
+		if(c->seqpacket) cb = recv(c->fd, buf->data + used, buf->size - used, MSG_TRUNC);
+		else cb = read(c->fd, buf->data + used, quota);
+		if(-1 == cb)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN != errno)
+			{
+				alog_error("read: %s", strerror(errno));
+				done = 1;
+			}else metric_add(&r->metrics.eagain_read, 1);
+			break;
+		}else if(0 == cb) // remote close the connection
+		{
+			done = 1;
+			break;
+		}else if((size_t)cb > buf->size - used) // MSG_TRUNC: 返回的是消息的实际长度
+		{
+			alog_warn("%ld bytes message truncated on [%d]", (long)cb, c->fd);
+			done = 1;
+			break;
+		}
+		
+		conn_received(r, c, cb);
+		buf_slice_t slice = {buf, used, (size_t)cb};
+		if(conn_echo(r, c, &slice))
+		{
+			done = 1;
+			break;
+		}
+		// 全部发送完毕、没有其他引用时从头开始复用这块缓冲区
+		used = (1 == buf->refs)?0:(used + cb);
+		
+		// 对端读得太慢，暂停读取，等输出队列降到低水位以下再恢复
+		if(c->out_bytes > OUT_HIGH_WATER) c->read_paused = 1;
+		if(conn_read_charge(r, c, &budget, cb)) break;
+	}
+	pool_buf_unref(buf);
+	if(!done && conn_update_events(r, c)) done = 1;
+	if(done)
+	{
+		conn_close(r, c);
+	}
+	return done;
+}
+
+/* ************************
+ * -N cork: 处理一次读事件期间设置TCP_CORK，这期间的多次回显合并成完整的报文段，
+ * 结束时取消TCP_CORK立即发出剩下的部分；每次事件多两次setsockopt()
+ * */
+static int on_recv(reactor_t * r, conn_t * c)
+{
+	int done;
+	int on = 1, off = 0;
+	conn_ready_remove(r, c);
+	if(!c->cork) return conn_recv(r, c);
+	setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	done = conn_recv(r, c);
+	if(!done) setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	return done;
+}
+
+/* ************************
+ * framing mode (-f):
+ * 字节流按长度前缀切分成消息帧（见frame.h），每个完整的帧按顺序交给g_frame_handler处理，
+ * 处理函数返回响应数据的slice，这里再给它加上长度前缀。
+ * 客户端流水线发送请求时，一次read()可能带来任意多个帧：
+ * 所有响应的前缀和数据组成一个iovec数组，用一次writev()发出，发不完的部分挂到输出队列。
+ * 不完整的帧留在c->in_buf中等下一次read()补齐，
+ * 比接收缓冲区大的帧单独分配一块足够大的缓冲区。
+ * */
+typedef int (*frame_handler_t)(reactor_t * r, conn_t * c, const buf_slice_t * request, buf_slice_t * response);
+
+typedef struct frame_batch
+{
+	int count;
+	struct iovec iov[FRAME_BATCH_IOV];
+	pool_buf_t * bufs[FRAME_BATCH_IOV];	// referenced buffer of each iovec
+	pool_buf_t * hdr_buf;	// response prefixes
+	size_t hdr_used;
+}frame_batch_t;
+
+// echo：响应就是请求本身，只增加引用计数
+static int frame_echo(reactor_t * r, conn_t * c, const buf_slice_t * request, buf_slice_t * response)
+{
+	(void)r;
+	(void)c;
+	*response = buf_slice_make(request->buf, request->offset, request->length);
+	return 0;
+}
+
+static frame_handler_t g_frame_handler = frame_echo;
+
+static inline void frame_batch_push(frame_batch_t * batch, pool_buf_t * buf, void * data, size_t length)
+{
+	assert(batch->count < FRAME_BATCH_IOV);
+	batch->iov[batch->count].iov_base = data;
+	batch->iov[batch->count].iov_len = length;
+	batch->bufs[batch->count] = pool_buf_ref(buf);
+	++batch->count;
+}
+
+static void frame_batch_release(frame_batch_t * batch)
+{
+	int i;
+	for(i = 0; i < batch->count; ++i) pool_buf_unref(batch->bufs[i]);
+	batch->count = 0;
+	pool_buf_unref(batch->hdr_buf);
+	batch->hdr_buf = NULL;
+	batch->hdr_used = 0;
+}
+
+/* ************************
+ * 输出队列为空时用writev()发送，剩余的部分按顺序放入输出队列
+ * */
+static int frame_batch_flush(reactor_t * r, conn_t * c, frame_batch_t * batch)
+{
+	int rc = 0;
+	int i = 0;
+	ssize_t cb;
+	if(0 == batch->count) return 0;
+	while(NULL == c->out_head && i < batch->count)
+	{
+		cb = writev(c->fd, batch->iov + i, batch->count - i);
+		if(-1 == cb)
+		{
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				metric_add(&r->metrics.eagain_write, 1);
+				break;
+			}
+			if(EINTR == errno) continue;
+			alog_error("writev: %s", strerror(errno));
+			rc = -1;
+			break;
+		}
+		conn_sent(r, c, cb);
+		for(; i < batch->count && (size_t)cb >= batch->iov[i].iov_len; ++i)
+		{
+			cb -= batch->iov[i].iov_len;
+			pool_buf_unref(batch->bufs[i]);
+		}
+		if(cb > 0)
+		{
+			batch->iov[i].iov_base = (char *)batch->iov[i].iov_base + cb;
+			batch->iov[i].iov_len -= cb;
+		}
+	}
+	
+	for(; i < batch->count; ++i)
+	{
+		pool_buf_t * buf = batch->bufs[i];
+		buf_slice_t slice = {buf, (size_t)((unsigned char *)batch->iov[i].iov_base - buf->data), batch->iov[i].iov_len};
+		if(0 == rc && slice.length > 0 && conn_enqueue(r, c, &slice)) rc = -1;
+		pool_buf_unref(buf);
+	}
+	batch->count = 0;
+	// 前缀都已发出，从头复用
+	if(batch->hdr_buf && 1 == batch->hdr_buf->refs) batch->hdr_used = 0;
+	return rc;
+}
+
+static int frame_batch_reply(reactor_t * r, conn_t * c, frame_batch_t * batch, const buf_slice_t * response)
+{
+	size_t n;
+	if(batch->count + 2 > FRAME_BATCH_IOV && frame_batch_flush(r, c, batch)) return -1;
+	if(NULL == batch->hdr_buf || batch->hdr_used + FRAME_MAX_HEADER > batch->hdr_buf->size)
+	{
+		pool_buf_unref(batch->hdr_buf);
+		batch->hdr_used = 0;
+		batch->hdr_buf = buffer_pool_get(&r->pool);
+		if(NULL == batch->hdr_buf)
+		{
+			alog_error("buffer_pool_get: %s", strerror(errno));
+			return -1;
+		}
+	}
+	
+	unsigned char * hdr = batch->hdr_buf->data + batch->hdr_used;
+	n = frame_encode_header(g_framing, hdr, (uint32_t)response->length);
+	frame_batch_push(batch, batch->hdr_buf, hdr, n);
+	batch->hdr_used += n;
+	if(response->length > 0) frame_batch_push(batch, response->buf, buf_slice_data(response), response->length);
+	return 0;
+}
+
+// 按顺序处理c->in_buf中所有完整的帧
+static int frame_dispatch(reactor_t * r, conn_t * c, frame_batch_t * batch)
+{
+	int hlen;
+	uint32_t length;
+	pool_buf_t * buf = c->in_buf;
+	while(c->in_start < c->in_end)
+	{
+		hlen = frame_parse_header(g_framing, buf->data + c->in_start, c->in_end - c->in_start, &length);
+		if(hlen < 0)
+		{
+			alog_warn("bad frame header on [%d]", c->fd);
+			return -1;
+		}
+		if(0 == hlen || c->in_end - c->in_start < (size_t)hlen + length) break;
+		
+		buf_slice_t request = {buf, c->in_start + hlen, length};
+		buf_slice_t response = {NULL, 0, 0};
+		if(g_frame_handler(r, c, &request, &response)) return -1;
+		int rc = frame_batch_reply(r, c, batch, &response);
+		buf_slice_release(&response);
+		if(rc) return -1;
+		c->in_start += hlen + length;
+		metric_add(&r->metrics.frames, 1);
+	}
+	return 0;
+}
+
+/* ************************
+ * 保证c->in_buf还有空间接收：
+ * 缓冲区满了以后把不完整的帧移到缓冲区开头，
+ * 缓冲区还被输出队列引用、或者容纳不下这个帧时，换一块新的缓冲区
+ * */
+static int frame_in_reserve(reactor_t * r, conn_t * c)
+{
+	pool_buf_t * buf = c->in_buf;
+	size_t pending;
+	size_t need = r->pool.buf_size;
+	uint32_t length;
+	int hlen;
+	if(buf && c->in_start == c->in_end && 1 == buf->refs) c->in_start = c->in_end = 0;
+	if(buf && c->in_end < buf->size) return 0;
+	
+	pending = buf?(c->in_end - c->in_start):0;
+	if(pending)
+	{
+		hlen = frame_parse_header(g_framing, buf->data + c->in_start, pending, &length);
+		if(hlen > 0 && (size_t)hlen + length > need) need = (size_t)hlen + length;
+	}
+	if(buf && 1 == buf->refs && need <= buf->size)
+	{
+		memmove(buf->data, buf->data + c->in_start, pending);
+	}else
+	{
+		pool_buf_t * fresh = buffer_pool_get_size(&r->pool, need);
+		if(NULL == fresh)
+		{
+			alog_error("buffer_pool_get: %s", strerror(errno));
+			return -1;
+		}
+		if(pending) memcpy(fresh->data, buf->data + c->in_start, pending);
+		pool_buf_unref(buf);
+		c->in_buf = fresh;
+	}
+	c->in_start = 0;
+	c->in_end = pending;
+	return 0;
+}
+
+static int on_frame_recv(reactor_t * r, conn_t * c)
+{
+	int done = 0;
+	ssize_t cb;
+	read_budget_t budget;
+	frame_batch_t batch;
+	batch.count = 0;
+	batch.hdr_buf = NULL;
+	batch.hdr_used = 0;
+	
+	read_budget_init(&budget);
+	while(!c->read_paused)
+	{
+		if(frame_in_reserve(r, c))
+		{
+			done = 1;
+			break;
+		}
+		size_t quota = conn_read_quota(r, c, c->in_buf->size - c->in_end);
+		if(0 == quota) break;
+		cb = read(c->fd, c->in_buf->data + c->in_end, quota);
+		if(-1 == cb)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN != errno)
+			{
+				alog_error("read: %s", strerror(errno));
+				done = 1;
+			}else metric_add(&r->metrics.eagain_read, 1);
+			break;
+		}else if(0 == cb) // remote close the connection
+		{
+			done = 1;
+			break;
+		}
+		
+		conn_received(r, c, cb);
+		c->in_end += cb;
+		// 一次read()中所有请求的响应用一次writev()发出
+		if(frame_dispatch(r, c, &batch) || frame_batch_flush(r, c, &batch))
+		{
+			done = 1;
+			break;
+		}
+		if(c->out_bytes > OUT_HIGH_WATER) c->read_paused = 1;
+		if(conn_read_charge(r, c, &budget, cb)) break;
+	}
+	frame_batch_release(&batch);
+	
+	// 没有不完整的帧时不占用缓冲区，空闲连接不消耗内存
+	if(c->in_buf && c->in_start == c->in_end)
+	{
+		pool_buf_unref(c->in_buf);
+		c->in_buf = NULL;
+		c->in_start = c->in_end = 0;
+	}
+	if(!done && conn_update_events(r, c)) done = 1;
+	if(done)
+	{
+		conn_close(r, c);
+	}
+	return done;
+}
+
+
+/* ************************
+ * splice mode:
+ * 每个连接拥有一对管道，数据经 socket -> pipe -> socket 原样发回，
+ * 全程在内核中移动页面，不经过用户态缓冲区。
+ * 管道本身就是输出队列：管道写满时暂停读取，排空到一半以下再恢复。
+ * 内核不支持对该socket做splice时（EINVAL），退回到普通的缓冲区模式。
+ * */
+static int conn_splice_init(conn_t * c)
+{
+	if(pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC))
+	{
+		alog_error("pipe2: %s", strerror(errno));
+		c->pipe[0] = c->pipe[1] = -1;
+		return -1;
+	}
+	// 管道容量受 /proc/sys/fs/pipe-max-size 限制，设置失败时使用默认容量
+	fcntl(c->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	int size = fcntl(c->pipe[1], F_GETPIPE_SZ);
+	c->pipe_size = (size > 0)?(size_t)size:65536;
+	return 0;
+}
+
+static void conn_splice_fallback(conn_t * c)
+{
+	assert(0 == c->pipe_bytes);
+	alog_warn("splice not supported on [%d], fall back to buffered echo", c->fd);
+	close(c->pipe[0]);
+	close(c->pipe[1]);
+	c->pipe[0] = c->pipe[1] = -1;
+}
+
+// 把管道中的数据发送到socket，直到管道为空或者socket不可写
+static int splice_flush(reactor_t * r, conn_t * c)
+{
+	ssize_t cb;
+	while(c->pipe_bytes)
+	{
+		cb = splice(c->pipe[0], NULL, c->fd, NULL, c->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(-1 == cb)
+		{
+			if(EAGAIN == errno)
+			{
+				metric_add(&r->metrics.eagain_write, 1);
+				break;
+			}
+			if(EINTR == errno) continue;
+			if(EPIPE != errno && ECONNRESET != errno) alog_error("splice: %s", strerror(errno));
+			return -1;
+		}
+		c->pipe_bytes -= cb;
+		conn_sent(r, c, cb);
+		metric_sub(&r->metrics.out_queued, cb);
+	}
+	return 0;
+}
+
+static int on_splice_recv(reactor_t * r, conn_t * c)
+{
+	int done = 0;
+	ssize_t cb;
+	read_budget_t budget;
+	read_budget_init(&budget);
+	while(!c->read_paused)
+	{
+		if(c->pipe_bytes >= c->pipe_size)
+		{
+			c->read_paused = 1;
+			break;
+		}
+		size_t quota = conn_read_quota(r, c, c->pipe_size - c->pipe_bytes);
+		if(0 == quota) break;
+		cb = splice(c->fd, NULL, c->pipe[1], NULL, quota, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(-1 == cb)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno)
+			{
+				metric_add(&r->metrics.eagain_read, 1);
+				break;
+			}
+			if((EINVAL == errno || ENOSYS == errno) && 0 == c->pipe_bytes)
+			{
+				conn_splice_fallback(c);
+				return on_recv(r, c);
+			}
+			if(ECONNRESET != errno) alog_error("splice: %s", strerror(errno));
+			done = 1;
+			break;
+		}else if(0 == cb) // remote close the connection
+		{
+			done = 1;
+			break;
+		}
+		conn_received(r, c, cb);
+		if(0 == c->pipe_bytes) conn_touch_write(r, c);
+		c->pipe_bytes += cb;
+		metric_add(&r->metrics.out_queued, cb);
+		if(splice_flush(r, c))
+		{
+			done = 1;
+			break;
+		}
+		if(c->pipe_bytes && r->wheel && g_write_timeout) conn_timer_update(r, c);
+		if(conn_read_charge(r, c, &budget, cb)) break;
+	}
+	if(!done && conn_update_events(r, c)) done = 1;
+	if(done)
+	{
+		conn_close(r, c);
+	}
+	return done;
+}
+
+/* ************************
+ * UDP mode:
+ * 每个reactor有自己的SO_REUSEPORT数据报socket，由内核按四元组分散到各个reactor。
+ * 一次recvmmsg()收一批数据报到预先分配好的缓冲区，
+ * 再用一次sendmmsg()把它们原样发回各自的来源地址，收发都不需要逐个数据报调用系统调用。
+ * 内核支持UDP_GRO时，同一来源的连续数据报被合并成一个大缓冲区收上来，
+ * 发回时带上UDP_SEGMENT（GSO），由内核（或网卡）按原来的大小重新切分。
+ * 发送缓冲区满时剩下的数据报直接丢弃（UDP本来就不保证送达）。
+ * */
+#define UDP_CTRL_SIZE (CMSG_SPACE(sizeof(int)))
+
+static udp_batch_t * udp_batch_new(int sfd)
+{
+	int on = 1;
+	int size = UDP_SOCK_BUF_SIZE;
+	int i;
+	udp_batch_t * b = calloc(1, sizeof(udp_batch_t));
+	if(NULL == b)
+	{
+		perror("calloc");
+		return NULL;
+	}
+	b->fd = sfd;
+	
+	// 突发流量时socket缓冲区越大，丢包越少
+	setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	b->gro = (0 == setsockopt(sfd, SOL_UDP, UDP_GRO, &on, sizeof(on)));
+	b->batch = b->gro?UDP_GRO_BATCH:UDP_BATCH;
+	b->buf_size = b->gro?UDP_GRO_BUF_SIZE:UDP_BUF_SIZE;
+	b->msgs = calloc(b->batch, sizeof(struct mmsghdr));
+	b->iovs = calloc(b->batch, sizeof(struct iovec));
+	b->addrs = calloc(b->batch, sizeof(struct sockaddr_storage));
+	b->ctrls = aligned_alloc(64, b->batch * UDP_CTRL_SIZE);
+	b->bufs = aligned_alloc(64, b->batch * b->buf_size);
+	if(NULL == b->msgs || NULL == b->iovs || NULL == b->addrs || NULL == b->ctrls || NULL == b->bufs)
+	{
+		perror("udp_batch_new");
+		return NULL;
+	}
+	for(i = 0; i < b->batch; ++i)
+	{
+		b->iovs[i].iov_base = b->bufs + i * b->buf_size;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	}
+	return b;
+}
+
+// GRO合并后的数据报中每一段的大小，0 == 没有合并
+static int udp_gro_size(struct msghdr * hdr)
+{
+	struct cmsghdr * cmsg;
+	for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+	{
+		if(SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type)
+		{
+			int size;
+			memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+			return size;
+		}
+	}
+	return 0;
+}
+
+static void udp_on_readable(reactor_t * r)
+{
+	udp_batch_t * b = r->udp;
+	int i, n, rc;
+	int sent = 0;
+	
+	for(i = 0; i < b->batch; ++i)
+	{
+		struct msghdr * hdr = &b->msgs[i].msg_hdr;
+		hdr->msg_namelen = sizeof(struct sockaddr_storage);
+		hdr->msg_control = b->gro?(b->ctrls + i * UDP_CTRL_SIZE):NULL;
+		hdr->msg_controllen = b->gro?UDP_CTRL_SIZE:0;
+		hdr->msg_flags = 0;
+		b->iovs[i].iov_len = b->buf_size;
+	}
+	n = recvmmsg(b->fd, b->msgs, b->batch, MSG_DONTWAIT, NULL);
+	if(n <= 0)
+	{
+		if(n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) metric_add(&r->metrics.eagain_read, 1);
+		else if(n < 0 && EINTR != errno) alog_error("recvmmsg: %s", strerror(errno));
+		return;
+	}
+	
+	// 发送长度改为实际收到的长度；合并过的数据报用UDP_SEGMENT按原来的大小发回
+	for(i = 0; i < n; ++i)
+	{
+		struct msghdr * hdr = &b->msgs[i].msg_hdr;
+		int segment = b->gro?udp_gro_size(hdr):0;
+		b->iovs[i].iov_len = b->msgs[i].msg_len;
+		metric_add(&r->metrics.bytes_in, b->msgs[i].msg_len);
+		hdr->msg_flags = 0;
+		if(segment > 0 && (unsigned)segment < b->msgs[i].msg_len)
+		{
+			struct cmsghdr * cmsg;
+			uint16_t gso_size = (uint16_t)segment;
+			hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cmsg = CMSG_FIRSTHDR(hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+		}else
+		{
+			hdr->msg_control = NULL;
+			hdr->msg_controllen = 0;
+		}
+	}
+	
+	while(sent < n)
+	{
+		rc = sendmmsg(b->fd, b->msgs + sent, n - sent, MSG_DONTWAIT);
+		if(rc < 0)
+		{
+			if(EINTR == errno) continue;
+			if(EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				metric_add(&r->metrics.eagain_write, 1);
+				break;
+			}
+			// 只有第一个数据报失败时才返回错误（例如ICMP报告的ECONNREFUSED），跳过它
+			alog_debug("sendmmsg: %s", strerror(errno));
+			++sent;
+			continue;
+		}
+		for(i = sent; i < sent + rc; ++i) metric_add(&r->metrics.bytes_out, b->msgs[i].msg_len);
+		sent += rc;
+	}
+}
+
+/* ************************
+ * io_uring backend:
+ * 	- multishot accept: 一个sqe持续接受新连接
+ * 	- multishot recv + provided buffer ring: 一个sqe持续接收数据，由内核挑选缓冲区
+ * 	- 回显时直接发送内核填好的provided buffer（不做memcpy），
+ * 	  同一连接的多个send用IOSQE_IO_LINK串起来，保证发送顺序，
+ * 	  发送完成后再把缓冲区还给buffer ring。
+ * 每一轮循环只调用一次io_uring_enter：同时提交新的sqe并等待完成事件。
+ * 
+ * 连接状态(conn_t)、输出队列和高低水位的处理与epoll backend相同。
+ * */
+enum URING_OP
+{
+	URING_OP_ACCEPT = 1,
+	URING_OP_RECV,
+	URING_OP_SEND,
+	URING_OP_CANCEL,
+	URING_OP_WAKEUP,
+	URING_OP_MASK = 0x07
+};
+
+#define URING_UDATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+
+static int uring_arm_accept(reactor_t * r, reactor_listener_t * rl)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(&r->ring);
+	if(NULL == sqe) return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = rl->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_UDATA(rl, URING_OP_ACCEPT);
+	return 0;
+}
+
+static int uring_arm_recv(reactor_t * r, conn_t * c)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(&r->ring);
+	if(NULL == sqe) return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_UDATA(c, URING_OP_RECV);
+	c->recv_armed = 1;
+	++c->uring_ops;
+	return 0;
+}
+
+static int uring_cancel_recv(reactor_t * r, conn_t * c)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(&r->ring);
+	if(NULL == sqe) return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = URING_UDATA(c, URING_OP_RECV);
+	sqe->user_data = URING_UDATA(NULL, URING_OP_CANCEL);
+	return 0;
+}
+
+/* ************************
+ * 从队首开始，把最多URING_MAX_LINKED_SENDS个数据块用IOSQE_IO_LINK串起来一起提交，
+ * 同一时刻每个连接只有一条send链在飞行中。
+ * 一条链必须在同一次提交中：SQ的空位不够时先提交之前的sqe，仍然不够就缩短这条链，
+ * 剩下的数据块等这条链完成后再发。
+ * */
+static int uring_flush(reactor_t * r, conn_t * c)
+{
+	out_chunk_t * chunk;
+	struct io_uring_sqe * sqe = NULL;
+	unsigned n = 0;
+	if(c->send_inflight || c->closing) return 0;
+	
+	for(chunk = c->out_head; chunk && n < URING_MAX_LINKED_SENDS; chunk = chunk->next) ++n;
+	if(0 == n) return 0;
+	if(uring_sq_space(&r->ring) < n)
+	{
+		if(uring_submit(&r->ring) < 0) return -1;
+		unsigned space = uring_sq_space(&r->ring);
+		if(0 == space) return -1;
+		if(space < n) n = space;
+	}
+	
+	for(chunk = c->out_head; chunk && (unsigned)c->send_inflight < n; chunk = chunk->next)
+	{
+		struct io_uring_sqe * prev = sqe;
+		sqe = uring_get_sqe(&r->ring);	// cannot submit: there is room for the whole chain
+		if(NULL == sqe) return -1;
+		if(prev) prev->flags |= IOSQE_IO_LINK;
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->fd;
+		sqe->addr = (unsigned long)(chunk->data + chunk->offset);
+		sqe->len = (unsigned)(chunk->length - chunk->offset);
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = URING_UDATA(c, URING_OP_SEND);
+		++c->send_inflight;
+		++c->uring_ops;
+	}
+	return 0;
+}
+
+/* ************************
+ * 关闭连接：先shutdown()让飞行中的recv/send尽快结束，
+ * 等所有引用该连接的sqe都完成后再真正释放
+ * */
+static void uring_conn_close(reactor_t * r, conn_t * c)
+{
+	if(!c->closing)
+	{
+		c->closing = 1;
+		shutdown(c->fd, SHUT_RDWR);
+		if(r->wheel) timer_wheel_del(r->wheel, &c->timer);
+	}
+	if(c->uring_ops > 0 || c->starved) return;
+	conn_close(r, c);
+}
+
+static void uring_conn_add(reactor_t * r, int fd)
+{
+	conn_t * c = conn_new(r, fd);
+	if(NULL == c)
+	{
+		close(fd);
+		return;
+	}
+	alog_info("[%d] connected on [%d]", r->id, fd);
+	conn_sockopt_init(c);
+	if(uring_arm_recv(r, c)) uring_conn_close(r, c);
+}
+
+static void uring_on_accept(reactor_t * r, reactor_listener_t * rl, struct io_uring_cqe * cqe)
+{
+	if(!(cqe->flags & IORING_CQE_F_MORE) && !r->draining) uring_arm_accept(r, rl);
+	if(cqe->res < 0)
+	{
+		if(-EAGAIN != cqe->res && -EINTR != cqe->res && -ECANCELED != cqe->res) alog_error("accept: %s", strerror(-cqe->res));
+		return;
+	}
+	uring_conn_add(r, cqe->res);
+}
+
+static int uring_arm_wakeup(reactor_t * r)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(&r->ring);
+	if(NULL == sqe) return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->evfd;
+	sqe->addr = (unsigned long)&r->evfd_value;
+	sqe->len = sizeof(r->evfd_value);
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = URING_UDATA(NULL, URING_OP_WAKEUP);
+	return 0;
+}
+
+// acceptor转交过来的连接、从旧进程接管的连接，或者侦听socket已经交给了新进程：取消multishot accept
+static void uring_on_wakeup(reactor_t * r)
+{
+	int fd, k;
+	while(r->accept_queue && -1 != (fd = fd_queue_pop(r->accept_queue)))
+	{
+		uring_conn_add(r, fd);
+	}
+	while(r->handover_queue && -1 != (fd = fd_queue_pop(r->handover_queue)))
+	{
+		uring_conn_add(r, fd);
+	}
+	if(!r->draining && __atomic_load_n(&g_draining, __ATOMIC_ACQUIRE))
+	{
+		r->draining = 1;
+		for(k = 0; k < r->num_listeners; ++k)
+		{
+			struct io_uring_sqe * sqe = uring_get_sqe(&r->ring);
+			if(NULL == sqe) break;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = URING_UDATA(&r->listeners[k], URING_OP_ACCEPT);
+			sqe->user_data = URING_UDATA(NULL, URING_OP_CANCEL);
+		}
+		alog_info("[%d] stopped accepting, %d connection(s) left", r->id, r->num_conns);
+	}
+	uring_arm_wakeup(r);
+}
+
+static void uring_on_recv(reactor_t * r, conn_t * c, struct io_uring_cqe * cqe)
+{
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	if(!more)
+	{
+		c->recv_armed = 0;
+		--c->uring_ops;
+	}
+	
+	if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	{
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		out_chunk_t * chunk = out_chunk_new(r);
+		if(NULL == chunk)
+		{
+			uring_buf_ring_add(&r->bufs, bid);
+			uring_buf_ring_commit(&r->bufs);
+			uring_conn_close(r, c);
+			return;
+		}
+		chunk->data = (char *)uring_buf_ring_addr(&r->bufs, bid);
+		chunk->length = cqe->res;
+		chunk->bid = (int)bid;
+		conn_received(r, c, cqe->res);
+		if(c->out_tail) c->out_tail->next = chunk;
+		else c->out_head = chunk;
+		c->out_tail = chunk;
+		if(0 == c->out_bytes) conn_output_queued(r, c);
+		c->out_bytes += cqe->res;
+		metric_add(&r->metrics.out_queued, cqe->res);
+		
+		if(c->closing)
+		{
+			uring_conn_close(r, c);
+			return;
+		}
+		
+		// 对端读得太慢：取消multishot recv，等输出队列降到低水位以下再重新开始接收
+		if(c->out_bytes > OUT_HIGH_WATER && !c->read_paused)
+		{
+			c->read_paused = 1;
+			if(c->recv_armed) uring_cancel_recv(r, c);
+		}
+		if(uring_flush(r, c)) uring_conn_close(r, c);
+		else if(!more && !c->read_paused) uring_arm_recv(r, c);
+		return;
+	}
+	
+	if(c->closing)
+	{
+		uring_conn_close(r, c);
+		return;
+	}
+	if(-ENOBUFS == cqe->res)
+	{
+		// buffer ring已经用完，等有缓冲区归还时再重新开始接收
+		if(!c->starved)
+		{
+			c->starved = 1;
+			c->next_starved = r->starved;
+			r->starved = c;
+		}
+		return;
+	}
+	if(-ECANCELED == cqe->res && c->read_paused) return;
+	if(0 != cqe->res && -ECONNRESET != cqe->res) alog_error("recv: %s", strerror(-cqe->res));
+	uring_conn_close(r, c); // 0 == remote close the connection
+}
+
+static void uring_on_send(reactor_t * r, conn_t * c, struct io_uring_cqe * cqe)
+{
+	out_chunk_t * chunk = c->out_head;
+	--c->send_inflight;
+	--c->uring_ops;
+	
+	if(cqe->res < 0)
+	{
+		// 链中前一个send失败或者发送不完整时，后续的send会被取消，
+		// 数据仍然留在队列中，等整条链结束后重新提交
+		if(-ECANCELED != cqe->res && !c->closing)
+		{
+			if(-EPIPE != cqe->res && -ECONNRESET != cqe->res) alog_error("send: %s", strerror(-cqe->res));
+			uring_conn_close(r, c);
+			return;
+		}
+	}else
+	{
+		assert(NULL != chunk);
+		chunk->offset += cqe->res;
+		c->out_bytes -= cqe->res;
+		conn_sent(r, c, cqe->res);
+		metric_sub(&r->metrics.out_queued, cqe->res);
+		if(chunk->offset == chunk->length)
+		{
+			c->out_head = chunk->next;
+			if(NULL == c->out_head) c->out_tail = NULL;
+			out_chunk_free(r, chunk);
+		}
+	}
+	
+	if(c->closing)
+	{
+		uring_conn_close(r, c);
+		return;
+	}
+	if(c->send_inflight) return;
+	
+	if(c->read_paused && c->out_bytes <= OUT_LOW_WATER)
+	{
+		c->read_paused = 0;
+		if(!c->recv_armed && !c->starved) uring_arm_recv(r, c);
+	}
+	if(uring_flush(r, c)) uring_conn_close(r, c);
+}
+
+// 有缓冲区被归还之后，让因ENOBUFS而停止接收的连接重新开始接收
+static void uring_wake_starved(reactor_t * r)
+{
+	conn_t * c = r->starved;
+	r->starved = NULL;
+	while(c)
+	{
+		conn_t * next = c->next_starved;
+		c->starved = 0;
+		c->next_starved = NULL;
+		if(c->closing) uring_conn_close(r, c);
+		else if(!c->read_paused && !c->recv_armed) uring_arm_recv(r, c);
+		c = next;
+	}
+}
+
+static int uring_reactor_run(reactor_t * r)
+{
+	int rc;
+	int k;
+	
+	rc = uring_init(&r->ring, URING_ENTRIES, URING_CQ_ENTRIES, 
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+	if(rc) rc = uring_init(&r->ring, URING_ENTRIES, URING_CQ_ENTRIES, 0);
+	if(rc)
+	{
+		perror("io_uring_setup");
+		return -1;
+	}
+	rc = uring_buf_ring_setup(&r->ring, &r->bufs, URING_NUM_BUFS, URING_BUF_SIZE, URING_BGID);
+	if(rc)
+	{
+		perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+		uring_cleanup(&r->ring);
+		return -1;
+	}
+	
+	for(k = 0; k < r->num_listeners; ++k) uring_arm_accept(r, &r->listeners[k]);
+	if(r->evfd >= 0) uring_arm_wakeup(r);
+	while(1)
+	{
+		struct io_uring_cqe * cqe;
+		unsigned free_bufs = r->bufs.tail;
+		
+		int timeout = r->wheel?timer_wheel_next_timeout(r->wheel, r->now_ms):-1;
+		rc = uring_submit_and_wait_timeout(&r->ring, 1, timeout);
+		uint64_t t_ready = clock_now_ns();
+		r->now_ms = t_ready / 1000000;
+		int n = 0;
+		if(rc < 0 && EINTR != errno && EBUSY != errno && ETIME != errno)
+		{
+			perror("io_uring_enter");
+			break;
+		}
+		
+		while(NULL != (cqe = uring_peek_cqe(&r->ring)))
+		{
+			void * ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+			conn_t * c = (conn_t *)ptr;
+			switch(cqe->user_data & URING_OP_MASK)
+			{
+				case URING_OP_ACCEPT: uring_on_accept(r, (reactor_listener_t *)ptr, cqe); break;
+				case URING_OP_RECV: uring_on_recv(r, c, cqe); break;
+				case URING_OP_SEND: uring_on_send(r, c, cqe); break;
+				case URING_OP_WAKEUP: uring_on_wakeup(r); break;
+				default: break;
+			}
+			uring_cqe_seen(&r->ring);
+			hdr_hist_record(&r->metrics.latency, clock_now_ns() - t_ready);
+			++n;
+		}
+		if(n > 0) reactor_metrics_wakeup(r, n);
+		
+		if(r->starved && free_bufs != r->bufs.tail) uring_wake_starved(r);
+		if(r->wheel) timer_wheel_advance(r->wheel, r->now_ms, conn_on_timer, r);
+	}
+	
+	uring_buf_ring_cleanup(&r->bufs);
+	uring_cleanup(&r->ring);
+	return -1;
 }
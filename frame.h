@@ -0,0 +1,112 @@
+/*
+ * frame.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+/* ************************
+ * 长度前缀的消息帧：
+ * 	FRAME_U32    - 4字节大端序长度 + 数据
+ * 	FRAME_VARINT - LEB128无符号变长整数（1~5字节）+ 数据
+ * 长度只包括数据部分，不包括前缀本身。
+ * */
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum FRAME_TYPE
+{
+	FRAME_NONE = 0,	// raw byte stream
+	FRAME_U32,
+	FRAME_VARINT,
+};
+
+#define FRAME_MAX_HEADER (5)
+#define FRAME_MAX_SIZE (16 * 1024 * 1024)	// larger frames are protocol errors
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline size_t frame_encode_header(int type, unsigned char * p, uint32_t length)
+{
+	size_t n = 0;
+	if(FRAME_U32 == type)
+	{
+		p[0] = (unsigned char)(length >> 24);
+		p[1] = (unsigned char)(length >> 16);
+		p[2] = (unsigned char)(length >> 8);
+		p[3] = (unsigned char)length;
+		return 4;
+	}
+	while(length >= 0x80)
+	{
+		p[n++] = (unsigned char)(length | 0x80);
+		length >>= 7;
+	}
+	p[n++] = (unsigned char)length;
+	return n;
+}
+
+/* ************************
+ * 解析前缀，返回值：
+ * 	> 0  前缀的长度，*length为数据长度
+ * 	0    数据不够，还需要继续接收
+ * 	-1   格式错误或者超过FRAME_MAX_SIZE
+ * */
+static inline int frame_parse_header(int type, const unsigned char * p, size_t avail, uint32_t * length)
+{
+	size_t i;
+	uint32_t value = 0;
+	if(FRAME_U32 == type)
+	{
+		if(avail < 4) return 0;
+		value = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+		if(value > FRAME_MAX_SIZE) return -1;
+		*length = value;
+		return 4;
+	}
+
+	for(i = 0; i < avail && i < FRAME_MAX_HEADER; ++i)
+	{
+		value |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+		if(0 == (p[i] & 0x80))
+		{
+			if(value > FRAME_MAX_SIZE) return -1;
+			*length = value;
+			return (int)(i + 1);
+		}
+	}
+	return (i == FRAME_MAX_HEADER)?-1:0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
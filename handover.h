@@ -0,0 +1,210 @@
+/*
+ * handover.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+/* ************************
+ * 平滑重启 (echoserv -H)：
+ * 新进程连接旧进程的handover socket (AF_UNIX SOCK_SEQPACKET)，发送HANDOVER_REQUEST，
+ * 旧进程用SCM_RIGHTS把所有侦听socket逐个发过来（每条消息一个fd，附带侦听地址的名字），
+ * 以HANDOVER_LISTENERS_DONE结束，然后停止accept，处理完已有的连接后退出。
+ * 请求中带HANDOVER_F_CONNS时，旧进程还会把空闲的连接以HANDOVER_CONN转交过来，
+ * 旧进程关闭这个连接即表示转交结束。
+ * 侦听socket本身没有关闭过，backlog中尚未accept的连接也不会丢失。
+ * */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transport.h"
+
+#define HANDOVER_MAGIC (0x45484f31)	// "EHO1"
+
+enum HANDOVER_TYPE
+{
+	HANDOVER_REQUEST = 1,		// new -> old
+	HANDOVER_LISTENER,			// old -> new, with a listening socket
+	HANDOVER_LISTENERS_DONE,	// old -> new, the old process stops accepting
+	HANDOVER_CONN,				// old -> new, with an idle connection
+};
+
+#define HANDOVER_F_CONNS (0x01)	// HANDOVER_REQUEST: also take over idle connections
+
+typedef struct handover_msg
+{
+	uint32_t magic;
+	uint32_t type;
+	uint32_t flags;
+	char name[TRANSPORT_NAME_MAX];	// HANDOVER_LISTENER: transport_addr_name() of the listener
+}handover_msg_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void handover_msg_init(handover_msg_t * msg, uint32_t type, const char * name)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->magic = HANDOVER_MAGIC;
+	msg->type = type;
+	if(name) snprintf(msg->name, sizeof(msg->name), "%s", name);
+}
+
+// 发送一条消息，fd >= 0时用SCM_RIGHTS附带这个文件描述符；成功返回0
+static inline int handover_send(int sock, const handover_msg_t * msg, int fd)
+{
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	}ctrl;
+	struct iovec iov;
+	struct msghdr hdr;
+	ssize_t cb;
+	
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = (void *)msg;
+	iov.iov_len = sizeof(*msg);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	if(fd >= 0)
+	{
+		struct cmsghdr * cmsg;
+		memset(&ctrl, 0, sizeof(ctrl));
+		hdr.msg_control = ctrl.buf;
+		hdr.msg_controllen = sizeof(ctrl.buf);
+		cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	do
+	{
+		cb = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+	}while(-1 == cb && EINTR == errno);
+	if(cb < 0) return -1;
+	if((size_t)cb != sizeof(*msg))
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 0;
+}
+
+/* ************************
+ * 接收一条消息，附带的文件描述符放入*fd（没有时为-1，已设置FD_CLOEXEC）。
+ * 返回值：1 收到一条消息，0 对端已关闭，-1 出错（包括EAGAIN和格式错误EPROTO）
+ * */
+static inline int handover_recv(int sock, handover_msg_t * msg, int * fd)
+{
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	}ctrl;
+	struct iovec iov;
+	struct msghdr hdr;
+	struct cmsghdr * cmsg;
+	ssize_t cb;
+	
+	*fd = -1;
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = ctrl.buf;
+	hdr.msg_controllen = sizeof(ctrl.buf);
+	do
+	{
+		cb = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	}while(-1 == cb && EINTR == errno);
+	if(cb <= 0) return (int)cb;
+	
+	for(cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+	{
+		if(SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type 
+			&& cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+		{
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if((size_t)cb != sizeof(*msg) || HANDOVER_MAGIC != msg->magic || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+	{
+		if(*fd >= 0) close(*fd);
+		*fd = -1;
+		errno = EPROTO;
+		return -1;
+	}
+	msg->name[sizeof(msg->name) - 1] = '\0';
+	return 1;
+}
+
+// 旧进程一侧：addr必须是AF_UNIX SOCK_SEQPACKET地址，文件系统中的路径先删除旧文件再bind
+static inline int handover_listen(const transport_addr_t * addr)
+{
+	int sfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(-1 == sfd) return -1;
+	if(!transport_addr_is_abstract(addr)) unlink(addr->un.sun_path);
+	if(bind(sfd, (const struct sockaddr *)&addr->un, addr->un_len) || listen(sfd, 1))
+	{
+		int err = errno;
+		close(sfd);
+		errno = err;
+		return -1;
+	}
+	return sfd;
+}
+
+// 新进程一侧：没有旧进程在运行时失败，errno为ENOENT或ECONNREFUSED
+static inline int handover_connect(const transport_addr_t * addr)
+{
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(-1 == sock) return -1;
+	if(connect(sock, (const struct sockaddr *)&addr->un, addr->un_len))
+	{
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	return sock;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * metrics.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+/* ************************
+ * 单写者计数器与HDR风格的直方图：
+ * 	- 每个计数器只由一个线程（所属的reactor）写入，其他线程只读，
+ * 	  写入用relaxed的load + store，在x86上就是普通的add，没有lock前缀
+ * 	- 直方图按对数-线性分桶：每个2的幂区间再等分为HIST_SUB_COUNT个子桶，
+ * 	  相对误差不超过 1/HIST_SUB_COUNT，小于HIST_SUB_COUNT的值精确记录
+ * 	- 读取方（统计输出）可以在写入的同时读取，得到的是近似一致的快照
+ * */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS (5)
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)	// 32 sub-buckets, ~3% precision
+#define HIST_MAX_BITS (40)	// values >= 2^40 are clamped (~18 minutes in ns)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct hdr_hist
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;	// valid when count > 0
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+}hdr_hist_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 单写者的计数器：其他线程用metric_get()读取
+static inline void metric_add(uint64_t * counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_sub(uint64_t * counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metric_get(const uint64_t * counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline unsigned hdr_hist_index(uint64_t value)
+{
+	if(value < HIST_SUB_COUNT) return (unsigned)value;
+	if(value >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+	unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+	unsigned shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + (unsigned)(value >> shift) - HIST_SUB_COUNT;
+}
+
+// 桶中最大的值：报告百分位时取上界，不会低估延迟
+static inline uint64_t hdr_hist_bucket_high(unsigned index)
+{
+	unsigned group = index / HIST_SUB_COUNT;
+	if(group <= 1) return index;
+	unsigned shift = group - 1;
+	uint64_t low = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void hdr_hist_record(hdr_hist_t * hist, uint64_t value)
+{
+	metric_add(&hist->buckets[hdr_hist_index(value)], 1);
+	if(0 == hist->count || value < hist->min) __atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+	if(value > hist->max) __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	metric_add(&hist->sum, value);
+	metric_add(&hist->count, 1);
+}
+
+// 把src累加到dst中，src可以正在被其他线程写入
+static inline void hdr_hist_merge(hdr_hist_t * dst, const hdr_hist_t * src)
+{
+	unsigned i;
+	uint64_t count = metric_get(&src->count);
+	if(0 == count) return;
+	uint64_t min = metric_get(&src->min);
+	uint64_t max = metric_get(&src->max);
+	if(0 == dst->count || min < dst->min) dst->min = min;
+	if(max > dst->max) dst->max = max;
+	dst->count += count;
+	dst->sum += metric_get(&src->sum);
+	for(i = 0; i < HIST_BUCKETS; ++i) dst->buckets[i] += metric_get(&src->buckets[i]);
+}
+
+// percentile: 0.0 ~ 100.0
+static inline uint64_t hdr_hist_percentile(const hdr_hist_t * hist, double percentile)
+{
+	unsigned i;
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	for(i = 0; i < HIST_BUCKETS; ++i) total += hist->buckets[i];
+	if(0 == total) return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > total) rank = total;
+	for(i = 0; i < HIST_BUCKETS; ++i)
+	{
+		seen += hist->buckets[i];
+		if(seen >= rank) break;
+	}
+	uint64_t value = hdr_hist_bucket_high(i);
+	return (value > hist->max)?hist->max:value;
+}
+
+// 输出一个JSON对象（不带换行），hist应当是hdr_hist_merge()得到的快照
+static inline void hdr_hist_print_json(const hdr_hist_t * hist, FILE * fp)
+{
+	fprintf(fp, "{\"count\":%lu,\"min\":%lu,\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,"
+		"\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+		(unsigned long)hist->count,
+		(unsigned long)(hist->count?hist->min:0),
+		hist->count?((double)hist->sum / (double)hist->count):0.0,
+		(unsigned long)hdr_hist_percentile(hist, 50.0),
+		(unsigned long)hdr_hist_percentile(hist, 90.0),
+		(unsigned long)hdr_hist_percentile(hist, 99.0),
+		(unsigned long)hdr_hist_percentile(hist, 99.9),
+		(unsigned long)hist->max);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * mpsc_queue.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+/* ************************
+ * 有界的多生产者/单消费者队列，按批次唤醒消费者：
+ * 	- 生产者用一次fetch-add预留位置（tail），不需要加锁，也没有CAS重试，
+ * 	  写入元素后把槽位的序号设为 pos + 1 表示已经发布；
+ * 	  消费者取走后把序号设为 pos + capacity，表示这个槽位可以给下一轮的生产者使用
+ * 	- 预留到第 k * batch - 1 个位置的生产者在发布后把批次计数加1，
+ * 	  只有消费者正在睡眠时才调用futex唤醒它，每个批次最多一次系统调用
+ * 	- 队列满时生产者在自己预留的槽位上自旋等待（sched_yield），不会丢失元素，
+ * 	  capacity应当是batch的若干倍
+ * 
+ * 预留和发布之间有几条指令的间隔，发布的顺序不一定是预留的顺序，
+ * 所以批次计数只表示这一批的位置都已经被预留，消费者取到还没有发布的槽位时要等一下（mpsc_queue_pop_wait()）。
+ * Linux only (futex).
+ * */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MPSC_SPIN (64)	// polls before sched_yield()
+
+typedef struct mpsc_slot
+{
+	uint64_t seq;
+	void * value;
+}mpsc_slot_t;
+
+typedef struct mpsc_queue
+{
+	uint64_t tail __attribute__((aligned(64)));		// next position to reserve, producers
+	uint32_t batches __attribute__((aligned(64)));	// completed batches, futex word
+	int sleeping;									// the consumer is (about to be) in futex_wait
+	uint64_t head __attribute__((aligned(64)));		// next position to consume, consumer only
+	uint64_t mask;
+	unsigned batch;
+	mpsc_slot_t * slots;
+}mpsc_queue_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ************************
+ * capacity: 2的幂，batch: 每多少个元素唤醒一次消费者
+ * */
+static inline int mpsc_queue_init(mpsc_queue_t * q, size_t capacity, unsigned batch)
+{
+	size_t i;
+	if(0 == capacity || (capacity & (capacity - 1)) || 0 == batch) return -1;
+	memset(q, 0, sizeof(*q));
+	q->slots = (mpsc_slot_t *)aligned_alloc(64, (capacity * sizeof(mpsc_slot_t) + 63) & ~(size_t)63);
+	if(NULL == q->slots) return -1;
+	for(i = 0; i < capacity; ++i)
+	{
+		q->slots[i].seq = i;
+		q->slots[i].value = NULL;
+	}
+	q->mask = capacity - 1;
+	q->batch = batch;
+	return 0;
+}
+
+static inline void mpsc_queue_cleanup(mpsc_queue_t * q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+static inline void mpsc_queue_spin(unsigned * spins)
+{
+	if(++*spins >= MPSC_SPIN) sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+	else __builtin_ia32_pause();
+#endif
+}
+
+// 批次计数加1，消费者在睡眠时唤醒它；也用于退出时唤醒消费者
+static inline void mpsc_queue_wake(mpsc_queue_t * q)
+{
+	__atomic_add_fetch(&q->batches, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST))
+	{
+		syscall(SYS_futex, &q->batches, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static inline void mpsc_queue_push(mpsc_queue_t * q, void * value)
+{
+	unsigned spins = 0;
+	uint64_t pos = __atomic_fetch_add(&q->tail, 1, __ATOMIC_RELAXED);
+	mpsc_slot_t * slot = &q->slots[pos & q->mask];
+	while(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos) mpsc_queue_spin(&spins);	// full
+	slot->value = value;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	if(0 == (pos + 1) % q->batch) mpsc_queue_wake(q);
+}
+
+// 只由消费者调用：取出下一个元素，还没有发布时返回-1
+static inline int mpsc_queue_pop(mpsc_queue_t * q, void ** value)
+{
+	mpsc_slot_t * slot = &q->slots[q->head & q->mask];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) return -1;
+	*value = slot->value;
+	__atomic_store_n(&slot->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+	++q->head;
+	return 0;
+}
+
+// 取出已经被预留的下一个元素，等待生产者发布
+static inline void * mpsc_queue_pop_wait(mpsc_queue_t * q)
+{
+	void * value;
+	unsigned spins = 0;
+	while(mpsc_queue_pop(q, &value)) mpsc_queue_spin(&spins);
+	return value;
+}
+
+// 只由消费者调用：已经被预留的元素个数，包括还没有发布的
+static inline uint64_t mpsc_queue_length(mpsc_queue_t * q)
+{
+	return __atomic_load_n(&q->tail, __ATOMIC_RELAXED) - q->head;
+}
+
+/* ************************
+ * 只由消费者调用：等到批次计数不等于seen，返回新的批次计数。
+ * sleeping与batches的先写后读都是SEQ_CST，生产者和消费者至少有一方能看到对方的写入，不会漏掉唤醒
+ * */
+static inline uint32_t mpsc_queue_wait(mpsc_queue_t * q, uint32_t seen)
+{
+	uint32_t batches;
+	while(seen == (batches = __atomic_load_n(&q->batches, __ATOMIC_ACQUIRE)))
+	{
+		__atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+		if(seen == __atomic_load_n(&q->batches, __ATOMIC_SEQ_CST))
+		{
+			syscall(SYS_futex, &q->batches, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+		}
+		__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return batches;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,50 +28,74 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
 
+#include "mpsc_queue.h"
+
 #define N 6
+#define BATCH_BUFFERS (256)	// 2的幂，2就是双缓冲；等待线程落后不超过BATCH_BUFFERS - 1批时工作者线程不用等待
 
 /* ************************
- * 在使用条件变量时，尽可能地创建一个单独的互斥锁，将其仅用于同步条件变量cond，
- * 假使为了省事，将该mutex用在了其他地方，如果实现的逻辑有出了差错，可能会出现不可预知的结果
- * 为此，下面自定义了一个结构体，将cond和mutex强行捆绑在一起，避免误用
+ * 多个【工作者线程】产生数据，每凑满N个，【等待线程】计算一次平均值。
+ * 
+ * 原来的做法是所有工作者线程用同一个mutex保护data[N]和count，count == N时用条件变量通知等待线程，
+ * 在等待线程取走并打印之前，其他工作者线程只能每10 ms重试一次。
+ * 现在是N路缓冲：
+ * 	- 工作者线程用fetch-add在当前的缓冲区（current）中预留位置，互相之间没有锁
+ * 	- 预留到最后一个位置的线程从空闲队列中取一个新的缓冲区换上去，其他线程马上转到新的缓冲区，
+ * 	  不用等这一批被处理
+ * 	- 写满的缓冲区通过ready队列（mpsc_queue.h）整个交给等待线程，只有这时才唤醒等待线程；
+ * 	  等待线程计算、打印完以后把缓冲区放回空闲队列，printf()不在工作者线程的路径上
+ * 	- 只有所有缓冲区都在等待处理时（等待线程持续跟不上），换缓冲区的线程才需要等待，计入stalls
+ * 
+ * usage: pthread_cond_usuage [workers] [work_us]
+ * 	work_us是每个工作者线程产生一个数据后模拟的工作量（默认100 ms），0表示测试本身的吞吐量
  * */
-typedef struct cond_mutex
+typedef struct batch
 {
-	pthread_cond_t c;
-	pthread_mutex_t m;
-}cond_mutex_t;
+	unsigned reserved;	// fetch-add by the workers, >= N: full, move to the next buffer
+	unsigned filled;	// values written, the worker that makes it N hands the buffer over
+	int data[N];
+}batch_t;
 
-/* ************************
- * 初始化 互斥锁 和 条件变量 
- * */
-cond_mutex_t cm = 
-{
-	PTHREAD_COND_INITIALIZER,
-	PTHREAD_MUTEX_INITIALIZER
-};
- 
+static batch_t buffers[BATCH_BUFFERS];
+static batch_t * current;	// the buffer being filled
+static mpsc_queue_t ready;	// full buffers, workers -> wait thread
+static mpsc_queue_t spare;	// empty buffers, wait thread -> the worker that switches buffers
+static uint64_t stalls = 0;	// no spare buffer when one was needed
  
 static void * wait_thread(void * param);   // 等待线程
 static void * worker_thread(void * param); // 工作者线程
 
-// 用一个mutex来同步对count的操作
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static int count = 0;
-static int data[N];
-
 unsigned int seed;
-volatile int quit = 0; // notify threads to quit
+volatile int quit = 0; // notify workers to quit
+volatile int stop = 0; // notify the wait thread to quit, after all workers have quit
+static useconds_t work_us = 100000; // 100 ms
+static uint64_t processed = 0; // batches, written by the wait thread
 
 int main(int argc, char ** argv)
 {
 	int rc;
 	int i;
 #define NUM_WORKERS (4)
-	pthread_t th[NUM_WORKERS + 1]; // 1个等待线程、NUM_WORKERS个工作者线程
+	int num_workers = (argc > 1)?atoi(argv[1]):NUM_WORKERS;
+	if(argc > 2) work_us = (useconds_t)atoi(argv[2]);
+	if(num_workers < 1)
+	{
+		fprintf(stderr, "usage: %s [workers] [work_us]\n", argv[0]);
+		exit(1);
+	}
+	pthread_t * th = calloc(num_workers + 1, sizeof(pthread_t)); // 1个等待线程、num_workers个工作者线程
+	if(NULL == th || mpsc_queue_init(&ready, BATCH_BUFFERS, 1) || mpsc_queue_init(&spare, BATCH_BUFFERS, 1))
+	{
+		perror("init");
+		exit(1);
+	}
+	current = &buffers[0];
+	for(i = 1; i < BATCH_BUFFERS; ++i) mpsc_queue_push(&spare, &buffers[i]);
 	seed = time(NULL);
 	
 	void * ret_code = NULL;
@@ -86,9 +110,11 @@ int main(int argc, char ** argv)
 	usleep(5000); // 5 ms
 	
 	// 创建工作者线程
-	for(i = 1; i <= NUM_WORKERS; ++i)
+	struct timespec t_start, t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for(i = 1; i <= num_workers; ++i)
 	{
-		rc = pthread_create(&th[i], NULL, worker_thread, NULL);
+		rc = pthread_create(&th[i], NULL, worker_thread, (void *)(long)i);
 		if(0 != rc)
 		{
 			perror("pthread_create");
@@ -100,67 +126,80 @@ int main(int argc, char ** argv)
 	printf("press enter to quit.\n");
 	while(1)
 	{
-		scanf("%c", &c);
+		if(1 != scanf("%c", &c)) break;
 		if(c == '\n') break;
 	}
 	
+	// 先让工作者线程退出：没有空闲的缓冲区时它们在等待线程处理完之前不会返回
 	quit = 1;
-	pthread_cond_broadcast(&cm.c); // 激活在所有线程中正在等待中的条件变量
-	
-	pthread_join(th[0], &ret_code);
-	for(i = 1; i <= NUM_WORKERS; ++i)
+	for(i = 1; i <= num_workers; ++i)
 	{
 		pthread_join(th[i], &ret_code);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE); // 工作者线程的push都在这之前完成
+	mpsc_queue_wake(&ready); // 激活正在等待中的等待线程
+	pthread_join(th[0], &ret_code);
 	
+	double elapsed = (double)(t_end.tv_sec - t_start.tv_sec) + (double)(t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+	uint64_t values = processed * N;
+	printf("%d workers: %lu values in %.3f s (%.0f per second), %lu batches, %lu stalls\n", 
+		num_workers, (unsigned long)values, elapsed, (double)values / elapsed, 
+		(unsigned long)processed, (unsigned long)stalls);
 	
 	rc = (int)(long)ret_code;
 	
-	pthread_mutex_destroy(&mutex);
-	pthread_cond_destroy(&cm.c);
-	pthread_mutex_destroy(&cm.m);
+	mpsc_queue_cleanup(&ready);
+	mpsc_queue_cleanup(&spare);
+	free(th);
 	return rc;	
 }
 
-static void * worker_thread(void * param)
+/* ************************
+ * 取得最后一个位置的线程负责换上新的缓冲区，spare的取出由它们依次进行（单消费者）：
+ * 下一次换缓冲区一定发生在新的current发布之后
+ * */
+static void switch_buffer(void)
 {
-	while(!quit)
-	{	
-		pthread_mutex_lock(&mutex); // 先加锁之后，再修改data和count值
-		
-		if(quit) // 有可能在锁定等待期间被用户强行退出
+	void * next;
+	unsigned spins = 0;
+	if(mpsc_queue_pop(&spare, &next))
+	{
+		++stalls; // only one worker switches at a time
+		while(mpsc_queue_pop(&spare, &next)) mpsc_queue_spin(&spins);
+	}
+	batch_t * b = next;
+	b->filled = 0;
+	__atomic_store_n(&b->reserved, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&current, b, __ATOMIC_RELEASE);
+}
+
+static void batch_put(int value)
+{
+	unsigned spins = 0;
+	while(1)
+	{
+		batch_t * b = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+		unsigned i = __atomic_fetch_add(&b->reserved, 1, __ATOMIC_ACQ_REL);
+		if(i >= N) // 正在换缓冲区，或者b已经不是current
 		{
-			pthread_mutex_unlock(&mutex);
-			break;
-		}
-		if(count == N) //某一个【工作者线程】已经触发了条件变量，但【等待线程】还没来得及加锁
-		{	
-			printf("正在与【等待线程】争抢资源...\n");		
-			pthread_mutex_unlock(&mutex);			
-			usleep(10000); // sleep 10 ms, 给其他线程一个机会
+			mpsc_queue_spin(&spins);
 			continue;
 		}
-	//~ #ifdef _DEBUG
-		if(count > N) // 应该不可能发生，仅供调试时使用
-		{
-			fprintf(stderr, "同步的逻辑出现问题，请检查源代码。\n");
-			printf("请按回车建退出...\n");
-			quit = 1;
-			pthread_mutex_unlock(&mutex);
-			break;
-		}
-	//~ #endif
-	
-		data[count++] = rand_r(&seed) % 1000;	
-		
-		if(count == N)
-		{
-			pthread_mutex_lock(&cm.m);			
-			pthread_cond_signal(&cm.c);
-			pthread_mutex_unlock(&cm.m);			
-		}
-		pthread_mutex_unlock(&mutex); // 解锁
-		usleep(100000); // 100 ms; 人为故意地延迟一下，模拟一下真实场景可能需要的工作量。
+		if(i == N - 1) switch_buffer();
+		b->data[i] = value;
+		if(N == __atomic_add_fetch(&b->filled, 1, __ATOMIC_ACQ_REL)) mpsc_queue_push(&ready, b);
+		return;
+	}
+}
+
+static void * worker_thread(void * param)
+{
+	unsigned int s = seed + (unsigned)(long)param; // rand_r()的状态不能在线程之间共享
+	while(!quit)
+	{	
+		batch_put(rand_r(&s) % 1000);
+		if(work_us) usleep(work_us); // 人为故意地延迟一下，模拟一下真实场景可能需要的工作量。
 	}
 	pthread_exit((void *)(long)0);
 }
@@ -168,30 +207,33 @@ static void * worker_thread(void * param)
 static void * wait_thread(void * param)
 {
 	int i, sum;
-	pthread_mutex_lock(&cm.m);	
-	while(!quit)
+	void * p;
+	uint32_t seen = 0;
+	while(1)
 	{
-		pthread_cond_wait(&cm.c, &cm.m);
-		if(quit) break; //有可能是在等待期间被用户干预，强制退出的（在while中判断时quit可能还是0）
+		seen = mpsc_queue_wait(&ready, seen);
+		
+		// 先读stop再取：看到stop时所有写满的缓冲区都已经在ready中，这一轮会全部取走
+		int last = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
 		
-		pthread_mutex_lock(&mutex); // 先上锁，避免其他线程修改 data 和 count 值
-		sum = 0;
-		printf("average = (");
-		for(i = 0; i < N; ++i)
+		// 缓冲区已经属于等待线程，处理完再还回去
+		while(0 == mpsc_queue_pop(&ready, &p))
 		{
-			sum += data[i];
-			printf(" %3d ", data[i]);
-			if(i < (N - 1)) printf("+");
+			batch_t * b = p;
+			sum = 0;
+			printf("average = (");
+			for(i = 0; i < N; ++i)
+			{
+				sum += b->data[i];
+				printf(" %3d ", b->data[i]);
+				if(i < (N - 1)) printf("+");
+			}
+			printf(") / %d = %.2f\n", N, (double)sum / (double)N);
+			__atomic_store_n(&processed, processed + 1, __ATOMIC_RELAXED);
+			mpsc_queue_push(&spare, b);
 		}
-		
-		
-		printf(") / %d = %.2f\n", N, (double)sum / (double)N);
-		count = 0;
-		pthread_mutex_unlock(&mutex);
-		
+		if(last) break; // 工作者线程都已经退出，current中剩下的不足一批
 	} // end while
 	
-	pthread_mutex_unlock(&cm.m);
-	
 	pthread_exit((void *)(long)0);
 }
@@ -0,0 +1,129 @@
+/*
+ * slab.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/* ************************
+ * 固定大小对象的slab分配器：
+ * 每次向系统申请一整块slab（objs_per_slab个对象），切分后挂到空闲链表上，
+ * 之后的分配/释放都只是空闲链表的出栈/入栈，O(1)且不调用malloc。
+ * 对象按cache line对齐，相邻对象不会共享同一个cache line。
+ *
+ * 不是线程安全的，每个线程（reactor）使用自己的slab_cache_t。
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SLAB_CACHE_LINE (64)
+
+typedef struct slab_cache
+{
+	size_t obj_size;		// rounded up to SLAB_CACHE_LINE
+	size_t objs_per_slab;
+	void * free_list;		// first word of a free object links to the next one
+	void ** slabs;
+	size_t num_slabs;
+	size_t max_slabs;
+	size_t in_use;
+	size_t high_water;
+}slab_cache_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void slab_cache_init(slab_cache_t * cache, size_t obj_size, size_t objs_per_slab)
+{
+	assert(NULL != cache && obj_size > 0 && objs_per_slab > 0);
+	memset(cache, 0, sizeof(*cache));
+	if(obj_size < sizeof(void *)) obj_size = sizeof(void *);
+	cache->obj_size = (obj_size + SLAB_CACHE_LINE - 1) & ~(size_t)(SLAB_CACHE_LINE - 1);
+	cache->objs_per_slab = objs_per_slab;
+}
+
+static inline int slab_cache_grow(slab_cache_t * cache)
+{
+	size_t i;
+	unsigned char * slab;
+	if(cache->num_slabs == cache->max_slabs)
+	{
+		size_t max_slabs = cache->max_slabs?(cache->max_slabs * 2):16;
+		void ** slabs = (void **)realloc(cache->slabs, max_slabs * sizeof(void *));
+		if(NULL == slabs) return -1;
+		cache->slabs = slabs;
+		cache->max_slabs = max_slabs;
+	}
+
+	slab = (unsigned char *)aligned_alloc(SLAB_CACHE_LINE, cache->obj_size * cache->objs_per_slab);
+	if(NULL == slab) return -1;
+	cache->slabs[cache->num_slabs++] = slab;
+
+	// 倒序入栈，使分配顺序与内存地址顺序一致
+	for(i = cache->objs_per_slab; i > 0; --i)
+	{
+		void ** obj = (void **)(slab + (i - 1) * cache->obj_size);
+		*obj = cache->free_list;
+		cache->free_list = obj;
+	}
+	return 0;
+}
+
+static inline void * slab_alloc(slab_cache_t * cache)
+{
+	void ** obj;
+	if(NULL == cache->free_list && slab_cache_grow(cache)) return NULL;
+	obj = (void **)cache->free_list;
+	cache->free_list = *obj;
+	if(++cache->in_use > cache->high_water) cache->high_water = cache->in_use;
+	return obj;
+}
+
+static inline void slab_free(slab_cache_t * cache, void * ptr)
+{
+	if(NULL == ptr) return;
+	*(void **)ptr = cache->free_list;
+	cache->free_list = ptr;
+	--cache->in_use;
+}
+
+static inline void slab_cache_destroy(slab_cache_t * cache)
+{
+	size_t i;
+	for(i = 0; i < cache->num_slabs; ++i) free(cache->slabs[i]);
+	free(cache->slabs);
+	memset(cache, 0, sizeof(*cache));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * timer_wheel.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+/* ************************
+ * 哈希时间轮 (hashed timing wheel)：
+ * 	- 到期时间按tick取模放入对应的槽，每个槽是一个双向链表，
+ * 	  添加/删除都是O(1)，与定时器的总数无关
+ * 	- 到期时间超过一圈的定时器同样放在取模后的槽中，
+ * 	  扫描到该槽时如果还没有到期，就留在原处等下一圈
+ * 	- 用位图记录非空的槽，可以快速求出下一个需要处理的槽，
+ * 	  作为epoll_wait()等的超时时间
+ *
+ * timer_node_t嵌入在使用者自己的结构体中，不需要额外分配内存。
+ * 不是线程安全的，每个reactor使用自己的时间轮。
+ * */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#define TIMER_WHEEL_SLOTS (4096)	// power of 2, multiple of 64
+
+typedef struct timer_node
+{
+	struct timer_node * next;
+	struct timer_node * prev;
+	uint64_t expire;	// absolute tick
+}timer_node_t;
+
+typedef void (* timer_callback)(timer_node_t * node, void * user_data);
+
+typedef struct timer_wheel
+{
+	timer_node_t slots[TIMER_WHEEL_SLOTS];	// list heads
+	uint64_t bitmap[TIMER_WHEEL_SLOTS / 64];	// non-empty slots
+	uint64_t tick_ms;
+	uint64_t current;	// next tick to be processed
+	size_t count;
+}timer_wheel_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void timer_node_init(timer_node_t * node)
+{
+	node->next = node->prev = NULL;
+	node->expire = 0;
+}
+
+static inline int timer_node_pending(const timer_node_t * node)
+{
+	return NULL != node->next;
+}
+
+static inline void timer_wheel_init(timer_wheel_t * wheel, uint64_t tick_ms, uint64_t now_ms)
+{
+	int i;
+	assert(tick_ms > 0);
+	memset(wheel, 0, sizeof(*wheel));
+	for(i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+	{
+		wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+	}
+	wheel->tick_ms = tick_ms;
+	wheel->current = now_ms / tick_ms;
+}
+
+static inline void timer_wheel_del(timer_wheel_t * wheel, timer_node_t * node)
+{
+	if(!timer_node_pending(node)) return;
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+
+	// 槽变空时清除位图
+	unsigned slot = (unsigned)(node->expire & (TIMER_WHEEL_SLOTS - 1));
+	if(wheel->slots[slot].next == &wheel->slots[slot])
+	{
+		wheel->bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	}
+	node->next = node->prev = NULL;
+	--wheel->count;
+}
+
+/* ************************
+ * 在 expire_ms 时刻（与now_ms同一时钟）到期，已经在时间轮中的定时器会被重新安排
+ * */
+static inline void timer_wheel_add(timer_wheel_t * wheel, timer_node_t * node, uint64_t expire_ms)
+{
+	timer_wheel_del(wheel, node);
+
+	// 向上取整到tick，保证不会提前到期
+	uint64_t expire = (expire_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	if(expire < wheel->current) expire = wheel->current;
+	node->expire = expire;
+
+	unsigned slot = (unsigned)(expire & (TIMER_WHEEL_SLOTS - 1));
+	timer_node_t * head = &wheel->slots[slot];
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+	wheel->bitmap[slot / 64] |= ((uint64_t)1 << (slot % 64));
+	++wheel->count;
+}
+
+/* ************************
+ * 处理所有在now_ms之前到期的定时器：
+ * 先把到期的节点全部摘到一个临时链表中，再逐个调用callback，
+ * callback中可以安全地重新添加或释放该节点。
+ * 返回到期的定时器个数。
+ * */
+static inline size_t timer_wheel_advance(timer_wheel_t * wheel, uint64_t now_ms, timer_callback callback, void * user_data)
+{
+	uint64_t now = now_ms / wheel->tick_ms;
+	uint64_t tick;
+	size_t expired = 0;
+	timer_node_t list;
+	list.next = list.prev = &list;
+
+	if(now < wheel->current) return 0;
+
+	// 超过一圈时只需要把每个槽扫描一遍
+	tick = wheel->current;
+	if(now - tick >= TIMER_WHEEL_SLOTS) tick = now - TIMER_WHEEL_SLOTS + 1;
+
+	for(; tick <= now && wheel->count; ++tick)
+	{
+		unsigned slot = (unsigned)(tick & (TIMER_WHEEL_SLOTS - 1));
+		if(!(wheel->bitmap[slot / 64] & ((uint64_t)1 << (slot % 64)))) continue;
+
+		timer_node_t * head = &wheel->slots[slot];
+		timer_node_t * node = head->next;
+		while(node != head)
+		{
+			timer_node_t * next = node->next;
+			if(node->expire <= now)
+			{
+				timer_wheel_del(wheel, node);
+				node->prev = list.prev;
+				node->next = &list;
+				list.prev->next = node;
+				list.prev = node;
+			}
+			node = next;
+		}
+	}
+	wheel->current = now + 1;
+
+	while(list.next != &list)
+	{
+		timer_node_t * node = list.next;
+		list.next = node->next;
+		node->next->prev = &list;
+		node->next = node->prev = NULL;
+		++expired;
+		callback(node, user_data);
+	}
+	return expired;
+}
+
+/* ************************
+ * 距离下一个非空槽的毫秒数，没有定时器时返回-1（可以直接作为epoll_wait的超时）
+ * */
+static inline int timer_wheel_next_timeout(const timer_wheel_t * wheel, uint64_t now_ms)
+{
+	unsigned i;
+	if(0 == wheel->count) return -1;
+
+	unsigned start = (unsigned)(wheel->current & (TIMER_WHEEL_SLOTS - 1));
+	uint64_t delta = TIMER_WHEEL_SLOTS - 1;	// 最多等一圈
+	for(i = 0; i <= TIMER_WHEEL_SLOTS / 64; ++i)
+	{
+		unsigned slot = (start + i * 64) & (TIMER_WHEEL_SLOTS - 1);
+		unsigned word = slot / 64;
+		uint64_t bits = wheel->bitmap[word];
+		if(0 == i) bits &= ~(uint64_t)0 << (slot % 64);	// 跳过start之前的槽
+		else if(i == TIMER_WHEEL_SLOTS / 64) bits &= ((uint64_t)1 << (start % 64)) - 1;
+		if(0 == bits) continue;
+
+		unsigned found = word * 64 + (unsigned)__builtin_ctzll(bits);
+		delta = (found - start) & (TIMER_WHEEL_SLOTS - 1);
+		break;
+	}
+
+	uint64_t expire_ms = (wheel->current + delta) * wheel->tick_ms;
+	if(expire_ms <= now_ms) return 0;
+	uint64_t timeout = expire_ms - now_ms;
+	return (timeout > 0x7fffffff)?0x7fffffff:(int)timeout;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
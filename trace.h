@@ -0,0 +1,341 @@
+/*
+ * trace.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* ************************
+ * 流量记录（echoserv -C）与回放（echoclnt -P）使用的二进制格式：
+ * 	文件头 trace_header_t，之后是定长16字节的记录 trace_record_t，都是本机字节序
+ * 	记录的时间是从开始记录起的微秒数，按时间排序，回放时两条记录的时间差就是到达间隔
+ * 	每个连接在文件内有唯一的编号：TRACE_OPEN，若干TRACE_DATA（一次读到的字节数），TRACE_CLOSE
+ * 
+ * 记录端（trace_capture_*）与alog相同：每个生产者（reactor）一个单生产者/单消费者的无锁环形缓冲区，
+ * 写记录只是取时间、拷贝16字节；后台线程每TRACE_FLUSH_MS把所有缓冲区按时间归并后成批write()，
+ * 缓冲区满时丢弃记录并计数，不阻塞reactor。
+ * 一个生产者的记录时间单调，归并以后整个文件按时间排序（两次归并之间只可能有微秒级的交错）。
+ * 
+ * 读取端（trace_map_*）把整个文件mmap进来，回放时直接读映射的内存，不解析也不复制。
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC "ECTR"
+#define TRACE_VERSION (1)
+#define TRACE_RING_SIZE (16384)	// records per producer, power of 2
+#define TRACE_FLUSH_MS (10)
+#define TRACE_OUT_RECORDS (4096)	// records per write()
+
+enum TRACE_RECORD_TYPE
+{
+	TRACE_OPEN = 1,
+	TRACE_DATA,
+	TRACE_CLOSE,
+};
+
+typedef struct trace_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+	uint64_t start_ns;		// CLOCK_REALTIME when the capture started
+}trace_header_t;
+
+typedef struct trace_record
+{
+	uint64_t time_us;		// since the capture started
+	uint32_t conn;
+	uint32_t type_size;		// type in the top 2 bits, TRACE_DATA: bytes received
+}trace_record_t;
+
+#define TRACE_TYPE_SHIFT (30)
+#define TRACE_SIZE_MAX ((1u << TRACE_TYPE_SHIFT) - 1)
+
+typedef struct trace_ring
+{
+	uint64_t dropped;	// written by the producer
+	uint64_t head __attribute__((aligned(64)));	// written by the producer
+	uint64_t tail __attribute__((aligned(64)));	// written by the background thread
+	trace_record_t records[TRACE_RING_SIZE] __attribute__((aligned(64)));
+}trace_ring_t;
+
+typedef struct trace_capture
+{
+	int fd;
+	int running;
+	int num_rings;
+	uint64_t start_ns;		// CLOCK_MONOTONIC
+	uint64_t records;		// written to the file, background thread only
+	pthread_t th;
+	trace_ring_t * rings;
+	trace_record_t out[TRACE_OUT_RECORDS];
+	size_t out_used;
+}trace_capture_t;
+
+typedef struct trace_map
+{
+	void * base;
+	size_t length;
+	const trace_header_t * header;
+	const trace_record_t * records;
+	size_t count;
+}trace_map_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline int trace_record_type(const trace_record_t * rec)
+{
+	return (int)(rec->type_size >> TRACE_TYPE_SHIFT);
+}
+
+static inline uint32_t trace_record_size(const trace_record_t * rec)
+{
+	return rec->type_size & TRACE_SIZE_MAX;
+}
+
+static inline uint64_t trace_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 生产者调用：ring是生产者自己的编号（0 ~ num_rings - 1）
+static inline void trace_capture_record(trace_capture_t * cap, int ring, int type, uint32_t conn, size_t size)
+{
+	trace_ring_t * r = &cap->rings[ring];
+	uint64_t head = r->head;
+	if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+	{
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	trace_record_t * rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+	rec->time_us = (trace_now_ns() - cap->start_ns) / 1000;
+	rec->conn = conn;
+	rec->type_size = ((uint32_t)type << TRACE_TYPE_SHIFT) | (uint32_t)((size > TRACE_SIZE_MAX)?TRACE_SIZE_MAX:size);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void trace_capture_flush(trace_capture_t * cap)
+{
+	const char * p = (const char *)cap->out;
+	size_t left = cap->out_used * sizeof(trace_record_t);
+	while(left > 0)
+	{
+		ssize_t n = write(cap->fd, p, left);
+		if(n < 0)
+		{
+			if(EINTR == errno) continue;
+			perror("trace write");
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	cap->records += cap->out_used;
+	cap->out_used = 0;
+}
+
+// 把所有缓冲区中现有的记录按时间归并输出，时间相同时按缓冲区的编号，返回记录数
+static inline size_t trace_capture_drain(trace_capture_t * cap)
+{
+	uint64_t heads[cap->num_rings];
+	size_t count = 0;
+	int i;
+	for(i = 0; i < cap->num_rings; ++i) heads[i] = __atomic_load_n(&cap->rings[i].head, __ATOMIC_ACQUIRE);
+	while(1)
+	{
+		int best = -1;
+		const trace_record_t * rec = NULL;
+		for(i = 0; i < cap->num_rings; ++i)
+		{
+			trace_ring_t * r = &cap->rings[i];
+			if(r->tail == heads[i]) continue;
+			const trace_record_t * front = &r->records[r->tail & (TRACE_RING_SIZE - 1)];
+			if(NULL == rec || front->time_us < rec->time_us)
+			{
+				best = i;
+				rec = front;
+			}
+		}
+		if(best < 0) break;
+		cap->out[cap->out_used++] = *rec;
+		__atomic_store_n(&cap->rings[best].tail, cap->rings[best].tail + 1, __ATOMIC_RELEASE);
+		if(TRACE_OUT_RECORDS == cap->out_used) trace_capture_flush(cap);
+		++count;
+	}
+	trace_capture_flush(cap);
+	return count;
+}
+
+static inline void * trace_capture_thread(void * param)
+{
+	trace_capture_t * cap = (trace_capture_t *)param;
+	struct timespec ts = {0, TRACE_FLUSH_MS * 1000000};
+	while(__atomic_load_n(&cap->running, __ATOMIC_ACQUIRE))
+	{
+		trace_capture_drain(cap);
+		nanosleep(&ts, NULL);
+	}
+	trace_capture_drain(cap);
+	return NULL;
+}
+
+/* ************************
+ * 创建（截断）path，写入文件头，启动后台线程；num_rings是生产者的个数
+ * */
+static inline int trace_capture_init(trace_capture_t * cap, const char * path, int num_rings)
+{
+	int rc;
+	trace_header_t header;
+	struct timespec ts;
+	memset(cap, 0, sizeof(*cap));
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(cap->fd < 0) return -1;
+	cap->num_rings = num_rings;
+	cap->rings = (trace_ring_t *)aligned_alloc(64, sizeof(trace_ring_t) * num_rings);
+	if(NULL == cap->rings)
+	{
+		close(cap->fd);
+		return -1;
+	}
+	memset(cap->rings, 0, sizeof(trace_ring_t) * num_rings);
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(trace_record_t);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if(write(cap->fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+	{
+		close(cap->fd);
+		free(cap->rings);
+		return -1;
+	}
+	cap->start_ns = trace_now_ns();
+	
+	// 后台线程屏蔽所有信号
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	__atomic_store_n(&cap->running, 1, __ATOMIC_RELEASE);
+	rc = pthread_create(&cap->th, NULL, trace_capture_thread, cap);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(rc)
+	{
+		close(cap->fd);
+		free(cap->rings);
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+/* ************************
+ * 写出剩下的记录并关闭文件，返回丢弃的记录数。
+ * 生产者可以仍在运行，之后的记录留在缓冲区里，不再写出；缓冲区不释放
+ * */
+static inline uint64_t trace_capture_shutdown(trace_capture_t * cap)
+{
+	uint64_t dropped = 0;
+	int i;
+	if(!__atomic_load_n(&cap->running, __ATOMIC_ACQUIRE)) return 0;
+	__atomic_store_n(&cap->running, 0, __ATOMIC_RELEASE);
+	pthread_join(cap->th, NULL);
+	close(cap->fd);
+	cap->fd = -1;
+	for(i = 0; i < cap->num_rings; ++i) dropped += __atomic_load_n(&cap->rings[i].dropped, __ATOMIC_RELAXED);
+	return dropped;
+}
+
+/* ************************
+ * 只读映射一个记录文件，结尾不完整的记录被忽略
+ * */
+static inline int trace_map_open(trace_map_t * map, const char * path)
+{
+	struct stat st;
+	memset(map, 0, sizeof(*map));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(trace_header_t))
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map->length = (size_t)st.st_size;
+	map->base = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == map->base)
+	{
+		map->base = NULL;
+		return -1;
+	}
+	map->header = (const trace_header_t *)map->base;
+	if(memcmp(map->header->magic, TRACE_MAGIC, sizeof(map->header->magic)) 
+		|| TRACE_VERSION != map->header->version
+		|| sizeof(trace_record_t) != map->header->record_size)
+	{
+		munmap(map->base, map->length);
+		map->base = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	map->records = (const trace_record_t *)(map->header + 1);
+	map->count = (map->length - sizeof(trace_header_t)) / sizeof(trace_record_t);
+	madvise(map->base, map->length, MADV_SEQUENTIAL);
+	return 0;
+}
+
+static inline void trace_map_close(trace_map_t * map)
+{
+	if(map->base) munmap(map->base, map->length);
+	memset(map, 0, sizeof(*map));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * transport.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+/* ************************
+ * 传输层地址，echoserv的 -L 和 echoclnt 共用同一种写法：
+ * 	tcp                  127.0.0.1和默认端口
+ * 	tcp:PORT
+ * 	tcp:HOST:PORT
+ * 	unix:PATH            AF_UNIX SOCK_STREAM
+ * 	unix:@NAME           Linux abstract namespace，不在文件系统中创建文件
+ * 	seqpacket:PATH       AF_UNIX SOCK_SEQPACKET，保留消息边界
+ * 	seqpacket:@NAME
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+typedef struct transport_addr
+{
+	int family;		// AF_UNSPEC (tcp, resolved with getaddrinfo()) or AF_UNIX
+	int socktype;	// SOCK_STREAM or SOCK_SEQPACKET
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	struct sockaddr_un un;
+	socklen_t un_len;
+}transport_addr_t;
+
+#define TRANSPORT_NAME_MAX (16 + NI_MAXHOST + NI_MAXSERV)	// transport_addr_name()
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline int transport_addr_parse(transport_addr_t * addr, const char * spec, 
+	const char * default_host, const char * default_port)
+{
+	const char * path = NULL;
+	memset(addr, 0, sizeof(*addr));
+	addr->socktype = SOCK_STREAM;
+	if(0 == strncmp(spec, "unix:", 5)) path = spec + 5;
+	else if(0 == strncmp(spec, "seqpacket:", 10))
+	{
+		path = spec + 10;
+		addr->socktype = SOCK_SEQPACKET;
+	}
+	
+	if(NULL == path)
+	{
+		const char * colon;
+		if(0 == strcmp(spec, "tcp")) spec = "";
+		else if(0 == strncmp(spec, "tcp:", 4)) spec += 4;
+		else return -1;
+		
+		addr->family = AF_UNSPEC;
+		colon = strrchr(spec, ':');
+		if(colon)
+		{
+			if((size_t)(colon - spec) >= sizeof(addr->host)) return -1;
+			memcpy(addr->host, spec, colon - spec);
+			spec = colon + 1;
+		}else snprintf(addr->host, sizeof(addr->host), "%s", default_host);
+		snprintf(addr->port, sizeof(addr->port), "%s", *spec?spec:default_port);
+		return 0;
+	}
+	
+	// 抽象地址以'\0'开头，长度只算到名字结尾，不包括末尾的'\0'
+	size_t len = strlen(path);
+	if(0 == len || len >= sizeof(addr->un.sun_path)) return -1;
+	addr->family = AF_UNIX;
+	addr->un.sun_family = AF_UNIX;
+	memcpy(addr->un.sun_path, path, len);
+	if('@' == path[0]) addr->un.sun_path[0] = '\0';
+	else ++len;
+	addr->un_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+	return 0;
+}
+
+static inline int transport_addr_is_abstract(const transport_addr_t * addr)
+{
+	return AF_UNIX == addr->family && '\0' == addr->un.sun_path[0];
+}
+
+// 按原来的写法输出，用于日志和统计
+static inline const char * transport_addr_name(const transport_addr_t * addr, char * buf, size_t size)
+{
+	if(AF_UNIX != addr->family)
+	{
+		snprintf(buf, size, "tcp:%s:%s", addr->host, addr->port);
+		return buf;
+	}
+	snprintf(buf, size, "%s:%s%.*s", (SOCK_SEQPACKET == addr->socktype)?"seqpacket":"unix",
+		transport_addr_is_abstract(addr)?"@":"",
+		(int)(addr->un_len - offsetof(struct sockaddr_un, sun_path)) - (transport_addr_is_abstract(addr)?1:0),
+		addr->un.sun_path + (transport_addr_is_abstract(addr)?1:0));
+	return buf;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,374 @@
+/*
+ * uring.h
+ *
+ * Copyright 2016 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+/* ************************
+ * 直接基于io_uring系统调用的最小封装（不依赖liburing），
+ * 只提供echoserv用到的功能：SQ/CQ环、以及provided buffer ring。
+ *
+ * 每个uring_t只能被一个线程使用。
+ * */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <assert.h>
+
+typedef struct uring
+{
+	int fd;
+	unsigned flags;		// IORING_SETUP_*
+
+	// submission queue
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;		// local tail, published by uring_submit()
+	unsigned to_submit;
+	struct io_uring_sqe * sqes;
+
+	// completion queue
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+}uring_t;
+
+typedef struct uring_buf_ring
+{
+	struct io_uring_buf_ring * br;
+	size_t ring_size;
+	unsigned entries;	// power of 2
+	uint16_t tail;		// local tail, published by uring_buf_ring_commit()
+	uint16_t bgid;
+	size_t buf_size;
+	unsigned char * base;	// entries * buf_size bytes
+}uring_buf_ring_t;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void uring_cleanup(uring_t * ring);
+
+static inline int uring_init(uring_t * ring, unsigned entries, unsigned cq_entries, unsigned flags)
+{
+	struct io_uring_params params;
+	assert(NULL != ring);
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	params.flags = flags;
+	if(cq_entries)
+	{
+		params.flags |= IORING_SETUP_CQSIZE;
+		params.cq_entries = cq_entries;
+	}
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) return -1;
+	ring->flags = params.flags;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(MAP_FAILED == ring->sq_ring) goto label_err;
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ring = ring->sq_ring;
+	}else
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(MAP_FAILED == ring->cq_ring)
+		{
+			ring->cq_ring = NULL;
+			goto label_err;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(MAP_FAILED == ring->sqes)
+	{
+		ring->sqes = NULL;
+		goto label_err;
+	}
+
+	unsigned char * sq = (unsigned char *)ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+	ring->sqe_tail = *ring->sq_tail;
+
+	unsigned char * cq = (unsigned char *)ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// sq_array与sqes一一对应，之后就不用再修改了
+	unsigned i;
+	for(i = 0; i < ring->sq_entries; ++i) ring->sq_array[i] = i;
+	return 0;
+
+label_err:
+	uring_cleanup(ring);
+	return -1;
+}
+
+static inline void uring_cleanup(uring_t * ring)
+{
+	if(ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	if(ring->sq_ring && MAP_FAILED != ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+	if(ring->fd >= 0) close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+static inline int uring_enter(uring_t * ring, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* ************************
+ * 把本地累积的sqe发布给内核，并等待至少wait_nr个完成事件
+ * */
+static inline int uring_submit_and_wait(uring_t * ring, unsigned wait_nr)
+{
+	int rc;
+	unsigned flags = 0;
+	unsigned to_submit = ring->to_submit;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	if(wait_nr || (ring->flags & IORING_SETUP_DEFER_TASKRUN)) flags |= IORING_ENTER_GETEVENTS;
+
+	rc = uring_enter(ring, to_submit, wait_nr, flags);
+	if(rc >= 0)
+	{
+		ring->to_submit -= ((unsigned)rc < to_submit)?(unsigned)rc:to_submit;
+	}
+	return rc;
+}
+
+static inline int uring_submit(uring_t * ring)
+{
+	return uring_submit_and_wait(ring, 0);
+}
+
+/* ************************
+ * 与uring_submit_and_wait()相同，但最多等待timeout_ms毫秒 (IORING_FEAT_EXT_ARG, 5.11+)，
+ * timeout_ms < 0 时一直等待
+ * */
+static inline int uring_submit_and_wait_timeout(uring_t * ring, unsigned wait_nr, int timeout_ms)
+{
+	int rc;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned to_submit = ring->to_submit;
+
+	if(timeout_ms < 0) return uring_submit_and_wait(ring, wait_nr);
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (unsigned long)&ts;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	rc = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if(rc >= 0)
+	{
+		ring->to_submit -= ((unsigned)rc < to_submit)?(unsigned)rc:to_submit;
+	}else if(ETIME == errno)
+	{
+		// 超时，但sqe已经全部提交
+		ring->to_submit = 0;
+	}
+	return rc;
+}
+
+// SQ中还能取得的sqe个数
+static inline unsigned uring_sq_space(uring_t * ring)
+{
+	return ring->sq_entries - (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* ************************
+ * 取得一个空闲的sqe，SQ已满时先提交一次
+ * */
+static inline struct io_uring_sqe * uring_get_sqe(uring_t * ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if((ring->sqe_tail - head) >= ring->sq_entries)
+	{
+		if(uring_submit(ring) < 0) return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if((ring->sqe_tail - head) >= ring->sq_entries) return NULL;
+	}
+
+	struct io_uring_sqe * sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	++ring->sqe_tail;
+	++ring->to_submit;
+	return sqe;
+}
+
+static inline struct io_uring_cqe * uring_peek_cqe(uring_t * ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if(head == tail) return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t * ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* ************************
+ * provided buffer ring (IORING_REGISTER_PBUF_RING, kernel 5.19+)：
+ * 由内核在数据到达时再挑选接收缓冲区，
+ * 不必为每个连接预先准备一块接收缓冲区。
+ * */
+static inline int uring_buf_ring_setup(uring_t * ring, uring_buf_ring_t * bufs,
+	unsigned entries, size_t buf_size, uint16_t bgid)
+{
+	int rc;
+	unsigned i;
+	assert(entries && 0 == (entries & (entries - 1)) && entries <= 32768);
+	memset(bufs, 0, sizeof(*bufs));
+
+	bufs->entries = entries;
+	bufs->bgid = bgid;
+	bufs->buf_size = buf_size;
+	bufs->ring_size = entries * sizeof(struct io_uring_buf);
+	bufs->br = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == bufs->br)
+	{
+		bufs->br = NULL;
+		return -1;
+	}
+	bufs->base = mmap(NULL, entries * buf_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == bufs->base)
+	{
+		bufs->base = NULL;
+		munmap(bufs->br, bufs->ring_size);
+		bufs->br = NULL;
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)bufs->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	rc = (int)syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if(rc < 0)
+	{
+		munmap(bufs->base, entries * buf_size);
+		munmap(bufs->br, bufs->ring_size);
+		memset(bufs, 0, sizeof(*bufs));
+		return -1;
+	}
+
+	for(i = 0; i < entries; ++i)
+	{
+		struct io_uring_buf * buf = &bufs->br->bufs[(bufs->tail + i) & (entries - 1)];
+		buf->addr = (unsigned long)(bufs->base + i * buf_size);
+		buf->len = (unsigned)buf_size;
+		buf->bid = (uint16_t)i;
+	}
+	bufs->tail += entries;
+	__atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline void uring_buf_ring_cleanup(uring_buf_ring_t * bufs)
+{
+	if(bufs->base) munmap(bufs->base, bufs->entries * bufs->buf_size);
+	if(bufs->br) munmap(bufs->br, bufs->ring_size);
+	memset(bufs, 0, sizeof(*bufs));
+}
+
+static inline unsigned char * uring_buf_ring_addr(uring_buf_ring_t * bufs, unsigned bid)
+{
+	return bufs->base + (size_t)bid * bufs->buf_size;
+}
+
+// 把缓冲区还给内核，需要调用uring_buf_ring_commit()后才生效
+static inline void uring_buf_ring_add(uring_buf_ring_t * bufs, unsigned bid)
+{
+	struct io_uring_buf * buf = &bufs->br->bufs[bufs->tail & (bufs->entries - 1)];
+	buf->addr = (unsigned long)uring_buf_ring_addr(bufs, bid);
+	buf->len = (unsigned)bufs->buf_size;
+	buf->bid = (uint16_t)bid;
+	++bufs->tail;
+}
+
+static inline void uring_buf_ring_commit(uring_buf_ring_t * bufs)
+{
+	__atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -48,6 +48,7 @@
 #include <termios.h>
 
 #include "visca.h"
+#include "../alog.h"
 
 #define MAX_DEVICES_COUNT (8)
 
@@ -82,6 +83,9 @@ int main(int argc, char **argv)
 	const char * pts_name = "/dev/pts/3";
 	if(argc > 1) pts_name = argv[1];
 	
+	// 日志由后台线程输出到stderr，级别由环境变量ALOG_LEVEL指定（默认info）
+	if(alog_init(STDERR_FILENO, ALOG_INFO)) perror("alog_init");
+	
 	fds = open(pts_name, O_RDWR);
 	if(fds < 0) 
 	{
@@ -173,6 +177,7 @@ int main(int argc, char **argv)
 		}
 		
 	}
+	alog_shutdown();
 	return 0;
 }
 
@@ -268,7 +273,7 @@ static int parse_command(const char * cmd, size_t length)
 
 static int parse_message(int fds, const unsigned char * data, size_t length)
 {
-	printf("receive message length: %d\n", (int)length);
+	alog_debug("receive message length: %d", (int)length);
 	static visca_buffer_t vbuf = {{0}};	
 	visca_packet_t packet;
 	
@@ -285,14 +290,14 @@ static int parse_message(int fds, const unsigned char * data, size_t length)
 		rc = visca_buffer_append(&vbuf, data, length);
 		if(rc != VISCA_SUCCESS)
 		{
-			fprintf(stderr, "visca_buffer_append failed with errcode = %d\n", rc);
+			alog_error("visca_buffer_append failed with errcode = %d", rc);
 			return 1;
 		}
 	}
 	while(visca_buffer_get_packet(&vbuf, &packet) == VISCA_SUCCESS)
 	{
 		// parse packet
-		visca_packet_dump2(STDOUT_FILENO, &packet);
+		alog_hexdump(ALOG_INFO, packet.data, packet.length, "packet");
 		
 		if(!reply) continue;
 		
@@ -300,7 +305,7 @@ static int parse_message(int fds, const unsigned char * data, size_t length)
 		rc = poll(pfd, 1, 1000);
 		if(rc < 0)
 		{
-			if(EAGAIN == errno) fprintf(stderr, "timeout\n");
+			if(EAGAIN == errno) alog_warn("timeout");
 			else 
 			{
 				perror("poll");
@@ -313,7 +318,7 @@ static int parse_message(int fds, const unsigned char * data, size_t length)
 		}
 		else if(pfd[0].revents & POLLHUP)
 		{
-			fprintf(stderr, "peer device hungup.\n");
+			alog_warn("peer device hungup.");
 			usleep(100000);			
 		}
 	}
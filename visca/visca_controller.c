@@ -48,6 +48,7 @@
 #include <termios.h>
 
 #include "visca.h"
+#include "../alog.h"
 
 //最多支持 1（控制端） + 7（虚拟相机）= 8 个设备
 #define MAX_DEVICES_COUNT (8)
@@ -85,6 +86,9 @@ int main(int argc, char **argv)
 	//~ test();
 	//~ return 0;
 	
+	// 日志由后台线程输出到stderr，级别由环境变量ALOG_LEVEL指定（默认info）
+	if(alog_init(STDERR_FILENO, ALOG_INFO)) perror("alog_init");
+	
 	// 初始化控制器
 	int fdm = init_controller(camera_count);
 	if(fdm <= 0) return 1;
@@ -92,6 +96,7 @@ int main(int argc, char **argv)
 	// 侦听客户端命令
 	rc = run();
 	
+	alog_shutdown();
 	return rc;
 }
 
@@ -201,6 +206,7 @@ static void * controller_thread(void * param)
 	pthread_t tcam[MAX_DEVICES_COUNT - 1];
 	void * exit_code = NULL;
 	
+	alog_set_thread_name("controller");
 	// 创建7个线程来模拟7个相机设备
 	for(i = 0; i < (MAX_DEVICES_COUNT - 1); ++i)
 	{
@@ -252,13 +258,13 @@ static void * controller_thread(void * param)
 		{
 			if(pfd[i].fd < 0)
 			{
-				printf("unavailable device %d\n", i);
+				alog_trace("unavailable device %d", i);
 				continue;
 			}
 			
 			if(pfd[i].revents & POLLIN)
 			{
-				printf("message ready on [%d]\n", i);
+				alog_debug("message ready on [%d]", i);
 				rc = read(pfd[i].fd, input, sizeof(input) - 1);
 				if(rc > 0)
 				{
@@ -290,11 +296,11 @@ static void * controller_thread(void * param)
 						
 					}else if(i == 0) // 发送到主控制器的命令
 					{
-						printf("message reached to master[%d]: length = %d\n", i, rc);
+						alog_debug("message reached to master[%d]: length = %d", i, rc);
 						controller_proc(0, input, rc);						
 					}else
 					{								
-						printf("notify from device [%d]: length = %d\n", i, rc);						
+						alog_debug("notify from device [%d]: length = %d", i, rc);						
 						controller_proc(i, input, rc);		
 					}
 				}else if(rc < 0)
@@ -349,6 +355,10 @@ static void * camera_thread(void * param)
 	if(id < 1 || id > 7) pthread_exit((void *)(long)-1);
 	int rc;
 	volatile int fds;
+	char name[16];
+	
+	snprintf(name, sizeof(name), "camera-%d", (int)id);
+	alog_set_thread_name(name);
 	
 	// 如果初始化主控制器时没有选择打开对应的相机端口，
 	// 那么在相机线程中打开
@@ -405,7 +415,7 @@ static void * camera_thread(void * param)
 			}else if(rc < 0)
 			{
 				// hangup
-				fprintf(stderr, "slave [%d] hangup...\n", (int)id);
+				alog_warn("slave [%d] hangup...", (int)id);
 				pthread_exit((void *)id);
 			}
 		}else if(pfd[0].revents & POLLHUP)
@@ -415,7 +425,7 @@ static void * camera_thread(void * param)
 		}
 		
 	}
-	printf("camera [%d] shutdown successfully.\n", (int)id);
+	alog_info("camera [%d] shutdown successfully.", (int)id);
 	pthread_exit((void *)0);
 }
 
@@ -430,7 +440,7 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 	int dst_device = 0;
 	if(id < 0 || id >= MAX_DEVICES_COUNT) 
 	{
-		fprintf(stderr, "invalid device id\n");
+		alog_error("invalid device id");
 		return 1;
 	}
 	
@@ -448,7 +458,7 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 			rc = visca_buffer_append(&vbuf, data, length);
 			if(rc != VISCA_SUCCESS)
 			{
-				fprintf(stderr, "visca_buffer_append failed with errcode = %d\n", rc);
+				alog_error("visca_buffer_append failed with errcode = %d", rc);
 				return 1;
 			}
 		}
@@ -465,10 +475,10 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 			rc = poll(pfd, 1, 1000);
 			if(rc < 0)
 			{
-				if(EAGAIN == errno) fprintf(stderr, "timeout\n");
+				if(EAGAIN == errno) alog_warn("timeout");
 				else 
 				{
-					perror("poll");
+					alog_error("poll: %s", strerror(errno));
 					return 1;
 				}
 			}
@@ -480,7 +490,7 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 			}
 			else if(pfd[0].revents & POLLHUP)
 			{
-				fprintf(stderr, "peer device hungup.\n");
+				alog_warn("peer device hungup.");
 				usleep(100000);			
 			}
 		}
@@ -492,12 +502,12 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 			rc = visca_buffer_append(&vbuf, data, length);
 			if(rc != VISCA_SUCCESS)
 			{
-				fprintf(stderr, "visca_buffer_append failed with errcode = %d\n", rc);
+				alog_error("visca_buffer_append failed with errcode = %d", rc);
 				return 1;
 			}
 		}
 		
-		printf("reveive msg from device: %d\n", id);
+		alog_debug("reveive msg from device: %d", id);
 		
 		while(visca_buffer_get_packet(&vbuf, &packet) == VISCA_SUCCESS)
 		{
@@ -506,29 +516,29 @@ static int controller_proc(int id, const unsigned char * data, size_t length)
 			// 受到对应设备返回的消息后，不做任何处理，直接写回主控制器0
 			dst_device = 0;
 			
-			visca_packet_dump2(STDOUT_FILENO, &packet);
+			alog_hexdump(ALOG_INFO, packet.data, packet.length, "packet from camera %d", id);
 			
 			pfd[0].fd = g_ptm[dst_device];
 			rc = poll(pfd, 1, 1000);
 			if(rc < 0)
 			{
-				if(EAGAIN == errno) fprintf(stderr, "timeout\n");
+				if(EAGAIN == errno) alog_warn("timeout");
 				else 
 				{
-					perror("poll");
+					alog_error("poll: %s", strerror(errno));
 					return 1;
 				}
 			}
 			if(pfd[0].revents & POLLOUT)
 			{
-				printf("receive camera %d response: %d bytes.\n", id, (int)packet.length);
+				alog_debug("receive camera %d response: %d bytes.", id, (int)packet.length);
 				
 				write(pfd[0].fd, packet.data, packet.length);
 				//~ write(pfd[0].fd, packet.data, packet.length);
 			}
 			else if(pfd[0].revents & POLLHUP)
 			{
-				fprintf(stderr, "peer device hungup.\n");
+				alog_warn("peer device hungup.");
 				usleep(100000);	
 			}
 		}
@@ -559,7 +569,7 @@ static int camera_proc(int address, const unsigned char * data, size_t length)
 		rc = visca_buffer_append(&vbuf, data, length);
 		if(rc != VISCA_SUCCESS)
 		{
-			fprintf(stderr, "visca_buffer_append failed with errcode = %d\n", rc);
+			alog_error("visca_buffer_append failed with errcode = %d", rc);
 			return 1;
 		}
 	}
@@ -570,10 +580,10 @@ static int camera_proc(int address, const unsigned char * data, size_t length)
 		rc = poll(pfd, 1, 1000);
 		if(rc < 0)
 		{
-			if(EAGAIN == errno) fprintf(stderr, "timeout\n");
+			if(EAGAIN == errno) alog_warn("timeout");
 			else 
 			{
-				perror("poll");
+				alog_error("poll: %s", strerror(errno));
 				return 1;
 			}
 		}
@@ -583,7 +593,7 @@ static int camera_proc(int address, const unsigned char * data, size_t length)
 		}
 		else if(pfd[0].revents & POLLHUP)
 		{
-			fprintf(stderr, "peer device hungup.\n");
+			alog_warn("peer device hungup.");
 			usleep(100000);			
 		}
 	}